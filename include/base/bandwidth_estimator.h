@@ -0,0 +1,98 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_BANDWIDTH_ESTIMATOR_
+#define NES_BASE_BANDWIDTH_ESTIMATOR_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+
+#include "nes.pb.h"
+
+// BandwidthEstimator turns the ClientFeedback of the clients of a session into
+// the bitrate the session should encode at. Each client has its own estimate,
+// adjusted on every report with additive-increase multiplicative-decrease:
+// a report showing congestion (dropped frames, a round trip time growing
+// above the lowest seen, or frames taking longer to decode than to play)
+// cuts the estimate below the rate the client actually received, while a
+// report showing the client keeping up raises it by kIncreaseFactor. The
+// target of the session is the estimate of its slowest client, so one
+// encoder output suits every client sharing it. Thread safe.
+class BandwidthEstimator {
+ public:
+  // Bounds of the target, in bits per second for all streams of a session.
+  struct Options {
+    unsigned min_bit_rate = 200000;
+    unsigned max_bit_rate = 50000000;
+  };
+
+  // Estimate kept on a congested report, relative to the received rate.
+  static constexpr double kDecreaseFactor = 0.85;
+
+  // Growth of the estimate on a report without congestion.
+  static constexpr double kIncreaseFactor = 1.05;
+
+  // The estimate only grows while the client receives at least this share of
+  // it; a client that does not use the bitrate gives no evidence for more.
+  static constexpr double kMinUtilization = 0.8;
+
+  // Round trip time above the lowest one seen by this much (relative, then
+  // absolute) is taken as queueing on the path.
+  static constexpr double kRttGrowthFactor = 1.25;
+  static constexpr std::chrono::milliseconds kRttGrowthSlack{20};
+
+  // Clients that have not reported for this long are not considered.
+  static constexpr std::chrono::seconds kClientTimeout{5};
+
+  // The target is only changed by at least this share, so the encoders are
+  // not reconfigured for every small step.
+  static constexpr double kMinChange = 0.05;
+
+  // initial_bit_rate is the target until the first report. frame_interval is
+  // the time a frame is shown, the longest decode time the client can afford.
+  BandwidthEstimator(Options options, unsigned initial_bit_rate,
+                     std::chrono::microseconds frame_interval);
+
+  // Record a report of client, any value identifying it such as its
+  // connection. Returns the new target if it changed.
+  std::optional<unsigned> report(const void *client,
+                                 const nesproto::ClientFeedback &feedback);
+
+  // Stop considering a client, e.g. when it disconnects. Returns the new
+  // target if it changed.
+  std::optional<unsigned> forget(const void *client);
+
+  // Start over from bit_rate, e.g. when it is set by hand. The reports of
+  // the clients adapt it from there.
+  void reset(unsigned bit_rate);
+
+  inline unsigned target() {
+    std::scoped_lock lock{m_mutex};
+    return m_target;
+  }
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  struct ClientState {
+    double estimate;
+    double min_rtt_ms = 0;
+    clock::time_point last_report;
+  };
+
+  const Options m_options;
+  const std::chrono::microseconds m_frame_interval;
+  std::mutex m_mutex;
+  std::map<const void *, ClientState> m_clients;
+  unsigned m_target;
+
+  double clamp(double bit_rate) const;
+
+  // Move the target to the estimate of the slowest recent client. Returns
+  // the new target if it changed. Must hold m_mutex.
+  std::optional<unsigned> update_target(clock::time_point now);
+};
+
+#endif  // NES_BASE_BANDWIDTH_ESTIMATOR_
@@ -3,14 +3,40 @@
 #ifndef NES_BASE_CAMERA_MANAGER_
 #define NES_BASE_CAMERA_MANAGER_
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
 
+#include "base/capture.h"
+#include "base/seqlock.h"
+#include "base/video/stereo_packing.h"
 #include "base/video/type_managers.h"
 #include "nes.pb.h"
 
+// Camera data used to request a frame. It is a fixed size POD so that it can
+// be published through a SeqLock without copying a protobuf object.
+struct CameraState {
+  static constexpr int kMatrixSize = 12;
+
+  float matrix[kMatrixSize];
+  std::uint32_t width;
+  std::uint32_t height;
+  // steady_clock time the camera was received, in nanoseconds.
+  std::int64_t timestamp_ns;
+  // Set by the client; see nesproto::Camera.
+  std::uint64_t pose_id;
+  std::int64_t client_timestamp;
+
+  // Fill a nesproto::Camera with the state.
+  void to_proto(bool is_left, nesproto::Camera *camera) const;
+};
+
 // CameraManager handles camera matrix used for rendering a frame. It accepts a
 // user position converted to a camera matrix, stores it internally, and
-// provides it when a FrameRequest is generated.
+// provides it when a FrameRequest is generated. Cameras are written by the io
+// threads and read by the renderer threads at a high rate, so they are stored
+// in a SeqLock: readers always get a consistent snapshot and never wait for a
+// writer. Writers of an eye are serialized by the mutex of the eye.
 class CameraManager {
  public:
   // Initial camera matrix set to the initial coordinate (0, 0, 0) and field of
@@ -19,28 +45,57 @@ class CameraManager {
       1.0f, 0.0f, 0.0f, 0.5f, 0.0f, -1.0f, 0.0f, 0.5f, 0.0f, 0.0f, -1.0f, 0.5f};
 
   // Initialize Camera with kInitialCameraMatrix and provided default
-  // dimensions.
+  // dimensions. With a StereoLayout, both eyes share the encoders, whose
+  // resolution is that of the packed frames.
   CameraManager(std::shared_ptr<types::AVCodecContextManager> codec_scene_left,
                 std::shared_ptr<types::AVCodecContextManager> codec_depth_left,
                 std::shared_ptr<types::AVCodecContextManager> codec_scene_right,
                 std::shared_ptr<types::AVCodecContextManager> codec_depth_right,
-                uint32_t default_width, uint32_t default_height);
+                uint32_t default_width, uint32_t default_height,
+                StereoLayout layout = StereoLayout::NONE);
 
   // Replace camera with the provided camera data. If the resolution has
-  // changed, reinitialize the encoder.
-  void set_camera_left(nesproto::Camera camera);
-  void set_camera_right(nesproto::Camera camera);
+  // changed, the encoders of the eye start opening encoders for it in the
+  // background; see AVCodecContextManager::change_resolution().
+  void set_camera_left(const nesproto::Camera &camera);
+  void set_camera_right(const nesproto::Camera &camera);
 
-  inline nesproto::Camera get_camera_left() const { return m_camera_left; }
-  inline nesproto::Camera get_camera_right() const { return m_camera_right; }
+  // Replace the camera of the eye selected by camera.is_left().
+  inline void set_camera(const nesproto::Camera &camera) {
+    if (camera.is_left()) {
+      set_camera_left(camera);
+    } else {
+      set_camera_right(camera);
+    }
+  }
+
+  // Record every camera received from now on to capture. Must be called
+  // before the cameras are set by the servers.
+  inline void set_capture(std::shared_ptr<CaptureWriter> capture) {
+    m_capture = capture;
+  }
+
+  inline CameraState get_camera_left() const { return m_camera_left.load(); }
+  inline CameraState get_camera_right() const { return m_camera_right.load(); }
 
  private:
-  nesproto::Camera m_camera_left;
-  nesproto::Camera m_camera_right;
+  SeqLock<CameraState> m_camera_left;
+  SeqLock<CameraState> m_camera_right;
+  std::mutex m_writer_mutex_left;
+  std::mutex m_writer_mutex_right;
   std::shared_ptr<types::AVCodecContextManager> m_codec_scene_left;
   std::shared_ptr<types::AVCodecContextManager> m_codec_depth_left;
   std::shared_ptr<types::AVCodecContextManager> m_codec_scene_right;
   std::shared_ptr<types::AVCodecContextManager> m_codec_depth_right;
+  std::shared_ptr<CaptureWriter> m_capture;
+  StereoLayout m_layout;
+
+  // Apply camera to the stored state of an eye, requesting new encoders for
+  // the eye if the resolution has changed.
+  void update_camera(const nesproto::Camera &camera,
+                     SeqLock<CameraState> &state, std::mutex &writer_mutex,
+                     types::AVCodecContextManager &codec_scene,
+                     types::AVCodecContextManager &codec_depth);
 };
 
 #endif  // NES_BASE_CAMERA_MANAGER_
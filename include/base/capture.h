@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_CAPTURE_
+#define NES_BASE_CAPTURE_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "nes.pb.h"
+
+// A capture file records the input of a session so that it can be replayed
+// without a renderer: the cameras received from the client and the frames
+// received from the renderers, each with the steady_clock time it arrived.
+//
+// Layout, in native byte order:
+//   CaptureHeader
+//   the payload of every record, back to back
+//   the CaptureRecord of every record in arrival order (the index)
+// The header points to the index, which is written when the capture is
+// closed. Payloads are serialized nesproto::Camera and nesproto::RenderedFrame
+// messages; a frame is stored as it was received from the renderer.
+
+struct CaptureRecord {
+  enum Type : std::uint32_t { TYPE_CAMERA = 1, TYPE_FRAME = 2 };
+
+  std::int64_t timestamp_ns;
+  // Position of the payload from the beginning of the file.
+  std::uint64_t offset;
+  std::uint64_t size;
+  std::uint32_t type;
+  std::uint32_t is_left;
+};
+static_assert(sizeof(CaptureRecord) == 32);
+
+struct CaptureHeader {
+  static constexpr char kMagic[8] = {'N', 'E', 'S', 'C', 'A', 'P', '0', '1'};
+
+  char magic[8];
+  // 0 until the capture is closed.
+  std::uint64_t index_offset;
+  std::uint64_t record_count;
+};
+static_assert(sizeof(CaptureHeader) == 24);
+
+// CaptureWriter appends records to a capture file. It is shared by the io
+// threads writing cameras and the renderer threads writing frames, which are
+// serialized by a mutex.
+class CaptureWriter {
+ public:
+  // Create or truncate the file at path. Throws std::runtime_error on failure.
+  explicit CaptureWriter(const std::string &path);
+
+  // Close the capture if it is still open.
+  ~CaptureWriter();
+
+  void write_camera(const nesproto::Camera &camera, std::int64_t timestamp_ns);
+
+  // payload is a serialized nesproto::RenderedFrame.
+  void write_frame(const std::string &payload, bool is_left,
+                   std::int64_t timestamp_ns);
+
+  // Write the index and the header. Records written afterwards are dropped.
+  void close();
+
+ private:
+  std::string m_path;
+  std::mutex m_mutex;
+  std::ofstream m_file;
+  std::uint64_t m_offset;
+  std::vector<CaptureRecord> m_index;
+  bool m_closed = false;
+
+  void append(CaptureRecord::Type type, bool is_left, const char *data,
+              std::size_t size, std::int64_t timestamp_ns);
+};
+
+// CaptureReader maps a closed capture file into memory. Payloads are returned
+// as views of the mapping, so replaying a capture costs no read() calls or
+// copies besides parsing.
+class CaptureReader {
+ public:
+  // Map the file at path and validate its index. Throws std::runtime_error if
+  // the file cannot be mapped or is not a closed capture.
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+
+  inline std::size_t size() const { return m_record_count; }
+
+  inline const CaptureRecord &record(std::size_t i) const {
+    return m_index[i];
+  }
+
+  inline std::string_view payload(std::size_t i) const {
+    return {m_data + m_index[i].offset, m_index[i].size};
+  }
+
+ private:
+  const char *m_data = nullptr;
+  std::size_t m_length = 0;
+  const CaptureRecord *m_index = nullptr;
+  std::size_t m_record_count = 0;
+};
+
+#endif  // NES_BASE_CAPTURE_
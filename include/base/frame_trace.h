@@ -0,0 +1,56 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_FRAME_TRACE_
+#define NES_BASE_FRAME_TRACE_
+
+#include <chrono>
+#include <cstdint>
+
+#include "nes.pb.h"
+
+// FrameTrace records when a frame went through each stage of the pipeline, in
+// nanoseconds of steady_clock. A stage that is unknown is 0. The trace is
+// created with the request, travels with the RenderedFrame and the encoder,
+// and is sent with the packet that carries the frame.
+struct FrameTrace {
+  std::uint64_t frame_index = 0;
+  // The frame shows the scene at this time: when it was rendered, or when it
+  // was recorded for a replayed frame. The pts of its packets is derived from
+  // it; 0 stands for the time the frame is sent to the encoder.
+  std::int64_t frame_time = 0;
+  // The camera used for the request was received from the client.
+  std::int64_t pose_received = 0;
+  // The request was sent to a renderer.
+  std::int64_t request_sent = 0;
+  // The rendered frame was received from the renderer.
+  std::int64_t render_received = 0;
+  // Overlays were drawn and the frame was converted.
+  std::int64_t processed = 0;
+  // The frame was sent to the encoder.
+  std::int64_t encoder_in = 0;
+  // The packet was received from the encoder.
+  std::int64_t packet_out = 0;
+  // Identify the pose of the camera for the client, in the clock of the
+  // client; see nesproto::Camera. They are sent in the PacketMetadata.
+  std::uint64_t pose_id = 0;
+  std::int64_t client_timestamp = 0;
+
+  // Current time in the clock of the trace.
+  static inline std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Fill a nesproto::FrameTrace with the trace.
+  inline void to_proto(nesproto::FrameTrace *trace) const {
+    trace->set_pose_received(pose_received);
+    trace->set_request_sent(request_sent);
+    trace->set_render_received(render_received);
+    trace->set_processed(processed);
+    trace->set_encoder_in(encoder_in);
+    trace->set_packet_out(packet_out);
+  }
+};
+
+#endif  // NES_BASE_FRAME_TRACE_
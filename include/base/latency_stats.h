@@ -0,0 +1,76 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_LATENCY_STATS_
+#define NES_BASE_LATENCY_STATS_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/frame_trace.h"
+#include "base/metrics.h"
+
+// LatencyStats aggregates the FrameTrace of every packet into per-stage
+// latency samples and reports their percentiles. Each stage keeps the most
+// recent kWindowSize samples for the logs, and every sample is also recorded
+// to the nes_frame_latency_seconds histogram of the global MetricsRegistry.
+class LatencyStats {
+ public:
+  // Latency between two consecutive stages of FrameTrace, and the total
+  // latency from the pose to the packet.
+  enum Stage {
+    STAGE_POSE_TO_REQUEST,
+    STAGE_RENDER,
+    STAGE_PROCESS,
+    STAGE_ENCODE_WAIT,
+    STAGE_ENCODE,
+    STAGE_POSE_TO_PACKET,
+    STAGE_COUNT
+  };
+
+  // Number of samples kept for each stage.
+  static constexpr std::size_t kWindowSize = 4096;
+
+  struct Percentiles {
+    std::size_t count = 0;
+    double p50_ms = 0;
+    double p90_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+  };
+
+  LatencyStats();
+
+  // Record the stages of a trace. Stages with an unknown end are skipped.
+  void record(const FrameTrace &trace);
+
+  // Empty the windows of every stage. The histograms are not affected.
+  void reset();
+
+  // Percentiles of the samples currently in the window of a stage.
+  Percentiles percentiles(Stage stage);
+
+  // Human readable summary of every stage.
+  std::string summary();
+
+  static const char *stage_name(Stage stage);
+
+ private:
+  struct Window {
+    std::array<std::int64_t, kWindowSize> samples;
+    std::size_t count = 0;
+    std::size_t next = 0;
+  };
+
+  std::array<Window, STAGE_COUNT> m_windows;
+  std::array<std::shared_ptr<Histogram>, STAGE_COUNT> m_histograms;
+  std::mutex m_mutex;
+
+  void add_sample(Stage stage, std::int64_t begin, std::int64_t end);
+};
+
+#endif  // NES_BASE_LATENCY_STATS_
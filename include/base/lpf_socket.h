@@ -0,0 +1,26 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_LPF_SOCKET_
+#define NES_BASE_LPF_SOCKET_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Blocking socket I/O shared by the server and the tools speaking the renderer
+// protocol. A message is framed with its length as a native size_t.
+
+// Send size bytes of buf. Returns 0 on success or a negative errno.
+int socket_send_blocking(int targetfd, uint8_t *buf, size_t size);
+
+// Send message with length prefix framing.
+int socket_send_blocking_lpf(int targetfd, uint8_t *buf, size_t size);
+
+// Receive size bytes to buf. Returns 0 on success or a negative value.
+int socket_receive_blocking(int targetfd, uint8_t *buf, size_t size);
+
+// Receive message with length prefix framing. Throws std::runtime_error if the
+// socket fails or is closed.
+std::string socket_receive_blocking_lpf(int targetfd);
+
+#endif  // NES_BASE_LPF_SOCKET_
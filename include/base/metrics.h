@@ -0,0 +1,168 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_METRICS_
+#define NES_BASE_METRICS_
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counter is a monotonically increasing value. Updates are a single relaxed
+// atomic add.
+class Counter {
+ public:
+  inline void inc(std::uint64_t n = 1) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+  inline std::uint64_t value() const {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<std::uint64_t> m_value{0};
+};
+
+// Gauge is a value that goes up and down, such as the depth of a queue.
+class Gauge {
+ public:
+  inline void set(std::int64_t value) {
+    m_value.store(value, std::memory_order_relaxed);
+  }
+  inline void add(std::int64_t n) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+  inline std::int64_t value() const {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<std::int64_t> m_value{0};
+};
+
+// Histogram counts integer samples in log-linear buckets, like HdrHistogram:
+// values below 2^kSubBucketBits have a bucket each, and every power of two
+// above is split into 2^kSubBucketBits buckets, so a bucket is at most 12.5%
+// wide. A sample v is counted in the bucket of v - 1, so that each bucket
+// includes its upper bound like the "le" buckets of Prometheus. Recording is
+// a few relaxed atomic adds and never allocates.
+class Histogram {
+ public:
+  static constexpr unsigned kSubBucketBits = 3;
+  static constexpr std::size_t kSubBucketCount = 1 << kSubBucketBits;
+  static constexpr std::size_t kBucketCount =
+      kSubBucketCount + (64 - kSubBucketBits) * kSubBucketCount;
+
+  // Samples are multiplied by unit when exported (e.g. 1e-9 for samples in
+  // nanoseconds exported in seconds). The exported "le" bounds are the powers
+  // of two from 2^min_exponent to 2^max_exponent.
+  Histogram(double unit, unsigned min_exponent, unsigned max_exponent);
+
+  inline void record(std::uint64_t value) {
+    m_buckets[bucket_index(value ? value - 1 : 0)].fetch_add(
+        1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  inline std::uint64_t count() const {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  inline std::uint64_t sum() const {
+    return m_sum.load(std::memory_order_relaxed);
+  }
+
+  // Value below which a quantile of the samples lie, within the width of a
+  // bucket. Returns 0 if there is no sample.
+  std::uint64_t quantile(double q) const;
+
+  // Number of samples smaller than or equal to 2^exponent.
+  std::uint64_t count_up_to_power(unsigned exponent) const;
+
+  inline double unit() const { return m_unit; }
+  inline unsigned min_exponent() const { return m_min_exponent; }
+  inline unsigned max_exponent() const { return m_max_exponent; }
+
+  static inline std::size_t bucket_index(std::uint64_t value) {
+    if (value < kSubBucketCount) {
+      return value;
+    }
+    // The position of the highest bit picks the power of two, and the
+    // kSubBucketBits bits below it pick the bucket within it.
+    unsigned exponent = std::bit_width(value) - 1;
+    unsigned shift = exponent - kSubBucketBits;
+    return kSubBucketCount + shift * kSubBucketCount +
+           ((value >> shift) - kSubBucketCount);
+  }
+
+  // Smallest value whose bucket_index() is index. The bucket counts the
+  // samples above it up to the lower bound of the next bucket.
+  static std::uint64_t bucket_lower_bound(std::size_t index);
+
+ private:
+  std::array<std::atomic<std::uint64_t>, kBucketCount> m_buckets{};
+  std::atomic<std::uint64_t> m_count{0};
+  std::atomic<std::uint64_t> m_sum{0};
+  double m_unit;
+  unsigned m_min_exponent;
+  unsigned m_max_exponent;
+};
+
+// MetricsRegistry owns every metric of the process and renders them in the
+// Prometheus text exposition format. Metrics are looked up once, usually when
+// a thread starts, and updated through the returned pointer without touching
+// the registry. Looking up the same name and labels twice returns the same
+// metric.
+class MetricsRegistry {
+ public:
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  // The registry shared by the whole process.
+  static MetricsRegistry &global();
+
+  std::shared_ptr<Counter> counter(const std::string &name,
+                                   const std::string &help,
+                                   const Labels &labels = {});
+
+  std::shared_ptr<Gauge> gauge(const std::string &name,
+                               const std::string &help,
+                               const Labels &labels = {});
+
+  // See Histogram for unit and the exponents. They are taken from the first
+  // lookup of a name.
+  std::shared_ptr<Histogram> histogram(const std::string &name,
+                                       const std::string &help,
+                                       double unit, unsigned min_exponent,
+                                       unsigned max_exponent,
+                                       const Labels &labels = {});
+
+  // Render every metric in the Prometheus text exposition format.
+  std::string exposition();
+
+ private:
+  enum Type { TYPE_COUNTER, TYPE_GAUGE, TYPE_HISTOGRAM };
+
+  struct Family {
+    Type type;
+    std::string help;
+    // Keyed by the rendered labels, e.g. {stream="scene_left"}.
+    std::map<std::string, std::shared_ptr<Counter>> counters;
+    std::map<std::string, std::shared_ptr<Gauge>> gauges;
+    std::map<std::string, std::shared_ptr<Histogram>> histograms;
+  };
+
+  std::map<std::string, Family> m_families;
+  std::mutex m_mutex;
+
+  Family &family(const std::string &name, const std::string &help, Type type);
+  static std::string format_labels(const Labels &labels);
+};
+
+#endif  // NES_BASE_METRICS_
@@ -0,0 +1,59 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_RENDER_PACER_
+#define NES_BASE_RENDER_PACER_
+
+#include <chrono>
+#include <mutex>
+
+// RenderPacer schedules the render requests of a session at the display rate
+// instead of as fast as the renderers answer. Every frame interval has one
+// slot per requested eye. A request is due a lead time before its slot, so its
+// frame arrives just before the encoder needs it; the lead follows the round
+// trip times of the renderers like the retransmission timeout of TCP
+// (smoothed round trip time plus twice its mean deviation). A pacer that
+// falls more than a frame interval behind, e.g. when the renderers are too
+// slow for the rate, skips the missed slots instead of bursting to catch up.
+// Thread safe.
+class RenderPacer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  explicit RenderPacer(std::chrono::nanoseconds frame_interval);
+
+  // Take the next slot of frame intervals with requests_per_frame slots, one
+  // per requested eye. Returns the time its request should be sent at, which
+  // may be in the past. Sets *late if the pacer fell behind and skipped
+  // slots.
+  clock::time_point reserve(unsigned requests_per_frame,
+                            bool *late = nullptr);
+
+  // The time the request of the next slot is due at, without taking it.
+  clock::time_point next_due();
+
+  // Adapt the lead to the round trip time of a request.
+  void record_rtt(std::chrono::nanoseconds rtt);
+
+  void set_frame_interval(std::chrono::nanoseconds frame_interval);
+
+  // Time a request is sent ahead of its slot.
+  std::chrono::nanoseconds lead();
+
+ private:
+  // Same as next_due() and lead() with m_mutex held.
+  clock::time_point due_locked() const;
+  std::chrono::nanoseconds lead_locked() const;
+
+  std::mutex m_mutex;
+  std::chrono::nanoseconds m_frame_interval;
+  // Time the frames of the next slot should arrive at; unset until the first
+  // request.
+  clock::time_point m_next_slot{};
+  // Requests already given the slot m_next_slot.
+  unsigned m_slot_requests = 0;
+  // Smoothed round trip time and its mean deviation, zero until measured.
+  std::chrono::nanoseconds m_srtt{0};
+  std::chrono::nanoseconds m_rttvar{0};
+};
+
+#endif  // NES_BASE_RENDER_PACER_
@@ -0,0 +1,32 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_RENDERER_LIST_
+#define NES_BASE_RENDERER_LIST_
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// RendererList holds the addresses ("ip:port") of the renderers the server
+// should be connected to. A renderer listed n times gets n connections.
+// socket_main_thread() follows changes made while it runs, connecting to added
+// renderers and disconnecting from removed ones. Thread safe.
+class RendererList {
+ public:
+  explicit RendererList(std::vector<std::string> renderers);
+
+  // Throws std::runtime_error if an address is not "ip:port" with a port
+  // from 1 to 65535.
+  static void check(const std::vector<std::string> &renderers);
+
+  // Replace the renderers. Throws like check(), leaving the list unchanged.
+  void set(std::vector<std::string> renderers);
+
+  std::vector<std::string> get();
+
+ private:
+  std::mutex m_mutex;
+  std::vector<std::string> m_renderers;
+};
+
+#endif  // NES_BASE_RENDERER_LIST_
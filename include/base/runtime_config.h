@@ -0,0 +1,44 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_RUNTIME_CONFIG_
+#define NES_BASE_RUNTIME_CONFIG_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "base/renderer_list.h"
+#include "base/session_manager.h"
+
+// RuntimeConfig changes the pipeline parameters of a running server by name:
+//   preset, tune, bitrate, depth_bitrate, fps, keyint, intra_refresh
+//     The encoder settings of every session; see SessionManager::reconfigure().
+//     The bitrates are changed in place, the others open new encoders which
+//     take over at the next frame with an IDR frame.
+//   queue_size
+//     The frame queue and frame map size of every session.
+//   renderers
+//     Comma separated addresses of the renderers; see RendererList.
+// renderers may be null for a server without renderers, e.g. when replaying.
+class RuntimeConfig {
+ public:
+  RuntimeConfig(std::shared_ptr<SessionManager> session_manager,
+                std::shared_ptr<RendererList> renderers);
+
+  // Apply the values of params. Every value is checked before any is applied;
+  // throws std::runtime_error for an unknown name or an invalid value, leaving
+  // the configuration unchanged.
+  void apply(const std::map<std::string, std::string> &params);
+
+  // The current values as a JSON object, including the encoders.
+  std::string json();
+
+ private:
+  std::shared_ptr<SessionManager> m_session_manager;
+  std::shared_ptr<RendererList> m_renderers;
+  // Serializes apply() so the checks hold when the values are applied.
+  std::mutex m_mutex;
+};
+
+#endif  // NES_BASE_RUNTIME_CONFIG_
@@ -9,7 +9,7 @@
 class ScopedTimer {
  public:
   using clock = std::chrono::steady_clock;
-  using time_format = std::chrono::milliseconds;
+  using time_format = std::chrono::microseconds;
   // Start the timer in a scope.
   ScopedTimer() : _start(clock::now()) {}
 
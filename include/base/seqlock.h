@@ -0,0 +1,69 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SEQLOCK_
+#define NES_BASE_SEQLOCK_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// SeqLock stores a small trivially copyable value that is written rarely by
+// one thread at a time and read often by many threads. Readers never block
+// and never take a lock: they copy the value and retry if a write happened
+// meanwhile. Writers must be serialized by the caller.
+//
+// The value is kept in relaxed atomic words instead of a plain T, so that a
+// reader racing with a writer reads torn data (which it then discards) rather
+// than causing a data race.
+template <typename T>
+class SeqLock {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SeqLock requires a trivially copyable type.");
+
+ public:
+  SeqLock() = default;
+  explicit SeqLock(const T &value) { store(value); }
+
+  // Publish a new value. Only one writer may call this at a time.
+  void store(const T &value) {
+    std::uint64_t words[kWords] = {};
+    std::memcpy(words, &value, sizeof(T));
+
+    const std::uint64_t seq = m_seq.load(std::memory_order_relaxed);
+    // An odd sequence number tells readers a write is in progress.
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < kWords; i++) {
+      m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_seq.store(seq + 2, std::memory_order_release);
+  }
+
+  // Returns a consistent snapshot of the value.
+  T load() const {
+    std::uint64_t words[kWords];
+    std::uint64_t seq_before, seq_after;
+    do {
+      seq_before = m_seq.load(std::memory_order_acquire);
+      for (std::size_t i = 0; i < kWords; i++) {
+        words[i] = m_words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      seq_after = m_seq.load(std::memory_order_relaxed);
+    } while ((seq_before & 1) || seq_before != seq_after);
+
+    T value;
+    std::memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+ private:
+  static constexpr std::size_t kWords =
+      (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+  std::atomic<std::uint64_t> m_seq{0};
+  std::atomic<std::uint64_t> m_words[kWords] = {};
+};
+
+#endif  // NES_BASE_SEQLOCK_
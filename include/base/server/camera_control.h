@@ -3,6 +3,7 @@
 #ifndef NES_BASE_SERVER_CAMERA_CONTROL_
 #define NES_BASE_SERVER_CAMERA_CONTROL_
 
+#include <atomic>
 #include <memory>
 
 #include "base/camera_manager.h"
@@ -16,13 +17,15 @@ class CameraControlServer : public WebSocketServer {
   static constexpr unsigned kReceivedLoggingInterval = 1000;
 
   CameraControlServer(std::shared_ptr<CameraManager> cameramgr,
-                      uint16_t bind_port);
+                      uint16_t bind_port,
+                      std::shared_ptr<IoContextPool> io_pool);
 
   void message_handler(websocketpp::connection_hdl hdl, message_ptr msg);
 
  private:
   std::shared_ptr<CameraManager> m_camera_manager;
-  uint64_t m_message_count = 0;
+  // Messages are handled on any of the io threads.
+  std::atomic<uint64_t> m_message_count = 0;
 };
 
 #endif  // NES_BASE_SERVER_CAMERA_CONTROL_
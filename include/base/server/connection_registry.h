@@ -0,0 +1,87 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SERVER_CONNECTION_REGISTRY_
+#define NES_BASE_SERVER_CONNECTION_REGISTRY_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <websocketpp/common/asio.hpp>
+#include <websocketpp/common/connection_hdl.hpp>
+
+// ConnectionContext stores the state of a single connection which is shared
+// between the asio thread and the send path.
+struct ConnectionContext {
+  ConnectionContext(websocketpp::connection_hdl hdl,
+                    websocketpp::lib::asio::io_service &service)
+      : hdl(hdl), strand(service) {}
+
+  websocketpp::connection_hdl hdl;
+
+  // Serializes the sends posted for this connection, so packets keep their
+  // order while different connections are served by different io threads.
+  websocketpp::lib::asio::io_service::strand strand;
+
+  // Bitmask of the streams the connection is subscribed to. Bit n is set when
+  // the connection wants to receive the stream with id n. Subscribed to every
+  // stream by default.
+  std::atomic<std::uint32_t> subscriptions{~0u};
+
+  // Id of the Session the connection is attached to.
+  std::atomic<std::uint64_t> session_id{0};
+
+  // Whether the session was created for this connection and should be closed
+  // with it.
+  std::atomic<bool> owns_session{false};
+
+  // Whether the connection was sent the backlog it needs to join the stream,
+  // and may receive live packets. Used by servers that send one on open.
+  std::atomic<bool> joined{false};
+};
+
+typedef std::map<websocketpp::connection_hdl,
+                 std::shared_ptr<ConnectionContext>,
+                 std::owner_less<websocketpp::connection_hdl>>
+    con_list;
+
+// ConnectionRegistry stores the open connections of a WebSocketServer. The
+// connections are published as an immutable snapshot. Writers (the open and
+// close handlers) copy the current snapshot, modify the copy and swap it in.
+// Writers are serialized with m_writer_mutex. Readers (the send path) load the
+// current snapshot without taking m_writer_mutex and iterate it while writers
+// are publishing a new one. A snapshot stays alive as long as a reader holds
+// it, so a connection closing during a send never invalidates the iteration.
+class ConnectionRegistry {
+ public:
+  using snapshot_ptr = std::shared_ptr<const con_list>;
+
+  ConnectionRegistry() : m_snapshot(std::make_shared<const con_list>()) {}
+
+  // Publish a new snapshot containing context.
+  void insert(std::shared_ptr<ConnectionContext> context);
+
+  // Publish a new snapshot without hdl.
+  void erase(websocketpp::connection_hdl hdl);
+
+  // Returns the context of hdl, or nullptr if hdl is not in the current
+  // snapshot.
+  std::shared_ptr<ConnectionContext> find(
+      websocketpp::connection_hdl hdl) const;
+
+  // Returns the current snapshot of the connections.
+  inline snapshot_ptr snapshot() const {
+    return m_snapshot.load(std::memory_order_acquire);
+  }
+
+  // Number of connections in the current snapshot.
+  inline std::size_t size() const { return snapshot()->size(); }
+
+ private:
+  std::atomic<snapshot_ptr> m_snapshot;
+  std::mutex m_writer_mutex;
+};
+
+#endif  // NES_BASE_SERVER_CONNECTION_REGISTRY_
@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SERVER_IO_CONTEXT_POOL_
+#define NES_BASE_SERVER_IO_CONTEXT_POOL_
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <websocketpp/common/asio.hpp>
+
+// IoContextPool runs one asio io_service on a configurable number of threads.
+// Every WebSocketServer shares the pool, so accepting, reading, framing and
+// writing for all connections of all servers spread across the threads.
+// Handlers of a single connection are serialized by the strand stored in its
+// ConnectionContext.
+class IoContextPool {
+ public:
+  using io_service = websocketpp::lib::asio::io_service;
+
+  explicit IoContextPool(unsigned thread_count);
+
+  // Spawn the threads running the io_service.
+  void start();
+
+  // Join the threads after the pending work is done. Every server sharing the
+  // pool should be stopped first.
+  void stop();
+
+  inline io_service &service() { return m_service; }
+
+  inline unsigned thread_count() const { return m_thread_count; }
+
+ private:
+  io_service m_service;
+  // Keeps the threads running while no server is listening.
+  std::unique_ptr<io_service::work> m_work;
+  std::vector<std::thread> m_threads;
+  unsigned m_thread_count;
+};
+
+#endif  // NES_BASE_SERVER_IO_CONTEXT_POOL_
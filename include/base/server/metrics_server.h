@@ -0,0 +1,38 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SERVER_METRICS_SERVER_
+#define NES_BASE_SERVER_METRICS_SERVER_
+
+#include <memory>
+
+#include "base/metrics.h"
+#include "base/runtime_config.h"
+#include "base/server/websocket_server.h"
+
+// A HTTP server that exposes a MetricsRegistry at /metrics in the Prometheus
+// text exposition format. It also controls the Tracer: /trace/start and
+// /trace/stop switch recording, and /trace returns the recorded zones in the
+// Chrome trace event format. With a RuntimeConfig, GET /config returns the
+// pipeline parameters as JSON and POST /config?name=value&... changes them;
+// invalid parameters are answered with 400 Bad Request. It shares the io
+// threads of the websocket servers.
+class MetricsServer : public WebSocketServer {
+ public:
+  MetricsServer(MetricsRegistry &registry, uint16_t bind_port,
+                std::shared_ptr<IoContextPool> io_pool,
+                std::shared_ptr<RuntimeConfig> config = nullptr);
+
+  // Websocket messages are ignored.
+  void message_handler(websocketpp::connection_hdl hdl, message_ptr msg) {}
+
+ protected:
+  void http_handler(server_notls::connection_ptr connection) override;
+
+ private:
+  void config_handler(server_notls::connection_ptr connection);
+
+  MetricsRegistry &m_registry;
+  std::shared_ptr<RuntimeConfig> m_config;
+};
+
+#endif  // NES_BASE_SERVER_METRICS_SERVER_
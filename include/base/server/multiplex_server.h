@@ -0,0 +1,155 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SERVER_MULTIPLEX_SERVER_
+#define NES_BASE_SERVER_MULTIPLEX_SERVER_
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "base/logging.h"
+#include "base/server/packet_sink.h"
+#include "base/server/websocket_server.h"
+#include "base/session.h"
+#include "base/session_manager.h"
+#include "nes.pb.h"
+
+// A Websocket server that carries camera control and every elementary stream
+// over a single connection. Every message starts with a one byte stream id.
+//
+// Client to server: [STREAM_ID_CONTROL][nesproto::ControlMessage]
+//   ControlMessage carries a camera update, a subscription, a request for a
+//   dedicated session, a request for key frames or a feedback report.
+// Server to client: [STREAM_ID_CONTROL][nesproto::ServerControlMessage]
+//                   [stream id][metadata size][nesproto::PacketMetadata]
+//                   [packet]
+//   The metadata size is a little endian uint16. PacketMetadata carries the
+//   frame index, the key frame flag, the pts, the FrameTrace of the packet
+//   and the pose id and client timestamp of the camera it was rendered with,
+//   so the client can schedule the display of the frame and measure the
+//   latency from its pose to the display in its own clock. The packet is
+//   identical to the one sent by PacketStreamServer. SessionStatus names the
+//   encoder of every stream.
+//
+// A connection is attached to the primary session and subscribed to every
+// stream when it opens. It can restrict the streams it receives with a
+// Subscription message, and ask for its own camera and encoders with a
+// SessionRequest. The SessionStatus follows once the encoders are open; the
+// connection stays on its session meanwhile. A dedicated session is closed
+// with its connection. Key frames are forced on the streams a connection
+// starts receiving, whether it opened, subscribed or switched to a dedicated
+// session, and on the streams of a KeyframeRequest. The bitrate of a session
+// adapts to the ClientFeedback of the connections attached to it.
+class MultiplexServer : public WebSocketServer {
+ public:
+  // Stream ids of the elementary streams follow Session::StreamIndex.
+  enum StreamId : std::uint8_t {
+    STREAM_ID_CONTROL = 0,
+    STREAM_ID_SCENE_LEFT = 1 + Session::STREAM_SCENE_LEFT,
+    STREAM_ID_DEPTH_LEFT = 1 + Session::STREAM_DEPTH_LEFT,
+    STREAM_ID_SCENE_RIGHT = 1 + Session::STREAM_SCENE_RIGHT,
+    STREAM_ID_DEPTH_RIGHT = 1 + Session::STREAM_DEPTH_RIGHT,
+  };
+
+  // Interval of logging the receive event.
+  static constexpr unsigned kReceivedLoggingInterval = 1000;
+
+  // Size of the stream id and the metadata size preceding the metadata.
+  static constexpr std::size_t kPacketHeaderSize = 3;
+
+  // PacketSink delivering the packets of one stream of a session to the
+  // subscribed connections attached to the session. The server must outlive
+  // the sink.
+  class StreamSink : public PacketSink {
+   public:
+    StreamSink(MultiplexServer &server, std::uint64_t session_id,
+               StreamId stream_id)
+        : m_server(server), m_session_id(session_id), m_stream_id(stream_id) {}
+
+    void consume_packet(AVPacket *pkt, const FrameTrace &trace) override;
+
+    inline bool has_viewers() const override {
+      return m_server.has_subscribers(m_session_id, m_stream_id);
+    }
+
+   private:
+    MultiplexServer &m_server;
+    std::uint64_t m_session_id;
+    StreamId m_stream_id;
+  };
+
+  MultiplexServer(std::shared_ptr<SessionManager> session_manager,
+                  uint16_t bind_port, std::shared_ptr<IoContextPool> io_pool);
+
+  // Stop admitting sessions and wait for the admission thread.
+  ~MultiplexServer();
+
+  void message_handler(websocketpp::connection_hdl hdl, message_ptr msg);
+
+  // Returns a sink for the packets of stream_id of a session.
+  inline std::shared_ptr<PacketSink> stream_sink(std::uint64_t session_id,
+                                                 StreamId stream_id) {
+    return std::make_shared<StreamSink>(*this, session_id, stream_id);
+  }
+
+  // Returns the sinks of every stream of a session, in the order expected by
+  // Session::start().
+  std::array<Session::sink_list, Session::STREAM_COUNT> session_sinks(
+      std::uint64_t session_id);
+
+  // Send a packet of stream_id of a session to every connection attached to
+  // the session and subscribed to the stream.
+  void send_packet(std::uint64_t session_id, StreamId stream_id,
+                   const nesproto::PacketMetadata &metadata, const char *data,
+                   size_t size);
+
+  // Whether a connection attached to the session is subscribed to stream_id.
+  bool has_subscribers(std::uint64_t session_id, StreamId stream_id) const;
+
+ protected:
+  void open_handler(std::shared_ptr<ConnectionContext> context) override;
+  void close_handler(std::shared_ptr<ConnectionContext> context) override;
+
+ private:
+  std::shared_ptr<SessionManager> m_session_manager;
+  // Messages are handled on any of the io threads.
+  std::atomic<uint64_t> m_message_count = 0;
+
+  // Dedicated sessions are admitted on m_admission_thread: opening their
+  // encoders takes long and would stall the other connections of an io
+  // thread. Requests wait in m_admissions.
+  std::mutex m_admission_mutex;
+  std::condition_variable m_admission_cv;
+  std::deque<std::shared_ptr<ConnectionContext>> m_admissions;
+  bool m_admission_stopping = false;
+  std::thread m_admission_thread;
+  // Serializes attaching a dedicated session to a connection with closing
+  // the connection, so that the session is closed with it either way.
+  std::mutex m_attach_mutex;
+
+  // Queue the request of the connection for a dedicated session.
+  void handle_session_request(std::shared_ptr<ConnectionContext> context);
+
+  void admission_loop();
+
+  // Create a dedicated session for the connection and report the result.
+  void admit_session(std::shared_ptr<ConnectionContext> context);
+
+  // Send the SessionStatus of the session the connection is attached to.
+  void send_session_status(std::shared_ptr<ConnectionContext> context);
+
+  // Ask the encoders of the streams selected by the bits of streams, as in
+  // Subscription, of a session for key frames.
+  void request_keyframes(std::uint64_t session_id, std::uint32_t streams);
+
+  // Send a control message to a single connection.
+  void send_control(const std::shared_ptr<ConnectionContext> &context,
+                    const nesproto::ServerControlMessage &message);
+};
+
+#endif  // NES_BASE_SERVER_MULTIPLEX_SERVER_
@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SERVER_PACKET_SINK_
+#define NES_BASE_SERVER_PACKET_SINK_
+
+#include <functional>
+
+#include "base/frame_trace.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"  // AVPacket, AV_PKT_FLAG_KEY
+}
+
+// PacketSink receives the encoded packets of an elementary stream. A stream
+// may deliver its packets to several sinks, e.g. a PacketStreamServer and a
+// MultiplexServer.
+class PacketSink {
+ public:
+  virtual ~PacketSink() = default;
+
+  // Deliver a packet. trace holds the timestamps of the frame the packet was
+  // encoded from.
+  virtual void consume_packet(AVPacket *pkt, const FrameTrace &trace) = 0;
+
+  // Whether a client currently receives the packets. The session suspends
+  // the streams none of whose sinks have viewers. Sinks that cannot tell are
+  // always watched. Called for every render request; must be cheap.
+  virtual bool has_viewers() const { return true; }
+
+  // Set by the session before the stream starts: asks the encoder of the
+  // stream for a key frame.
+  inline void set_keyframe_requester(std::function<void()> requester) {
+    m_keyframe_requester = std::move(requester);
+  }
+
+ protected:
+  // Ask the encoder of the stream for a key frame, e.g. when a client joins.
+  inline void request_keyframe() const {
+    if (m_keyframe_requester) {
+      m_keyframe_requester();
+    }
+  }
+
+  // Whether the packet is a key frame that is not an intra frame, i.e. a
+  // recovery point of intra refresh. The picture type comes from the encoder
+  // statistics attached by libavcodec; without them the packet is not one.
+  static inline bool is_recovery_point(const AVPacket *pkt) {
+    if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+      return false;
+    }
+    // The side data is u32le quality, u8 picture type, ... The array is read
+    // directly since the size type of av_packet_get_side_data() differs
+    // between libavcodec versions.
+    for (int i = 0; i < pkt->side_data_elems; i++) {
+      const AVPacketSideData &side_data = pkt->side_data[i];
+      if (side_data.type == AV_PKT_DATA_QUALITY_STATS && side_data.size > 4) {
+        return side_data.data[4] != AV_PICTURE_TYPE_I;
+      }
+    }
+    return false;
+  }
+
+  // Overwrite the first byte of the packet with the key frame indicator
+  // expected by the legacy clients: 0 for a key frame, including a recovery
+  // point, 1 otherwise. The first byte of an Annex B packet is always part of
+  // the start code, so the client can restore it. Packets of other bitstream
+  // formats (VP9, AV1) are left intact; their clients use the keyframe field
+  // of PacketMetadata. The operation is idempotent, so every sink of a stream
+  // may apply it to the same packet.
+  static inline void tag_keyframe(AVPacket *pkt) {
+    // A start code is 00 00 01 or 00 00 00 01. The first byte is not checked
+    // because it may already be tagged. VP9 and AV1 packets never begin with
+    // 0 or 1.
+    const uint8_t *data = pkt->data;
+    if (pkt->size < 4 || data[0] > 1 || data[1] != 0 ||
+        !(data[2] == 1 || (data[2] == 0 && data[3] == 1))) {
+      return;
+    }
+    pkt->data[0] = (pkt->flags & AV_PKT_FLAG_KEY) ? 0 : 1;
+  }
+
+ private:
+  std::function<void()> m_keyframe_requester;
+};
+
+#endif  // NES_BASE_SERVER_PACKET_SINK_
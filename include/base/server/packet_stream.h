@@ -3,24 +3,73 @@
 #ifndef NES_BASE_SERVER_PACKET_STREAM_
 #define NES_BASE_SERVER_PACKET_STREAM_
 
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 
 #include "base/logging.h"
+#include "base/server/packet_sink.h"
 #include "base/server/websocket_server.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"  // AVPacket, AV_PKT_FLAG_KEY
 }
 
-class PacketStreamServer : public WebSocketServer {
+// Sends the packets of one stream to every client. A new client cannot decode
+// until the next key frame. By default the encoder is asked for one when a
+// client connects. With a GOP cache, the server keeps the packets since the
+// last key frame instead, and sends them to a new client before the live
+// packets, so it can start decoding at once without an extra key frame
+// costing every other client bit rate.
+class PacketStreamServer : public WebSocketServer, public PacketSink {
  public:
-  PacketStreamServer(uint16_t bind_port, std::string server_name)
-      : WebSocketServer(server_name, bind_port) {}
+  // Upper bound of the size of the GOP cache. A GOP exceeding it is not
+  // cached, and clients joining during it are sent a forced key frame. The
+  // cache follows the key frame interval of the encoder, which may change
+  // while the server runs, and has no bound of packets.
+  static constexpr std::size_t kMaxGopCacheBytes = 32 * 1024 * 1024;
 
+  PacketStreamServer(uint16_t bind_port, std::string server_name,
+                     std::shared_ptr<IoContextPool> io_pool,
+                     bool gop_cache = false)
+      : WebSocketServer(server_name, bind_port, io_pool),
+        m_gop_cache_enabled(gop_cache) {}
+
+  // The stream carries no control protocol: any message from a client, e.g.
+  // after it lost packets, is taken as a request for a key frame.
   inline void message_handler(websocketpp::connection_hdl hdl,
-                              message_ptr msg) {}
+                              message_ptr msg) {
+    request_keyframe();
+  }
+
+  // Packets are sent as-is; the trace is only available on the multiplexed
+  // server, which keeps the legacy packet format unchanged.
+  void consume_packet(AVPacket *pkt, const FrameTrace &trace) override;
+
+  inline bool has_viewers() const override { return connection_count() > 0; }
+
+ protected:
+  // Send the GOP cache to the new client, or ask for a key frame if there is
+  // none.
+  void open_handler(std::shared_ptr<ConnectionContext> context) override;
+
+  // Drop the GOP cache with the last client. The stream is suspended without
+  // viewers, so the cache would be stale when the next client joins.
+  void close_handler(std::shared_ptr<ConnectionContext> context) override;
+
+ private:
+  const bool m_gop_cache_enabled;
 
-  void consume_packet(AVPacket *pkt);
+  // Packets since the last key frame, shared with the live sends. Empty if
+  // the cache is disabled or the GOP did not fit. m_gop_mutex also orders the
+  // backlog of a new client before its first live packet.
+  std::mutex m_gop_mutex;
+  std::deque<std::shared_ptr<const std::string>> m_gop_cache;
+  std::size_t m_gop_cache_bytes = 0;
+  // Whether the packets since the last key frame are all in m_gop_cache.
+  bool m_gop_complete = false;
 };
 
 #endif  // NES_BASE_SERVER_PACKET_STREAM_SERVER_
@@ -4,12 +4,15 @@
 #define NES_BASE_SERVER_WEBSOCKET_SERVER_
 
 #include <iostream>
-#include <set>
-#include <thread>
+#include <memory>
+#include <string>
 #include <websocketpp/config/asio.hpp>
 #include <websocketpp/server.hpp>
 
 #include "base/logging.h"
+#include "base/metrics.h"
+#include "base/server/connection_registry.h"
+#include "base/server/io_context_pool.h"
 
 typedef websocketpp::server<websocketpp::config::asio> server_notls;
 
@@ -21,29 +24,71 @@ using websocketpp::log::alevel;
 typedef websocketpp::config::asio::message_type::ptr message_ptr;
 typedef websocketpp::lib::shared_ptr<websocketpp::lib::asio::ssl::context>
     context_ptr;
-typedef std::set<websocketpp::connection_hdl,
-                 std::owner_less<websocketpp::connection_hdl>>
-    con_list;
 
+// WebSocketServer runs a websocketpp server on the io threads of an
+// IoContextPool. Outgoing messages are posted to the strand of each
+// connection, so the caller (usually an encoder thread) only copies the
+// payload once and the framing and socket writes for every connection are
+// done by the pool.
 class WebSocketServer {
  private:
   server_notls m_server;
-  con_list m_connections;
-  websocketpp::lib::shared_ptr<websocketpp::lib::thread> m_thread;
+  ConnectionRegistry m_connections;
+  std::shared_ptr<IoContextPool> m_io_pool;
   std::string m_server_name;
   uint16_t m_bind_port;
   bool m_running = false;
+  std::shared_ptr<Gauge> m_connections_gauge;
 
-  static void run_server(server_notls *s) { s->run(); }
+  // Send a message to a single connection on the calling thread. Errors of a
+  // connection that is closing are ignored.
+  void send_now(websocketpp::connection_hdl hdl, const std::string &message);
+
+ protected:
+  // Returns the current snapshot of open connections.
+  inline ConnectionRegistry::snapshot_ptr connections() const {
+    return m_connections.snapshot();
+  }
+
+  // Returns the context of hdl, or nullptr if the connection is not open.
+  inline std::shared_ptr<ConnectionContext> connection_context(
+      websocketpp::connection_hdl hdl) const {
+    return m_connections.find(hdl);
+  }
+
+  // Post a message to the strand of a connection. The message is shared by
+  // every connection it is posted to.
+  void post(const std::shared_ptr<ConnectionContext> &context,
+            std::shared_ptr<const std::string> message);
+
+  inline const std::string &server_name() const { return m_server_name; }
+
+  // Called on an io thread after a connection is opened and registered.
+  virtual void open_handler(std::shared_ptr<ConnectionContext> context) {}
+
+  // Called on an io thread after a connection is closed and unregistered.
+  virtual void close_handler(std::shared_ptr<ConnectionContext> context) {}
+
+  // Called on an io thread for a plain HTTP request. The response is sent
+  // when the handler returns. Replies 426 Upgrade Required by default.
+  virtual void http_handler(server_notls::connection_ptr connection) {
+    connection->set_status(websocketpp::http::status_code::upgrade_required);
+  }
 
  public:
   virtual void message_handler(websocketpp::connection_hdl hdl,
                                message_ptr msg) = 0;
 
-  WebSocketServer(std::string server_name, uint16_t bind_port);
+  WebSocketServer(std::string server_name, uint16_t bind_port,
+                  std::shared_ptr<IoContextPool> io_pool);
   void start();
   void stop();
+  // Send data to every connection in the current snapshot of m_connections.
+  // Connections opened or closed during the call do not block it.
   void send_to_all(const char *data, size_t size);
+
+  // Number of currently open connections.
+  inline std::size_t connection_count() const { return m_connections.size(); }
 };
 
 #endif  // NES_BASE_SERVER_WEBSOCKET_SERVER_
@@ -0,0 +1,212 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SESSION_
+#define NES_BASE_SESSION_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/bandwidth_estimator.h"
+#include "base/camera_manager.h"
+#include "base/capture.h"
+#include "base/frame_trace.h"
+#include "base/latency_stats.h"
+#include "base/metrics.h"
+#include "base/render_pacer.h"
+#include "base/server/packet_sink.h"
+#include "base/video/frame_map.h"
+#include "base/video/frame_queue.h"
+#include "base/video/render_text.h"
+#include "base/video/stereo_packing.h"
+#include "base/video/type_managers.h"
+#include "nes.pb.h"
+
+// Session owns the pipeline serving one client: the camera, the request stream
+// to the shared renderers, the frame queues and the encoders of the four
+// elementary streams. The primary session serves the legacy servers and every
+// multiplexed client that did not ask for a dedicated session.
+class Session {
+ public:
+  // Elementary streams produced by a session.
+  enum StreamIndex {
+    STREAM_SCENE_LEFT,
+    STREAM_DEPTH_LEFT,
+    STREAM_SCENE_RIGHT,
+    STREAM_DEPTH_RIGHT,
+    STREAM_COUNT
+  };
+
+  using sink_list = std::vector<std::shared_ptr<PacketSink>>;
+
+  // Name of a stream used in logs and metrics, e.g. "scene_left".
+  static const char *stream_name(StreamIndex stream);
+
+  // Initialize the encoders of the scene streams with scene_info and those of
+  // the depth streams with depth_info; both must have the same resolution.
+  // etctx draws the debug overlay on the scene frames; without it the overlay
+  // is skipped. The latency of every packet is recorded to latency_stats. The
+  // frame queue and the encode map of each eye hold up to queue_size frames.
+  // The infos give the size of one eye. With a StereoLayout, both eyes are
+  // packed into the frames of one scene and one depth encoder, whose packets
+  // are delivered to the sinks of STREAM_SCENE_LEFT and STREAM_DEPTH_LEFT;
+  // the right streams carry no packets. The bitrate of the session adapts to
+  // the feedback of its clients within bit_rate_limits, and is split between
+  // the scene and depth streams in the ratio of the bitrates of the infos.
+  // With render_pacing, the requests of the session are paced to the fps of
+  // scene_info by a RenderPacer; see pace_request(). With idle_suspension,
+  // streams nobody receives are not rendered or encoded; see
+  // refresh_viewers().
+  Session(std::uint64_t id,
+          types::AVCodecContextManager::CodecInitInfo scene_info,
+          types::AVCodecContextManager::CodecInitInfo depth_info,
+          std::shared_ptr<RenderTextContext> etctx,
+          std::shared_ptr<LatencyStats> latency_stats,
+          std::size_t queue_size = FrameQueue::kFrameQueueMaxSize,
+          StereoLayout layout = StereoLayout::NONE,
+          BandwidthEstimator::Options bit_rate_limits = {},
+          bool render_pacing = false, bool idle_suspension = false);
+
+  // Stop the threads of the session and wait for them.
+  ~Session();
+
+  // Spawn the processing, encoding and packet threads. sinks[n] receives the
+  // packets of the stream n and may request key frames from its encoder.
+  void start(std::array<sink_list, STREAM_COUNT> sinks);
+
+  // Request the threads to stop without waiting for them.
+  inline void request_stop() { m_shutdown_requested = true; }
+
+  // Request the threads to stop and wait for them.
+  void stop();
+
+  inline bool stop_requested() const { return m_shutdown_requested; }
+
+  // With idle suspension, suspend the encoders of the streams none of whose
+  // sinks has viewers and resume the others; frames are only requested for
+  // the eyes with a watched stream. Returns whether any stream is watched.
+  // A recording session is always watched. Thread safe.
+  bool refresh_viewers();
+
+  // Whether any stream was watched at the last refresh_viewers().
+  inline bool watched() const { return m_watched_streams != 0; }
+
+  // With render pacing, take the next request slot of the session and wait
+  // until its request is due. Returns at once without render pacing.
+  void pace_request();
+
+  // Time the next request of the session is due at; now without render
+  // pacing.
+  RenderPacer::clock::time_point next_request_due();
+
+  // Record the time a renderer took to answer a request of the session, which
+  // the render pacing sends requests ahead by.
+  void record_render_time(std::chrono::nanoseconds rtt);
+
+  // Generate the FrameRequest of the next frame. Eyes are requested
+  // alternately, skipping an eye without viewers. trace is initialized with
+  // the index of the frame and the time its camera was received.
+  nesproto::FrameRequest next_request(FrameTrace *trace);
+
+  // Queue a frame rendered for a request of this session along with the trace
+  // of the request. Throws LockTimeout if the frame queue stays full.
+  void push_frame(const nesproto::RenderedFrame &frame,
+                  const FrameTrace &trace);
+
+  // Record the cameras and the rendered frames of the session to capture.
+  // Must be called before the session is served.
+  void record(std::shared_ptr<CaptureWriter> capture);
+
+  // Capture the frames of the session are recorded to, or nullptr.
+  inline std::shared_ptr<CaptureWriter> capture() const { return m_capture; }
+
+  inline std::uint64_t id() const { return m_id; }
+
+  inline StereoLayout layout() const { return m_layout; }
+
+  // Ask the encoder of the stream for a key frame. With a StereoLayout, the
+  // left and right streams share their encoder.
+  void request_keyframe(StreamIndex stream);
+
+  // Adapt the bitrate of the session to a report of client, any value
+  // identifying it such as its connection. Thread safe.
+  void report_feedback(const void *client,
+                       const nesproto::ClientFeedback &feedback);
+
+  // Stop adapting the bitrate to client, e.g. when it disconnects.
+  void forget_client(const void *client);
+
+  // Apply scene_edit to the configuration of the scene encoders and
+  // depth_edit to that of the depth encoders; see
+  // AVCodecContextManager::reconfigure(). The edits must not change the
+  // resolution. A change of the bitrates also sets the split between the
+  // streams, and the bitrate the feedback of the clients adapts from.
+  void reconfigure(
+      const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+          &scene_edit,
+      const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+          &depth_edit);
+
+  // Change the number of frames the frame queues and the encode maps hold.
+  void set_queue_size(std::size_t queue_size);
+
+  // Name of the libavcodec encoder of the stream, e.g. "libx264".
+  const char *encoder_name(StreamIndex stream) const;
+
+  inline std::shared_ptr<CameraManager> camera_manager() const {
+    return m_camera_manager;
+  }
+
+ private:
+  std::uint64_t m_id;
+  StereoLayout m_layout;
+  // With a StereoLayout, the left and right encoders are the same.
+  std::shared_ptr<types::AVCodecContextManager> m_codec_scene_left;
+  std::shared_ptr<types::AVCodecContextManager> m_codec_depth_left;
+  std::shared_ptr<types::AVCodecContextManager> m_codec_scene_right;
+  std::shared_ptr<types::AVCodecContextManager> m_codec_depth_right;
+  std::shared_ptr<RenderTextContext> m_etctx;
+  std::shared_ptr<LatencyStats> m_latency_stats;
+  std::shared_ptr<CameraManager> m_camera_manager;
+  std::shared_ptr<CaptureWriter> m_capture;
+  std::shared_ptr<FrameQueue> m_frame_queue_left;
+  std::shared_ptr<FrameQueue> m_frame_queue_right;
+  std::shared_ptr<FrameMap> m_frame_map_left;
+  std::shared_ptr<FrameMap> m_frame_map_right;
+  std::atomic<std::uint64_t> m_frame_index_left = 0;
+  std::atomic<std::uint64_t> m_frame_index_right = 0;
+  std::atomic<int> m_is_left{0};
+  std::atomic<bool> m_shutdown_requested{false};
+  std::vector<std::thread> m_threads;
+  std::shared_ptr<Counter> m_dropped_stopping;
+  // Share of the bitrate of the session given to the depth streams.
+  std::atomic<double> m_depth_share;
+  BandwidthEstimator m_bandwidth;
+  std::shared_ptr<Counter> m_bit_rate_changes;
+  // Null without render pacing.
+  std::unique_ptr<RenderPacer> m_pacer;
+  std::shared_ptr<Counter> m_late_requests;
+  bool m_idle_suspension;
+  // The sinks given to start(), checked for viewers.
+  std::mutex m_sinks_mutex;
+  std::array<sink_list, STREAM_COUNT> m_sinks;
+  // Bit n is set while the stream n is watched.
+  std::atomic<std::uint32_t> m_watched_streams{~0u};
+  std::shared_ptr<Counter> m_suspensions;
+
+  // Whether an eye has a watched stream in watched_streams.
+  bool eye_watched(bool is_left, std::uint32_t watched_streams) const;
+
+  std::shared_ptr<types::AVCodecContextManager> codec(StreamIndex stream) const;
+
+  // Split bit_rate, for all streams, between the encoders.
+  void set_bit_rate(unsigned bit_rate);
+};
+
+#endif  // NES_BASE_SESSION_
@@ -0,0 +1,120 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_SESSION_MANAGER_
+#define NES_BASE_SESSION_MANAGER_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "base/bandwidth_estimator.h"
+#include "base/latency_stats.h"
+#include "base/metrics.h"
+#include "base/session.h"
+#include "base/video/render_text.h"
+#include "base/video/type_managers.h"
+
+// SessionManager owns every Session and shares the renderers between them.
+// The primary session always exists. Dedicated sessions are admitted until
+// max_sessions (including the primary session) are active. Renderer threads
+// ask for the next session in round-robin order, so each active session gets
+// an equal share of the renderers regardless of how many clients it serves.
+class SessionManager {
+ public:
+  // Id of the primary session.
+  static constexpr std::uint64_t kPrimarySessionId = 0;
+
+  // Every session is created with scene_info, depth_info, queue_size, layout,
+  // bit_rate_limits, render_pacing and idle_suspension; see Session. With
+  // render_pacing, next() returns the session whose request is due first.
+  SessionManager(types::AVCodecContextManager::CodecInitInfo scene_info,
+                 types::AVCodecContextManager::CodecInitInfo depth_info,
+                 std::shared_ptr<RenderTextContext> etctx,
+                 unsigned max_sessions,
+                 std::size_t queue_size = FrameQueue::kFrameQueueMaxSize,
+                 StereoLayout layout = StereoLayout::NONE,
+                 BandwidthEstimator::Options bit_rate_limits = {},
+                 bool render_pacing = false, bool idle_suspension = false);
+
+  inline std::shared_ptr<Session> primary() const { return m_primary; }
+
+  // Create a dedicated session. Returns nullptr if max_sessions are already
+  // active. The caller starts the session with the sinks of its client.
+  std::shared_ptr<Session> admit();
+
+  // Returns the session with the id, or nullptr if it is not active.
+  std::shared_ptr<Session> find(std::uint64_t id);
+
+  // Remove a dedicated session. Its threads are stopped and joined later by
+  // reap(), so this can be called from an io thread.
+  void close(std::uint64_t id);
+
+  // Returns the session which should issue the next render request, or
+  // nullptr if no session has viewers; see refresh_viewers().
+  std::shared_ptr<Session> next();
+
+  // Refresh the viewers of every session; see Session::refresh_viewers().
+  // next() follows the viewers as of the last call.
+  void refresh_viewers();
+
+  // Join the threads of the closed sessions.
+  void reap();
+
+  // Stop every session and wait for them.
+  void stop_all();
+
+  // Apply the edits to the encoders of every session and of the sessions
+  // admitted later; see Session::reconfigure().
+  void reconfigure(
+      const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+          &scene_edit,
+      const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+          &depth_edit);
+
+  // Change the queue size of every session and of the sessions admitted
+  // later.
+  void set_queue_size(std::size_t queue_size);
+
+  // Configuration sessions are admitted with.
+  types::AVCodecContextManager::CodecInitInfo scene_info();
+  types::AVCodecContextManager::CodecInitInfo depth_info();
+  std::size_t queue_size();
+
+  // Number of active sessions including the primary session.
+  std::size_t size();
+
+  // Number of frames requested from the renderers by all sessions.
+  inline std::uint64_t requested_frames() const { return m_requested_frames; }
+
+  // Latency of the packets of all sessions.
+  inline std::shared_ptr<LatencyStats> latency_stats() const {
+    return m_latency_stats;
+  }
+
+ private:
+  types::AVCodecContextManager::CodecInitInfo m_scene_info;
+  types::AVCodecContextManager::CodecInitInfo m_depth_info;
+  std::shared_ptr<RenderTextContext> m_etctx;
+  unsigned m_max_sessions;
+  std::size_t m_queue_size;
+  StereoLayout m_layout;
+  BandwidthEstimator::Options m_bit_rate_limits;
+  bool m_render_pacing;
+  bool m_idle_suspension;
+  std::shared_ptr<LatencyStats> m_latency_stats;
+  std::shared_ptr<Gauge> m_sessions_gauge;
+  std::shared_ptr<Session> m_primary;
+  std::mutex m_mutex;
+  std::map<std::uint64_t, std::shared_ptr<Session>> m_sessions;
+  std::vector<std::shared_ptr<Session>> m_retired;
+  std::uint64_t m_next_id = kPrimarySessionId + 1;
+  std::uint64_t m_cursor = kPrimarySessionId;
+  std::atomic<std::uint64_t> m_requested_frames = 0;
+};
+
+#endif  // NES_BASE_SESSION_MANAGER_
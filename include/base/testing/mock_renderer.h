@@ -0,0 +1,90 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_TESTING_MOCK_RENDERER_
+#define NES_BASE_TESTING_MOCK_RENDERER_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// MockRenderer speaks the protocol of instant-ngp-renderer without a GPU. It
+// answers every FrameRequest with a synthetic RGB and depth frame after a
+// configurable render latency, and can fail requests or drop the connection
+// to exercise the error paths of the server. It is used by the mock_renderer
+// tool and, in-process, by the pipeline benchmark.
+class MockRenderer {
+ public:
+  enum LatencyDistribution {
+    LATENCY_CONSTANT,
+    LATENCY_UNIFORM,
+    LATENCY_NORMAL,
+    LATENCY_LOGNORMAL,
+  };
+
+  struct Options {
+    // Resolution of the frames. 0 uses the resolution of the request.
+    unsigned width = 0;
+    unsigned height = 0;
+    LatencyDistribution distribution = LATENCY_CONSTANT;
+    double latency_ms = 10;
+    // Half width of the uniform distribution, or the standard deviation of
+    // the normal and log-normal distributions.
+    double jitter_ms = 0;
+    // Probability of answering a request with a malformed frame.
+    double failure_rate = 0;
+    // Probability of closing the connection instead of answering a request.
+    double disconnect_rate = 0;
+    // Fill the frames with noise, which is much harder to encode than the
+    // default gradient.
+    bool noise = false;
+    // Seed of the first connection; each connection uses the next one.
+    std::uint64_t seed = 1;
+  };
+
+  // Parse "constant", "uniform", "normal" or "lognormal". Throws
+  // std::runtime_error for other names.
+  static LatencyDistribution parse_distribution(const std::string &name);
+
+  // Listen on port of the loopback interface, or of every interface if
+  // loopback_only is false. Port 0 picks a free port; see port().
+  MockRenderer(Options options, uint16_t port, bool loopback_only = true);
+
+  // Close the listening socket and every connection, and wait for their
+  // threads.
+  ~MockRenderer();
+
+  // Port the renderer listens on.
+  inline uint16_t port() const { return m_port; }
+
+  // Address to pass to --renderer.
+  inline std::string address() const {
+    return "127.0.0.1:" + std::to_string(m_port);
+  }
+
+  // Frames sent by every connection.
+  inline std::uint64_t frames_served() const { return m_frames_served; }
+
+  // CPU time spent by the connection threads, in seconds.
+  inline double cpu_seconds() const { return m_cpu_ns / 1e9; }
+
+ private:
+  Options m_options;
+  int m_listen_fd = -1;
+  uint16_t m_port = 0;
+  std::atomic<bool> m_stopping{false};
+  std::atomic<std::uint64_t> m_frames_served{0};
+  std::atomic<std::int64_t> m_cpu_ns{0};
+  std::thread m_accept_thread;
+  std::mutex m_mutex;
+  // Open connections; a closed connection has an fd of -1.
+  std::vector<int> m_connection_fds;
+  std::vector<std::thread> m_connection_threads;
+
+  void accept_loop();
+  void serve(std::size_t slot, std::uint64_t seed);
+};
+
+#endif  // NES_BASE_TESTING_MOCK_RENDERER_
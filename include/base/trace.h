@@ -0,0 +1,104 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_TRACE_
+#define NES_BASE_TRACE_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Tracer records scoped zones of every thread with nanosecond timestamps and
+// writes them in the Chrome trace event format, which chrome://tracing and
+// Perfetto open. Each thread appends to its own ring buffer without locking;
+// the writer copies the buffers while they are being filled. Recording is off
+// until enable(true) and a disabled zone costs a relaxed load.
+class Tracer {
+ public:
+  // Zones kept per thread. Older zones are overwritten.
+  static constexpr std::size_t kThreadBufferSize = 1 << 16;
+
+  static inline bool enabled() {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+  static void enable(bool enabled);
+
+  // Name the calling thread in the trace.
+  static void name_thread(const std::string &name);
+
+  // Record a zone of the calling thread. name must outlive the tracer, e.g. a
+  // string literal.
+  static void record(const char *name, std::int64_t begin_ns,
+                     std::int64_t end_ns);
+
+  // Write the zones of every thread that ever recorded one.
+  static void write_chrome_json(std::ostream &out);
+
+  // Write the trace to a file. Returns false on an I/O error.
+  static bool write_chrome_json(const std::string &path);
+
+  static inline std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+ private:
+  // Single writer ring buffer. The fields are atomics so that the trace
+  // writer may read a slot that is being overwritten; such slots are detected
+  // by comparing the head before and after the copy and discarded.
+  struct Zone {
+    std::atomic<const char *> name{nullptr};
+    std::atomic<std::int64_t> begin_ns{0};
+    std::atomic<std::int64_t> end_ns{0};
+  };
+
+  struct ThreadBuffer {
+    std::uint64_t tid;
+    std::mutex name_mutex;
+    std::string name;
+    std::atomic<std::uint64_t> head{0};
+    std::array<Zone, kThreadBufferSize> zones;
+  };
+
+  static std::atomic<bool> s_enabled;
+  static std::mutex s_mutex;
+  static std::vector<std::shared_ptr<ThreadBuffer>> s_buffers;
+
+  static ThreadBuffer &thread_buffer();
+};
+
+// TraceZone records the scope it lives in as a zone of the calling thread.
+class TraceZone {
+ public:
+  explicit TraceZone(const char *name)
+      : m_name(name), m_begin(Tracer::enabled() ? Tracer::now() : 0) {}
+
+  ~TraceZone() {
+    if (m_begin != 0) {
+      Tracer::record(m_name, m_begin, Tracer::now());
+    }
+  }
+
+  TraceZone(const TraceZone &) = delete;
+  TraceZone &operator=(const TraceZone &) = delete;
+
+ private:
+  const char *m_name;
+  std::int64_t m_begin;
+};
+
+#define NES_TRACE_CONCAT_(a, b) a##b
+#define NES_TRACE_CONCAT(a, b) NES_TRACE_CONCAT_(a, b)
+
+// Trace the rest of the enclosing scope as a zone named name.
+#define NES_TRACE_ZONE(name) \
+  TraceZone NES_TRACE_CONCAT(nes_trace_zone_, __LINE__)(name)
+
+#endif  // NES_BASE_TRACE_
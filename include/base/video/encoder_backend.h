@@ -0,0 +1,74 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_VIDEO_ENCODER_BACKEND_
+#define NES_BASE_VIDEO_ENCODER_BACKEND_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/video/type_managers.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"  // AVCodecContext, AVCodecID
+#include "libavutil/dict.h"      // AVDictionary
+}
+
+// EncoderBackend maps the encoder settings of the server to the options of one
+// libavcodec encoder. The settings use the vocabulary of x264: presets from
+// ultrafast to veryslow and a comma separated list of tunes, of which
+// "zerolatency" asks for an encoder without lookahead or frame reordering.
+// Each backend translates them to the nearest options of its encoder.
+class EncoderBackend {
+ public:
+  // Features of an encoder the pipeline may depend on.
+  struct Capabilities {
+    // Packets are Annex B byte streams that begin with a start code.
+    bool annex_b = false;
+    // Frames can be encoded without lookahead or reordering.
+    bool zero_latency = false;
+    // Key frames can be replaced by a moving column of intra blocks, see
+    // CodecInitInfo::intra_refresh.
+    bool intra_refresh = false;
+    // The bitrate can be changed while the encoder is open.
+    bool bit_rate_reconfig = false;
+  };
+
+  virtual ~EncoderBackend() = default;
+
+  // Name of the libavcodec encoder, e.g. "libx264".
+  virtual const char *name() const = 0;
+
+  virtual AVCodecID codec_id() const = 0;
+
+  virtual Capabilities capabilities() const = 0;
+
+  // Set the options of info on ctx and options before the encoder is opened.
+  // The common fields of ctx (size, pixel format, bitrate and time base) are
+  // already set.
+  virtual void configure(
+      const types::AVCodecContextManager::CodecInitInfo &info,
+      AVCodecContext *ctx, AVDictionary **options) const = 0;
+
+  // Whether libavcodec was built with the encoder.
+  bool available() const;
+
+  // Whether the encoder can be opened with preset. Every backend accepts the
+  // x264 presets from ultrafast to veryslow.
+  virtual bool accepts_preset(const std::string &preset) const;
+
+  // Whether the encoder can be opened with tunes, a comma separated list of
+  // x264 tunes. At most one of them may be other than fastdecode and
+  // zerolatency.
+  virtual bool accepts_tune(const std::string &tunes) const;
+
+
+  // Returns the backend of the encoder name. Throws std::runtime_error if no
+  // backend has the name or libavcodec was built without the encoder.
+  static std::shared_ptr<const EncoderBackend> find(const std::string &name);
+
+  // Every backend, whether available or not.
+  static const std::vector<std::shared_ptr<const EncoderBackend>> &all();
+};
+
+#endif  // NES_BASE_VIDEO_ENCODER_BACKEND_
@@ -9,14 +9,16 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 
+#include "base/metrics.h"
 #include "base/video/rendered_frame.h"
 
 // Thread-safe Map implementation based on std::map used to store unique_ptr of
 // RenderedFrame.
 class FrameMap {
  public:
-  // Max size of FrameMap.
+  // Default max size of FrameMap.
   static constexpr std::size_t kFrameMapMaxSize = 100;
 
   // Timeout waiting for insert/get of FrameMap.
@@ -31,11 +33,27 @@ class FrameMap {
   using element = std::unique_ptr<RenderedFrame>;
   using keytype = std::uint64_t;
 
+  // The number of frames in the map is added to depth, which may be shared by
+  // several maps. insert() waits while the map holds max_size frames.
+  explicit FrameMap(std::shared_ptr<Gauge> depth = nullptr,
+                    std::size_t max_size = kFrameMapMaxSize);
+  ~FrameMap();
+
   void insert(keytype index, element &&el);
   element get_delete(keytype index);
 
+  // Lowest index of the frames in the map that is at least from, if any.
+  std::optional<keytype> next_index(keytype from);
+
+  // Change the number of frames insert() waits for. Frames held beyond a
+  // smaller size stay in the map.
+  void set_max_size(std::size_t max_size);
+
  private:
   std::map<keytype, element> m_map;
+  std::shared_ptr<Gauge> m_depth;
+  std::size_t m_max_size;
+  std::shared_ptr<Counter> m_dropped;
   std::condition_variable m_getter, m_inserter;
   std::mutex m_mutex;
   using unique_lock = std::unique_lock<std::mutex>;
@@ -10,13 +10,14 @@
 #include <mutex>
 #include <queue>
 
+#include "base/metrics.h"
 #include "base/video/rendered_frame.h"
 
 // Thread-safe queue implementation based on std::queue used to store unique_ptr
 // of RenderedFrame.
 class FrameQueue {
  public:
-  // Max size of FrameQueue.
+  // Default max size of FrameQueue.
   static constexpr std::size_t kFrameQueueMaxSize = 100;
 
   // Timeout of push/pop operation.
@@ -24,11 +25,23 @@ class FrameQueue {
 
   using element = std::unique_ptr<RenderedFrame>;
 
+  // The number of queued frames is added to depth, which may be shared by
+  // several queues. push() waits while max_size frames are queued.
+  explicit FrameQueue(std::shared_ptr<Gauge> depth = nullptr,
+                      std::size_t max_size = kFrameQueueMaxSize);
+  ~FrameQueue();
+
   void push(element &&el);
   element pop();
 
+  // Change the number of frames push() waits for. Frames queued beyond a
+  // smaller size stay queued.
+  void set_max_size(std::size_t max_size);
+
  private:
   std::queue<element> m_queue;
+  std::shared_ptr<Gauge> m_depth;
+  std::size_t m_max_size;
   std::condition_variable m_pusher, m_popper;
   std::mutex m_mutex;
   using unique_lock = std::unique_lock<std::mutex>;
@@ -3,15 +3,20 @@
 #ifndef NES_BASE_VIDEO_RENDER_TEXT_
 #define NES_BASE_VIDEO_RENDER_TEXT_
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "base/video/type_managers.h"
 
-extern "C" {
-#include "freetype2/ft2build.h"
-#include FT_FREETYPE_H
-}
-
+// RenderTextContext draws text into the luma plane of converted frames. The
+// glyphs of the printable ASCII characters are rasterized once when the
+// context is created and kept in an atlas, so drawing only blends the
+// pre-rasterized coverage into the plane. The atlas is immutable after
+// construction; any number of threads may draw at the same time without
+// locking.
 class RenderTextContext {
  public:
   enum RenderPosition {
@@ -22,20 +27,35 @@ class RenderTextContext {
     RENDER_POSITION_CENTER
   };
 
+  // Rasterize the glyphs of the font at font_location. Throws
+  // std::runtime_error if the font cannot be loaded.
   RenderTextContext(std::string font_location);
 
+  // Draw content in white at the position of the frame, which must have an
+  // 8-bit luma or gray first plane, e.g. YUV420P. '\n' starts a new line.
+  // Characters outside the printable ASCII range are drawn as '?'.
   void render_string_to_frame(types::FrameManager &frame,
                               RenderTextContext::RenderPosition opt,
-                              std::string content);
-
-  ~RenderTextContext();
+                              const std::string &content) const;
 
  private:
-  FT_Library _library;
-  FT_Face _face;
-  std::mutex m_mutex;
-  std::condition_variable m_wait;
-  using unique_lock = std::unique_lock<std::mutex>;
+  static constexpr char kFirstChar = ' ';
+  static constexpr char kLastChar = '~';
+
+  // A rasterized glyph. Its coverage is stored in the atlas row by row.
+  struct Glyph {
+    int left;
+    int top;
+    int width;
+    int rows;
+    int advance;
+    std::size_t offset;
+  };
+
+  std::array<Glyph, kLastChar - kFirstChar + 1> m_glyphs;
+  std::vector<std::uint8_t> m_atlas;
+
+  const Glyph &glyph(char ch) const;
 };
 
 #endif  // NES_BASE_VIDEO_RENDER_TEXT_
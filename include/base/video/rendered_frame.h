@@ -3,6 +3,11 @@
 #ifndef NES_BASE_RENDERED_FRAME_
 #define NES_BASE_RENDERED_FRAME_
 
+#include <memory>
+
+#include "base/frame_trace.h"
+#include "base/trace.h"
+#include "base/video/stereo_packing.h"
 #include "base/video/type_managers.h"
 #include "nes.pb.h"
 
@@ -12,25 +17,31 @@
 // texts. It converts the RGB image to YUV image using swscale and stores it in
 // m_converted_avframe_scene. After the image is ready, the program provides the
 // converted image to the encoder.
+//
+// The converted frames take the size the encoders expect when the frame is
+// converted, not when it is rendered, so frames rendered before a resolution
+// change are scaled to the new size. With a StereoLayout, the frames take the
+// size of one eye in the packed frames of the encoders.
 class RenderedFrame {
  public:
   RenderedFrame(nesproto::RenderedFrame frame, AVPixelFormat pix_fmt_scene,
                 AVPixelFormat pix_fmt_depth,
                 std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-                std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth);
+                std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
+                StereoLayout layout = StereoLayout::NONE);
 
   // Convert frame stored in m_source_avframe from RGB to YUV and store it in
-  // m_converted_avframe_scene.
-  inline void convert_frame() {
-    if (m_converted) {
-      throw std::runtime_error{"Tried to convert a converted RenderedFrame."};
-    }
-    types::SwsContextManager sws_context_scene(m_source_avframe_scene,
-                                               m_converted_avframe_scene);
-    types::SwsContextManager sws_context_depth(m_source_avframe_depth,
-                                               m_converted_avframe_depth);
-    m_converted = true;
-  }
+  // m_converted_avframe_scene, at the size given by
+  // AVCodecContextManager::frame_info() of the encoders.
+  void convert_frame();
+
+  // Scale the converted frames to the sizes of scene_info and depth_info if
+  // they differ, for frames converted before the encoders switched their
+  // resolution. The infos are those of the encoders, or of one eye with a
+  // StereoLayout. Returns whether any frame was scaled.
+  bool fit_converted(
+      const types::AVCodecContextManager::CodecInitInfo &scene_info,
+      const types::AVCodecContextManager::CodecInitInfo &depth_info);
 
   // Index of the frame.
   const inline uint64_t index() const { return this->m_frame_response.index(); }
@@ -47,25 +58,32 @@ class RenderedFrame {
     return m_source_avframe_scene;
   }
 
-  // Converted YUV frame.
+  // Converted YUV frame. Only valid after convert_frame().
   inline types::FrameManager &converted_frame_scene() {
-    return m_converted_avframe_scene;
+    return *m_converted_avframe_scene;
   }
 
-  // Converted YUV depth frame.
+  // Converted YUV depth frame. Only valid after convert_frame().
   inline types::FrameManager &converted_frame_depth() {
-    return m_converted_avframe_depth;
+    return *m_converted_avframe_depth;
   }
 
+  // Timestamps of the stages the frame went through.
+  inline FrameTrace &trace() { return m_trace; }
+
  private:
   nesproto::RenderedFrame m_frame_response;
+  std::shared_ptr<types::AVCodecContextManager> m_ctxmgr_scene;
+  std::shared_ptr<types::AVCodecContextManager> m_ctxmgr_depth;
+  StereoLayout m_layout;
   types::FrameManager m_source_avframe_scene;
-  types::FrameManager m_converted_avframe_scene;
+  std::unique_ptr<types::FrameManager> m_converted_avframe_scene;
   AVPixelFormat m_pix_fmt_scene;
   types::FrameManager m_source_avframe_depth;
-  types::FrameManager m_converted_avframe_depth;
+  std::unique_ptr<types::FrameManager> m_converted_avframe_depth;
   AVPixelFormat m_pix_fmt_depth;
   bool m_converted;
+  FrameTrace m_trace;
 };
 
 #endif  // NES_BASE_RENDERED_FRAME_
@@ -0,0 +1,39 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#ifndef NES_BASE_VIDEO_STEREO_PACKING_
+#define NES_BASE_VIDEO_STEREO_PACKING_
+
+#include <string>
+
+#include "base/video/type_managers.h"
+
+// Arrangement of the two eyes in the frames of one encoder. Without packing,
+// every eye has its own encoders. A packed frame holds the left eye in its
+// left (or top) half and the right eye in the other half, so both eyes share
+// one encoder, its pts and its key frames.
+enum class StereoLayout {
+  NONE,
+  SIDE_BY_SIDE,
+  TOP_BOTTOM,
+};
+
+// Parse "none", "side_by_side" or "top_bottom". Throws std::runtime_error for
+// any other name.
+StereoLayout parse_stereo_layout(const std::string &name);
+
+const char *stereo_layout_name(StereoLayout layout);
+
+// Encoder configuration holding eye frames of the size of info.
+types::AVCodecContextManager::CodecInitInfo packed_info(
+    StereoLayout layout, types::AVCodecContextManager::CodecInitInfo info);
+
+// Eye frame configuration of an encoder configured with info.
+types::AVCodecContextManager::CodecInitInfo eye_info(
+    StereoLayout layout, types::AVCodecContextManager::CodecInitInfo info);
+
+// Copy eye into its half of packed. Both frames must have the same planar
+// pixel format, and eye must have the eye size of packed.
+void pack_eye(StereoLayout layout, bool is_left, types::FrameManager &eye,
+              types::FrameManager &packed);
+
+#endif  // NES_BASE_VIDEO_STEREO_PACKING_
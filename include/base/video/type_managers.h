@@ -3,21 +3,33 @@
 #ifndef NES_BASE_VIDEO_TYPE_MANAGERS_
 #define NES_BASE_VIDEO_TYPE_MANAGERS_
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
+#include "base/frame_trace.h"
 #include "base/logging.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"  // AVPacket, AVCodecContext
-#include "libavutil/imgutils.h"  // av_image_alloc(), av_image_fill_pointers()
+#include "libavutil/imgutils.h"  // av_image_alloc()
 #include "libavutil/opt.h"       // av_opt_set()
 #include "libswscale/swscale.h"  // SwsContext
 }
 
+class EncoderBackend;
+
 namespace types {
 
 // Turn AVError errnum to a human-readable error string.
@@ -48,6 +60,10 @@ class AVDictionaryManager {
   // Access the stored AVDictionary.
   inline AVDictionary *operator()() { return m_dict; }
 
+  // Address of the stored AVDictionary for av_dict_set() and avcodec_open2(),
+  // which may replace it.
+  inline AVDictionary **address() { return &m_dict; }
+
  private:
   // AVDictionary will be automatically allocated by av_dict_set(), no need for
   // a ctor.
@@ -61,39 +77,55 @@ class AVDictionaryManager {
 // protected with a shared mutex m_codec_info_mutex. Multiple reads
 // are allowed but when a thread wants to write, it has to wait for all readers
 // to unlock the mutex. The AVCodecContext is protected with a normal mutex
-// m_codec_context_mutex to prevent concurrent operations. When the encoder
-// needs to be reinitalized (e.g. due to resolution change), the manager
-// acquires both the write lock for m_codec_info_mutex and m_codec_context_mutex
-// to prevent anyone from accessing the codec. Then the value of CodecInitInfo
-// is changed and the encoder is reinitalized according to it.
+// m_codec_context_mutex to prevent concurrent operations.
+//
+// A configuration change never stalls the encoder in use. The bitrate is
+// changed in place. For anything else, e.g. the resolution or the preset,
+// reconfigure() opens a new encoder on a builder thread. Once it is ready,
+// frames are converted for it, and the sender switches to it at the next
+// frame boundary with cut_over(). The old encoder is flushed and its
+// remaining packets are received before the first packet of the new encoder,
+// which always starts with a key frame.
 class AVCodecContextManager {
  public:
   // CodecInitInfo stores the configuration data for the encoder. This
   // information is used to provide current configuration state of the
   // encoder to the program and reinitalizing the encoder.
   struct CodecInitInfo {
-    CodecInitInfo(AVCodecID codec_id, AVPixelFormat pix_fmt,
-                  std::string x264_encode_preset, std::string x264_encode_tune,
+    CodecInitInfo(std::string encoder, AVPixelFormat pix_fmt,
+                  std::string encode_preset, std::string encode_tune,
                   unsigned width, unsigned height, unsigned bit_rate,
-                  unsigned fps, unsigned keyframe_interval)
-        : codec_id(codec_id),
+                  unsigned fps, unsigned keyframe_interval,
+                  bool intra_refresh = false)
+        : encoder(encoder),
           pix_fmt(pix_fmt),
-          x264_encode_preset(x264_encode_preset),
-          x264_encode_tune(x264_encode_tune),
+          encode_preset(encode_preset),
+          encode_tune(encode_tune),
           width(width),
           height(height),
           bit_rate(bit_rate),
           fps(fps),
-          keyframe_interval(keyframe_interval) {}
-    AVCodecID codec_id;
+          keyframe_interval(keyframe_interval),
+          intra_refresh(intra_refresh) {}
+    // Name of the EncoderBackend, e.g. "libx264".
+    std::string encoder;
     AVPixelFormat pix_fmt;
-    std::string x264_encode_preset;
-    std::string x264_encode_tune;
+    // x264 style preset and comma separated tunes, translated by the backend.
+    std::string encode_preset;
+    std::string encode_tune;
     unsigned width;
     unsigned height;
     unsigned bit_rate;
     unsigned fps;
     unsigned keyframe_interval;
+    // Replace the periodic key frames with a column of intra blocks sweeping
+    // the frame every keyframe_interval frames, which spreads the cost of a
+    // key frame over the frames. Only the first frame is an IDR frame; later
+    // key frames are recovery points. Requires an encoder with the
+    // intra_refresh capability.
+    bool intra_refresh;
+
+    bool operator==(const CodecInitInfo &) const = default;
   };
 
   // CodecInfoProvider encapsulates CodecInitInfo. The reader of CodecInitInfo
@@ -115,23 +147,89 @@ class AVCodecContextManager {
     std::shared_lock<std::shared_mutex> m_lock;
   };
 
+  // Time base of the encoders. The pts of a frame is its frame time in this
+  // unit, so frames rendered at an irregular rate are encoded with their real
+  // timing and clients can schedule their display.
+  static constexpr AVRational kTimeBase = {1, 90000};
+
+  // Maximum number of traces of frames waiting inside the encoder.
+  static constexpr std::size_t kMaxPendingTraces = 256;
+
+  // Minimum time between key frames forced by request_keyframe(). Requests
+  // made sooner are coalesced into one key frame at the end of the interval.
+  static constexpr std::chrono::milliseconds kMinForcedKeyframeInterval{500};
+
+  // Throws std::runtime_error if the encoder of info is unknown or
+  // unavailable, lacks intra refresh asked for by info, or cannot be opened
+  // with info.
   AVCodecContextManager(CodecInitInfo info);
 
+  // The backend of the encoder, which does not change over the lifetime of
+  // the manager.
+  inline const EncoderBackend &backend() const { return *m_backend; }
+
   inline CodecInfoProvider get_codec_info() {
     return CodecInfoProvider{m_info, m_codec_info_mutex};
   }
 
-  // Locks both m_codec_info_mutex and m_codec_context_mutex
-  // to ensure no thread is doing any operation while reinitialization and
-  // updates CodecInitInfo with the requested width and height and calls
-  // codec_ctx_init().
+  // Apply edit to the latest requested configuration and return
+  // immediately. A change of the bitrate alone is applied in place with
+  // set_bit_rate(). Any other change opens an encoder in the background; a
+  // request made while an encoder is being opened replaces the pending one,
+  // and requesting the configuration of the encoder in use cancels the
+  // change. If the encoder cannot be opened, the error is logged and the
+  // encoder in use is kept. Throws std::runtime_error if the edit changes the
+  // encoder or the pixel format, or asks for an unsupported intra refresh.
+  void reconfigure(const std::function<void(CodecInitInfo &)> &edit);
+
+  // Change the resolution; see reconfigure().
   void change_resolution(unsigned width, unsigned height);
 
-  // Thread safe wrapper for avcodec_send_frame().
-  int send_frame(AVFrame *frm);
+  // Configuration frames should be converted for: that of the encoder opened
+  // by reconfigure() if it is ready, otherwise that of the encoder in use.
+  CodecInitInfo frame_info();
+
+  // Switch to the encoder opened by reconfigure() if it is ready, and
+  // return the configuration of the encoder in use. The next frame must have
+  // its size. Must be called by the thread that sends the frames, before
+  // every frame.
+  CodecInitInfo cut_over();
+
+  // Change the bitrate of the encoder. Encoders with the bit_rate_reconfig
+  // capability apply it from the next frame; the others keep their bitrate
+  // until they are reopened by reconfigure().
+  void set_bit_rate(unsigned bit_rate);
+
+  // Ask for an IDR frame, e.g. for a client that joined or lost packets. The
+  // next frame sent is forced to be one, subject to
+  // kMinForcedKeyframeInterval. With intra refresh, a new refresh sweep
+  // starting with a recovery point is forced instead. Safe to call from any
+  // thread.
+  inline void request_keyframe() {
+    m_keyframe_requested.store(true, std::memory_order_relaxed);
+  }
+
+  // Stop encoding while the stream has no viewers: send_frame() drops the
+  // frames. The first frame after resuming is a key frame, whose pts follows
+  // the last frame by one frame interval, so the rate control does not take
+  // the suspension for one long frame. Safe to call from any thread.
+  void set_suspended(bool suspended);
 
-  // Thread safe wrapper for avcodec_receive_packet().
-  int receive_packet(AVPacket *pkt);
+  inline bool suspended() const {
+    return m_suspended.load(std::memory_order_relaxed);
+  }
+
+  // Thread safe wrapper for avcodec_send_frame(). The pts of frm is set to
+  // trace.frame_time (now if unset) in kTimeBase, raised if needed to stay
+  // after the pts of the previous frame. The trace is kept until the packet
+  // with the same pts is received. The frame is made a key frame if one was
+  // requested. Returns 0 without encoding the frame while suspended.
+  int send_frame(AVFrame *frm, const FrameTrace &trace);
+
+  // Thread safe wrapper for avcodec_receive_packet(). The remaining packets
+  // of the encoders replaced by cut_over() are received first. On success,
+  // trace is filled with the trace of the frame the packet was encoded from.
+  int receive_packet(AVPacket *pkt, FrameTrace *trace);
 
   ~AVCodecContextManager();
 
@@ -141,11 +239,39 @@ class AVCodecContextManager {
   std::mutex m_codec_context_mutex;
   std::condition_variable m_codec_context_waiter;
   CodecInitInfo m_info;
-  bool m_opened = false;
+  std::shared_ptr<const EncoderBackend> m_backend;
+  // Flushed encoders whose packets have not all been received, oldest first.
+  std::deque<AVCodecContext *> m_retired;
+  // Traces of the frames inside the encoder, keyed by pts.
+  std::map<int64_t, FrameTrace> m_traces;
+  std::atomic<bool> m_keyframe_requested{false};
+  // Time of the last forced key frame, protected by m_codec_context_mutex.
+  std::chrono::steady_clock::time_point m_last_forced_keyframe;
+  std::atomic<bool> m_suspended{false};
+  // The next frame sent is the first after a suspension.
+  std::atomic<bool> m_resuming{false};
+  // Pts of the last frame sent, and the time left out of the pts by
+  // suspensions, protected by m_codec_context_mutex.
+  std::int64_t m_last_pts = AV_NOPTS_VALUE;
+  std::int64_t m_pts_offset = 0;
   using unique_lock = std::unique_lock<std::mutex>;
 
-  // Initializes or reinitializes AVCodecContext.
-  void codec_ctx_init();
+  // State of the encoder opened by reconfigure(), protected by
+  // m_build_mutex. m_generation counts the requests; an encoder is only kept
+  // if no request was made while it was opened.
+  std::mutex m_build_mutex;
+  std::thread m_builder;
+  bool m_building = false;
+  std::uint64_t m_generation = 0;
+  std::optional<CodecInitInfo> m_pending;
+  AVCodecContext *m_ready = nullptr;
+  std::optional<CodecInitInfo> m_ready_info;
+
+  // Open an encoder with info. Throws std::runtime_error on failure.
+  AVCodecContext *open_encoder(const CodecInitInfo &info) const;
+
+  // Body of m_builder. Opens encoders until no request is pending.
+  void build_encoders();
 };
 
 // FrameManager manages an individual frame in FrameData struct. A frame could
@@ -153,9 +279,7 @@ class AVCodecContextManager {
 // filled. The manager stores FrameContext along with the frame, which specifies
 // the properties of the current frame (or the frame that is to be filled
 // later). FrameManager can export the frame as libavcodec's AVFrame struct
-// using AVFrameWrapper. The wrapper is necessary because we can't have two or
-// more AVFrames at the same time.
-// XXX: Find whether we could reuse AVFrames.
+// using AVFrameWrapper, which borrows the buffer of the FrameManager.
 class FrameManager {
  public:
   // This value allows the encoder to align the buffer to use fast/aligned SIMD
@@ -177,16 +301,19 @@ class FrameManager {
         : width(codecinfo->width),
           height(codecinfo->height),
           pix_fmt(codecinfo->pix_fmt) {}
+    FrameContext(const types::AVCodecContextManager::CodecInitInfo &info)
+        : width(info.width), height(info.height), pix_fmt(info.pix_fmt) {}
     unsigned width;
     unsigned height;
     AVPixelFormat pix_fmt;
   };
 
   // A wrapper for libavcodec's AVFrame that supports creation using
-  // FrameData and proper destruction.
+  // FrameData and proper destruction. The AVFrame refers to the buffer of the
+  // FrameManager, which must outlive the wrapper.
   class AVFrameWrapper {
    public:
-    // Allocate an AVFrame using FrameData and FrameContext
+    // Allocate an AVFrame pointing to FrameData.
     AVFrameWrapper(FrameData &data, FrameContext &context) {
       m_avframe = av_frame_alloc();
 
@@ -197,34 +324,20 @@ class FrameManager {
       m_avframe->format = context.pix_fmt;
       m_avframe->width = context.width;
       m_avframe->height = context.height;
-
-      if (int ret = av_image_alloc(m_avframe->data, m_avframe->linesize,
-                                   context.width, context.height,
-                                   context.pix_fmt, kBufferSizeAlignValueBytes);
-          ret < 0) {
-        throw std::runtime_error{
-            std::string("AVFrameWrapper: Failed to allocate AVFrame data: ") +
-            averror_explain(ret)};
-      }
-
-      if (int ret = av_image_fill_pointers(m_avframe->data, context.pix_fmt,
-                                           context.height, data.data[0],
-                                           data.linesize);
-          ret < 0) {
-        throw std::runtime_error{
-            std::string("AVFrameWrapper: Failed to fill pointer: ") +
-            averror_explain(ret)};
+      for (int plane = 0; plane < AV_NUM_DATA_POINTERS; plane++) {
+        m_avframe->data[plane] = data.data[plane];
+        m_avframe->linesize[plane] = data.linesize[plane];
       }
     }
 
+    AVFrameWrapper(const AVFrameWrapper &) = delete;
+    AVFrameWrapper &operator=(const AVFrameWrapper &) = delete;
+
     // Returns the stored AVFrame.
     inline AVFrame *get() { return m_avframe; }
 
-    ~AVFrameWrapper() {
-      av_frame_unref(m_avframe);
-      av_freep(&m_avframe->data[0]);
-      av_frame_free(&m_avframe);
-    }
+    // The frame holds no buffer reference, so only the AVFrame is freed.
+    ~AVFrameWrapper() { av_frame_free(&m_avframe); }
 
    private:
     AVFrame *m_avframe;
@@ -8,9 +8,15 @@
 #ifndef _ENCODE_H_
 #define _ENCODE_H_
 
+#include <string>
+#include <vector>
+
+#include "base/latency_stats.h"
+#include "base/server/packet_sink.h"
 #include "base/video/frame_map.h"
 #include "base/video/frame_queue.h"
 #include "base/video/render_text.h"
+#include "base/video/stereo_packing.h"
 #include "base/video/type_managers.h"
 
 void process_frame_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
@@ -25,12 +31,30 @@ void send_frame_thread(
     std::shared_ptr<FrameMap> encode_queue,
     std::atomic<bool> &shutdown_requested);
 
+// Pack frame n of both eyes into one frame per stream type and send it to
+// the shared encoders.
+void send_packed_frame_thread(
+    std::shared_ptr<types::AVCodecContextManager> scene_codecctx,
+    std::shared_ptr<types::AVCodecContextManager> depth_codecctx,
+    std::shared_ptr<FrameMap> encode_queue_left,
+    std::shared_ptr<FrameMap> encode_queue_right, StereoLayout layout,
+    std::atomic<bool> &shutdown_requested);
+
 void receive_packet_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
-                           std::shared_ptr<PacketStreamServer> mctx,
+                           std::vector<std::shared_ptr<PacketSink>> sinks,
+                           std::shared_ptr<LatencyStats> latency_stats,
+                           std::string stream_name,
                            std::atomic<bool> &shutdown_requested);
 
-void encode_stats_thread(std::atomic<std::uint64_t> &frame_index_left,
-                         std::atomic<std::uint64_t> &frame_index_right,
+class SessionManager;
+
+void encode_stats_thread(std::shared_ptr<SessionManager> session_manager,
                          std::atomic<bool> &shutdown_requested);
 
+void session_reaper_thread(std::shared_ptr<SessionManager> session_manager,
+                           std::atomic<bool> &shutdown_requested);
+
+void viewer_monitor_thread(std::shared_ptr<SessionManager> session_manager,
+                           std::atomic<bool> &shutdown_requested);
+
 #endif  // _ENCODE_H_
@@ -12,28 +12,26 @@
 
 #include <thread>
 
-#include "base/camera_manager.h"
-#include "base/video/frame_queue.h"
-
-void socket_main_thread(
-    std::vector<std::string> renderers,
-    std::shared_ptr<FrameQueue> frame_queue_left,
-    std::shared_ptr<FrameQueue> frame_queue_right,
-    std::atomic<std::uint64_t> &frame_index_left,
-    std::atomic<std::uint64_t> &frame_index_right, std::atomic<int> &is_left,
-    std::shared_ptr<CameraManager> cameramgr,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
-    std::atomic<bool> &shutdown_requested);
-
-void socket_client_thread(
-    int targetfd, std::shared_ptr<FrameQueue> frame_queue_left,
-    std::shared_ptr<FrameQueue> frame_queue_right,
-    std::atomic<std::uint64_t> &frame_index_left,
-    std::atomic<std::uint64_t> &frame_index_right, std::atomic<int> &is_left,
-    std::shared_ptr<CameraManager> cameramgr,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
-    std::atomic<bool> &shutdown_requested);
+#include "base/capture.h"
+#include "base/renderer_list.h"
+#include "base/session_manager.h"
+
+// Keep a connection to every renderer of the list, following its changes,
+// until shutdown_requested is set.
+void socket_main_thread(std::shared_ptr<RendererList> renderers,
+                        std::shared_ptr<SessionManager> session_manager,
+                        std::atomic<bool> &shutdown_requested);
+
+void socket_client_thread(int targetfd, std::string renderer,
+                          std::shared_ptr<SessionManager> session_manager,
+                          std::atomic<bool> &shutdown_requested);
+
+// Feed the frames of capture to session in place of the renderers, and apply
+// its cameras. The records are replayed at speed times their original pace,
+// or as fast as the session takes them if speed is 0, loops times.
+void capture_replay_thread(std::shared_ptr<CaptureReader> capture,
+                           std::shared_ptr<Session> session, double speed,
+                           unsigned loops,
+                           std::atomic<bool> &shutdown_requested);
 
 #endif  // _SERVER_H_
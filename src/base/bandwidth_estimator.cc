@@ -0,0 +1,88 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/bandwidth_estimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+BandwidthEstimator::BandwidthEstimator(
+    Options options, unsigned initial_bit_rate,
+    std::chrono::microseconds frame_interval)
+    : m_options(options),
+      m_frame_interval(frame_interval),
+      m_target(clamp(initial_bit_rate)) {}
+
+double BandwidthEstimator::clamp(double bit_rate) const {
+  return std::clamp(bit_rate, (double)m_options.min_bit_rate,
+                    (double)m_options.max_bit_rate);
+}
+
+std::optional<unsigned> BandwidthEstimator::report(
+    const void *client, const nesproto::ClientFeedback &feedback) {
+  const auto now = clock::now();
+  std::scoped_lock lock{m_mutex};
+  // A new client starts from the target the session is encoded at.
+  ClientState &state =
+      m_clients.try_emplace(client, ClientState{(double)m_target})
+          .first->second;
+  state.last_report = now;
+
+  // A field the client cannot measure is 0 and does not count.
+  const double received = feedback.receive_bps();
+  bool congested = feedback.dropped_frames() > 0;
+  if (feedback.rtt_ms() > 0) {
+    if (state.min_rtt_ms == 0 || feedback.rtt_ms() < state.min_rtt_ms) {
+      state.min_rtt_ms = feedback.rtt_ms();
+    }
+    congested |= feedback.rtt_ms() > state.min_rtt_ms * kRttGrowthFactor +
+                                         kRttGrowthSlack.count();
+  }
+  const double frame_interval_ms = m_frame_interval.count() / 1000.0;
+  congested |= feedback.decode_ms() > frame_interval_ms;
+
+  if (congested) {
+    const double delivered = received > 0 ? received : state.estimate;
+    state.estimate =
+        clamp(std::min(state.estimate, delivered) * kDecreaseFactor);
+  } else if (received >= state.estimate * kMinUtilization) {
+    state.estimate = clamp(state.estimate * kIncreaseFactor);
+  }
+  return update_target(now);
+}
+
+std::optional<unsigned> BandwidthEstimator::forget(const void *client) {
+  std::scoped_lock lock{m_mutex};
+  if (m_clients.erase(client) == 0) {
+    return std::nullopt;
+  }
+  return update_target(clock::now());
+}
+
+void BandwidthEstimator::reset(unsigned bit_rate) {
+  std::scoped_lock lock{m_mutex};
+  m_target = clamp(bit_rate);
+  for (auto &[client, state] : m_clients) {
+    state.estimate = m_target;
+  }
+}
+
+std::optional<unsigned> BandwidthEstimator::update_target(
+    clock::time_point now) {
+  double slowest = std::numeric_limits<double>::infinity();
+  for (auto it = m_clients.begin(); it != m_clients.end();) {
+    if (now - it->second.last_report > kClientTimeout) {
+      it = m_clients.erase(it);
+      continue;
+    }
+    slowest = std::min(slowest, it->second.estimate);
+    ++it;
+  }
+  // Without clients reporting, the last target is kept.
+  if (std::isinf(slowest) ||
+      std::abs(slowest - m_target) < m_target * kMinChange) {
+    return std::nullopt;
+  }
+  m_target = slowest;
+  return m_target;
+}
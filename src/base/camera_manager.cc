@@ -2,68 +2,94 @@
 
 #include "base/camera_manager.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 
 #include "base/logging.h"
 #include "base/video/type_managers.h"
 #include "nes.pb.h"
 
+void CameraState::to_proto(bool is_left, nesproto::Camera *camera) const {
+  camera->set_is_left(is_left);
+  camera->set_width(width);
+  camera->set_height(height);
+  *camera->mutable_matrix() = {matrix, matrix + kMatrixSize};
+  camera->set_pose_id(pose_id);
+  camera->set_client_timestamp(client_timestamp);
+}
+
 CameraManager::CameraManager(
     std::shared_ptr<types::AVCodecContextManager> codec_scene_left,
     std::shared_ptr<types::AVCodecContextManager> codec_depth_left,
     std::shared_ptr<types::AVCodecContextManager> codec_scene_right,
     std::shared_ptr<types::AVCodecContextManager> codec_depth_right,
-    uint32_t default_width, uint32_t default_height)
+    uint32_t default_width, uint32_t default_height, StereoLayout layout)
     : m_codec_scene_left(codec_scene_left),
       m_codec_depth_left(codec_depth_left),
       m_codec_scene_right(codec_scene_right),
-      m_codec_depth_right(codec_depth_right) {
-  *m_camera_left.mutable_matrix() = {kInitialCameraMatrix,
-                                     kInitialCameraMatrix + 12};
-  m_camera_left.set_width(default_width);
-  m_camera_left.set_height(default_height);
+      m_codec_depth_right(codec_depth_right),
+      m_layout(layout) {
+  CameraState initial{};
+  std::copy(std::begin(kInitialCameraMatrix), std::end(kInitialCameraMatrix),
+            initial.matrix);
+  initial.width = default_width;
+  initial.height = default_height;
 
-  *m_camera_right.mutable_matrix() = {kInitialCameraMatrix,
-                                      kInitialCameraMatrix + 12};
-  m_camera_right.set_width(default_width);
-  m_camera_right.set_height(default_height);
+  m_camera_left.store(initial);
+  m_camera_right.store(initial);
 }
 
-void CameraManager::set_camera_left(nesproto::Camera camera) {
-  if (m_camera_left.width() != camera.width() ||
-      m_camera_left.height() != camera.height()) {
-    // Resolution changed. Reinitialize the encoder.
-
-    // Resolution must be divisible by 2.
-    if (camera.width() % 2 != 0) {
-      camera.set_width(camera.width() - 1);
-    }
-    if (camera.height() % 2 != 0) {
-      camera.set_height(camera.height() - 1);
-    }
+void CameraManager::set_camera_left(const nesproto::Camera &camera) {
+  update_camera(camera, m_camera_left, m_writer_mutex_left,
+                *m_codec_scene_left, *m_codec_depth_left);
+}
 
-    m_codec_scene_left->change_resolution(camera.width(), camera.height());
-    m_codec_depth_left->change_resolution(camera.width(), camera.height());
-  }
-  m_camera_left = camera;
+void CameraManager::set_camera_right(const nesproto::Camera &camera) {
+  update_camera(camera, m_camera_right, m_writer_mutex_right,
+                *m_codec_scene_right, *m_codec_depth_right);
 }
 
-void CameraManager::set_camera_right(nesproto::Camera camera) {
-  if (m_camera_right.width() != camera.width() ||
-      m_camera_right.height() != camera.height()) {
-    // Resolution changed. Reinitialize the encoder.
+void CameraManager::update_camera(const nesproto::Camera &camera,
+                                  SeqLock<CameraState> &state,
+                                  std::mutex &writer_mutex,
+                                  types::AVCodecContextManager &codec_scene,
+                                  types::AVCodecContextManager &codec_depth) {
+  std::scoped_lock lock{writer_mutex};
+  CameraState next = state.load();
+
+  // Resolution must be divisible by 2.
+  uint32_t width = camera.width() - camera.width() % 2;
+  uint32_t height = camera.height() - camera.height() % 2;
+
+  if (next.width != width || next.height != height) {
+    // Resolution changed. The encoders switch once the new ones are open;
+    // this does not wait for them. Packed encoders follow the eye that
+    // changed last.
+    const bool side_by_side = m_layout == StereoLayout::SIDE_BY_SIDE;
+    const bool top_bottom = m_layout == StereoLayout::TOP_BOTTOM;
+    codec_scene.change_resolution(side_by_side ? width * 2 : width,
+                                  top_bottom ? height * 2 : height);
+    codec_depth.change_resolution(side_by_side ? width * 2 : width,
+                                  top_bottom ? height * 2 : height);
+    next.width = width;
+    next.height = height;
+  }
 
-    // Resolution must be divisible by 2.
-    if (camera.width() % 2 != 0) {
-      camera.set_width(camera.width() - 1);
-    }
-    if (camera.height() % 2 != 0) {
-      camera.set_height(camera.height() - 1);
-    }
+  // Keep the previous values of a malformed matrix with missing elements.
+  std::copy_n(camera.matrix().begin(),
+              std::min(camera.matrix_size(), CameraState::kMatrixSize),
+              next.matrix);
+  next.pose_id = camera.pose_id();
+  next.client_timestamp = camera.client_timestamp();
+  next.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now().time_since_epoch())
+                          .count();
+  state.store(next);
 
-    m_codec_scene_right->change_resolution(camera.width(), camera.height());
-    m_codec_depth_right->change_resolution(camera.width(), camera.height());
+  if (m_capture) {
+    m_capture->write_camera(camera, next.timestamp_ns);
   }
-  m_camera_right = camera;
 }
@@ -0,0 +1,151 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/capture.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "base/logging.h"
+#include "base/trace.h"
+
+CaptureWriter::CaptureWriter(const std::string &path)
+    : m_path(path),
+      m_file(path, std::ios::binary | std::ios::trunc),
+      m_offset(sizeof(CaptureHeader)) {
+  if (!m_file) {
+    throw std::runtime_error{"CaptureWriter: Failed to open " + path + "."};
+  }
+  // The header is rewritten with the index when the capture is closed.
+  CaptureHeader header{};
+  std::memcpy(header.magic, CaptureHeader::kMagic, sizeof(header.magic));
+  m_file.write((const char *)&header, sizeof(header));
+}
+
+CaptureWriter::~CaptureWriter() { close(); }
+
+void CaptureWriter::write_camera(const nesproto::Camera &camera,
+                                 std::int64_t timestamp_ns) {
+  std::string payload = camera.SerializeAsString();
+  append(CaptureRecord::TYPE_CAMERA, camera.is_left(), payload.data(),
+         payload.size(), timestamp_ns);
+}
+
+void CaptureWriter::write_frame(const std::string &payload, bool is_left,
+                                std::int64_t timestamp_ns) {
+  append(CaptureRecord::TYPE_FRAME, is_left, payload.data(), payload.size(),
+         timestamp_ns);
+}
+
+void CaptureWriter::append(CaptureRecord::Type type, bool is_left,
+                           const char *data, std::size_t size,
+                           std::int64_t timestamp_ns) {
+  NES_TRACE_ZONE("CaptureWriter::append");
+  std::scoped_lock lock{m_mutex};
+  if (m_closed) {
+    return;
+  }
+  m_file.write(data, size);
+  m_index.push_back({timestamp_ns, m_offset, size, type, is_left});
+  m_offset += size;
+}
+
+void CaptureWriter::close() {
+  std::scoped_lock lock{m_mutex};
+  if (m_closed) {
+    return;
+  }
+  m_closed = true;
+
+  // Align the index so that a reader can use it in place.
+  const char padding[alignof(CaptureRecord)] = {};
+  std::size_t padding_size =
+      (alignof(CaptureRecord) - m_offset % alignof(CaptureRecord)) %
+      alignof(CaptureRecord);
+  m_file.write(padding, padding_size);
+
+  CaptureHeader header{};
+  std::memcpy(header.magic, CaptureHeader::kMagic, sizeof(header.magic));
+  header.index_offset = m_offset + padding_size;
+  header.record_count = m_index.size();
+  m_file.write((const char *)m_index.data(),
+               m_index.size() * sizeof(CaptureRecord));
+  m_file.seekp(0);
+  m_file.write((const char *)&header, sizeof(header));
+  m_file.close();
+
+  if (!m_file) {
+    tlog::error() << "CaptureWriter: Failed to write " << m_path << ".";
+  } else {
+    tlog::info() << "CaptureWriter: Wrote " << m_index.size()
+                 << " records to " << m_path << ".";
+  }
+}
+
+CaptureReader::CaptureReader(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"CaptureReader: Failed to open " + path + ": " +
+                             std::strerror(errno)};
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int error = errno;
+    ::close(fd);
+    throw std::runtime_error{"CaptureReader: Failed to stat " + path + ": " +
+                             std::strerror(error)};
+  }
+  m_length = st.st_size;
+  if (m_length < sizeof(CaptureHeader)) {
+    ::close(fd);
+    throw std::runtime_error{"CaptureReader: " + path +
+                             " is not a capture file."};
+  }
+  void *data = mmap(nullptr, m_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open.
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error{"CaptureReader: Failed to map " + path + ": " +
+                             std::strerror(errno)};
+  }
+  m_data = (const char *)data;
+  // Replay reads the payloads in order.
+  madvise(data, m_length, MADV_SEQUENTIAL);
+
+  const CaptureHeader *header = (const CaptureHeader *)m_data;
+  std::string error;
+  if (std::memcmp(header->magic, CaptureHeader::kMagic,
+                  sizeof(header->magic)) != 0) {
+    error = " is not a capture file.";
+  } else if (header->index_offset == 0) {
+    error = " was not closed.";
+  } else if (header->index_offset % alignof(CaptureRecord) != 0 ||
+             header->index_offset > m_length ||
+             header->record_count >
+                 (m_length - header->index_offset) / sizeof(CaptureRecord)) {
+    error = " has a corrupted index.";
+  }
+  if (error.empty()) {
+    m_index = (const CaptureRecord *)(m_data + header->index_offset);
+    m_record_count = header->record_count;
+    for (std::size_t i = 0; i < m_record_count; i++) {
+      if (m_index[i].offset < sizeof(CaptureHeader) ||
+          m_index[i].offset > header->index_offset ||
+          m_index[i].size > header->index_offset - m_index[i].offset) {
+        error = " has a corrupted index.";
+        break;
+      }
+    }
+  }
+  if (!error.empty()) {
+    munmap(data, m_length);
+    throw std::runtime_error{"CaptureReader: " + path + error};
+  }
+}
+
+CaptureReader::~CaptureReader() { munmap((void *)m_data, m_length); }
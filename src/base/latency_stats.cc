@@ -0,0 +1,109 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/latency_stats.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+LatencyStats::LatencyStats() {
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    // Buckets from 1 usec to 17 sec.
+    m_histograms[stage] = MetricsRegistry::global().histogram(
+        "nes_frame_latency_seconds",
+        "Latency of each stage of a frame, from the pose to the packet.", 1e-9,
+        10, 34, {{"stage", stage_name(static_cast<Stage>(stage))}});
+  }
+}
+
+void LatencyStats::record(const FrameTrace &trace) {
+  std::scoped_lock lock{m_mutex};
+  add_sample(STAGE_POSE_TO_REQUEST, trace.pose_received, trace.request_sent);
+  add_sample(STAGE_RENDER, trace.request_sent, trace.render_received);
+  add_sample(STAGE_PROCESS, trace.render_received, trace.processed);
+  add_sample(STAGE_ENCODE_WAIT, trace.processed, trace.encoder_in);
+  add_sample(STAGE_ENCODE, trace.encoder_in, trace.packet_out);
+  add_sample(STAGE_POSE_TO_PACKET, trace.pose_received, trace.packet_out);
+}
+
+void LatencyStats::add_sample(Stage stage, std::int64_t begin,
+                              std::int64_t end) {
+  if (begin == 0 || end == 0 || end < begin) {
+    return;
+  }
+  m_histograms[stage]->record(end - begin);
+  Window &window = m_windows[stage];
+  window.samples[window.next] = end - begin;
+  window.next = (window.next + 1) % kWindowSize;
+  window.count = std::min(window.count + 1, kWindowSize);
+}
+
+void LatencyStats::reset() {
+  std::scoped_lock lock{m_mutex};
+  for (Window &window : m_windows) {
+    window.count = 0;
+    window.next = 0;
+  }
+}
+
+LatencyStats::Percentiles LatencyStats::percentiles(Stage stage) {
+  std::vector<std::int64_t> samples;
+  {
+    std::scoped_lock lock{m_mutex};
+    const Window &window = m_windows[stage];
+    samples.assign(window.samples.begin(),
+                   window.samples.begin() + window.count);
+  }
+
+  Percentiles result;
+  result.count = samples.size();
+  if (samples.empty()) {
+    return result;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  auto at = [&](double quantile) {
+    std::size_t index = (std::size_t)(quantile * (samples.size() - 1));
+    return samples[index] / 1e6;
+  };
+  result.p50_ms = at(0.50);
+  result.p90_ms = at(0.90);
+  result.p99_ms = at(0.99);
+  result.max_ms = samples.back() / 1e6;
+  return result;
+}
+
+std::string LatencyStats::summary() {
+  std::ostringstream stream;
+  stream << std::fixed << std::setprecision(2);
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    Percentiles p = percentiles(static_cast<Stage>(stage));
+    stream << "\n  " << std::setw(16) << std::left
+           << stage_name(static_cast<Stage>(stage)) << std::right
+           << " p50=" << p.p50_ms << " p90=" << p.p90_ms
+           << " p99=" << p.p99_ms << " max=" << p.max_ms
+           << " msec (n=" << p.count << ")";
+  }
+  return stream.str();
+}
+
+const char *LatencyStats::stage_name(Stage stage) {
+  switch (stage) {
+    case STAGE_POSE_TO_REQUEST:
+      return "pose_to_request";
+    case STAGE_RENDER:
+      return "render";
+    case STAGE_PROCESS:
+      return "process";
+    case STAGE_ENCODE_WAIT:
+      return "encode_wait";
+    case STAGE_ENCODE:
+      return "encode";
+    case STAGE_POSE_TO_PACKET:
+      return "pose_to_packet";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/lpf_socket.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include "base/logging.h"
+#include "base/trace.h"
+
+int socket_send_blocking(int targetfd, uint8_t *buf, size_t size) {
+  ssize_t ret;
+  ssize_t sent = 0;
+
+  while (sent < size) {
+    ret = send(targetfd, buf + sent, size - sent, MSG_NOSIGNAL);
+    if (ret < 0) {
+      // Buffer is full. Try again.
+      if (errno == EAGAIN) {
+        continue;
+      }
+      // Misc error. Terminate the socket.
+      tlog::error() << "socket_send_blocking: "
+                    << std::string(std::strerror(errno));
+      return -errno;
+    }
+    sent += ret;
+  }
+
+  return 0;
+}
+
+// Send message with length prefix framing.
+int socket_send_blocking_lpf(int targetfd, uint8_t *buf, size_t size) {
+  NES_TRACE_ZONE("socket_send_blocking_lpf");
+  int ret;
+  // hack: not very platform portable
+  // but then, the program isn't.
+  if ((ret = socket_send_blocking(targetfd, (uint8_t *)&size, sizeof(size))) <
+      0) {
+    return ret;
+  }
+
+  if ((ret = socket_send_blocking(targetfd, buf, size)) < 0) {
+    return ret;
+  }
+
+  return ret;
+}
+
+int socket_receive_blocking(int targetfd, uint8_t *buf, size_t size) {
+  ssize_t ret;
+  ssize_t recv = 0;
+
+  while (recv < size) {
+    ret = read(targetfd, buf + recv, size - recv);
+    if (ret < 0) {
+      // Buffer is full. Try again.
+      if (errno == EAGAIN) {
+        continue;
+      }
+      // Misc error. Terminate the socket.
+      tlog::error() << "socket_receive_blocking: "
+                    << std::string(std::strerror(errno));
+      return -errno;
+    }
+    if (ret == 0 && recv < size) {
+      // Client disconnected while sending data. Terminate the socket.
+      tlog::error()
+          << "socket_receive_blocking: Received EOF when transfer is not done.";
+      return -1;
+    }
+    recv += ret;
+  }
+
+  return 0;
+}
+
+// Receive message with length prefix framing.
+std::string socket_receive_blocking_lpf(int targetfd) {
+  NES_TRACE_ZONE("socket_receive_blocking_lpf");
+  int ret;
+  size_t size;
+  // hack: not very platform portable
+  // todo: silently fail, do not wail error.
+  if ((ret = socket_receive_blocking(targetfd, (uint8_t *)&size,
+                                     sizeof(size))) < 0) {
+    throw std::runtime_error{
+        "socket_receive_blocking_lpf: Error while "
+        "receiving data size from socket."};
+  }
+
+  auto buffer = std::make_unique<char[]>(size);
+
+  if ((ret = socket_receive_blocking(targetfd, (uint8_t *)buffer.get(), size)) <
+      0) {
+    throw std::runtime_error{
+        "socket_receive_blocking_lpf: Error while receiving data from socket."};
+  }
+
+  return std::string(buffer.get(), buffer.get() + size);
+}
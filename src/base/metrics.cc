@@ -0,0 +1,212 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+Histogram::Histogram(double unit, unsigned min_exponent,
+                     unsigned max_exponent)
+    : m_unit(unit),
+      m_min_exponent(min_exponent),
+      m_max_exponent(max_exponent) {
+  if (min_exponent > max_exponent || max_exponent > 63) {
+    throw std::runtime_error{"Histogram: Invalid range of exponents."};
+  }
+}
+
+std::uint64_t Histogram::bucket_lower_bound(std::size_t index) {
+  if (index < kSubBucketCount) {
+    return index;
+  }
+  std::size_t shift = (index - kSubBucketCount) / kSubBucketCount;
+  std::uint64_t mantissa =
+      kSubBucketCount + (index - kSubBucketCount) % kSubBucketCount;
+  return mantissa << shift;
+}
+
+std::uint64_t Histogram::quantile(double q) const {
+  std::uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = (std::uint64_t)std::ceil(q * total);
+  if (rank == 0) {
+    rank = 1;
+  }
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBucketCount; i++) {
+    seen += m_buckets[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // Report the upper end of the bucket so that the quantile is never
+      // underestimated.
+      return i + 1 < kBucketCount ? bucket_lower_bound(i + 1)
+                                  : bucket_lower_bound(i) + 1;
+    }
+  }
+  // Samples recorded during the walk can make count() ahead of the buckets.
+  return bucket_lower_bound(kBucketCount - 1) + 1;
+}
+
+std::uint64_t Histogram::count_up_to_power(unsigned exponent) const {
+  std::size_t end = exponent >= 64 ? kBucketCount
+                                   : bucket_index(std::uint64_t{1} << exponent);
+  std::uint64_t result = 0;
+  for (std::size_t i = 0; i < end; i++) {
+    result += m_buckets[i].load(std::memory_order_relaxed);
+  }
+  return result;
+}
+
+MetricsRegistry &MetricsRegistry::global() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+MetricsRegistry::Family &MetricsRegistry::family(const std::string &name,
+                                                 const std::string &help,
+                                                 Type type) {
+  auto [it, inserted] = m_families.try_emplace(name);
+  if (inserted) {
+    it->second.type = type;
+    it->second.help = help;
+  } else if (it->second.type != type) {
+    throw std::runtime_error{"MetricsRegistry: Metric " + name +
+                             " is registered with another type."};
+  }
+  return it->second;
+}
+
+std::shared_ptr<Counter> MetricsRegistry::counter(const std::string &name,
+                                                  const std::string &help,
+                                                  const Labels &labels) {
+  std::scoped_lock lock{m_mutex};
+  auto &metric =
+      family(name, help, TYPE_COUNTER).counters[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Counter>();
+  }
+  return metric;
+}
+
+std::shared_ptr<Gauge> MetricsRegistry::gauge(const std::string &name,
+                                              const std::string &help,
+                                              const Labels &labels) {
+  std::scoped_lock lock{m_mutex};
+  auto &metric = family(name, help, TYPE_GAUGE).gauges[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Gauge>();
+  }
+  return metric;
+}
+
+std::shared_ptr<Histogram> MetricsRegistry::histogram(
+    const std::string &name, const std::string &help, double unit,
+    unsigned min_exponent, unsigned max_exponent, const Labels &labels) {
+  std::scoped_lock lock{m_mutex};
+  Family &f = family(name, help, TYPE_HISTOGRAM);
+  // Every series of a family must export the same buckets.
+  if (!f.histograms.empty()) {
+    const auto &first = f.histograms.begin()->second;
+    unit = first->unit();
+    min_exponent = first->min_exponent();
+    max_exponent = first->max_exponent();
+  }
+  auto &metric = f.histograms[format_labels(labels)];
+  if (!metric) {
+    metric = std::make_shared<Histogram>(unit, min_exponent, max_exponent);
+  }
+  return metric;
+}
+
+std::string MetricsRegistry::format_labels(const Labels &labels) {
+  if (labels.empty()) {
+    return "";
+  }
+  std::string result = "{";
+  for (std::size_t i = 0; i < labels.size(); i++) {
+    if (i) {
+      result += ',';
+    }
+    result += labels[i].first + "=\"";
+    for (char c : labels[i].second) {
+      switch (c) {
+        case '\\':
+          result += "\\\\";
+          break;
+        case '"':
+          result += "\\\"";
+          break;
+        case '\n':
+          result += "\\n";
+          break;
+        default:
+          result += c;
+      }
+    }
+    result += '"';
+  }
+  return result + "}";
+}
+
+namespace {
+
+// Append a label to labels rendered by format_labels.
+std::string with_label(const std::string &labels, const std::string &label) {
+  if (labels.empty()) {
+    return "{" + label + "}";
+  }
+  return labels.substr(0, labels.size() - 1) + "," + label + "}";
+}
+
+}  // namespace
+
+std::string MetricsRegistry::exposition() {
+  std::ostringstream out;
+  out.precision(9);
+
+  std::scoped_lock lock{m_mutex};
+  for (const auto &[name, f] : m_families) {
+    out << "# HELP " << name << " " << f.help << "\n";
+    switch (f.type) {
+      case TYPE_COUNTER:
+        out << "# TYPE " << name << " counter\n";
+        for (const auto &[labels, metric] : f.counters) {
+          out << name << labels << " " << metric->value() << "\n";
+        }
+        break;
+      case TYPE_GAUGE:
+        out << "# TYPE " << name << " gauge\n";
+        for (const auto &[labels, metric] : f.gauges) {
+          out << name << labels << " " << metric->value() << "\n";
+        }
+        break;
+      case TYPE_HISTOGRAM:
+        out << "# TYPE " << name << " histogram\n";
+        for (const auto &[labels, metric] : f.histograms) {
+          // Samples may be recorded while rendering. Clamp the buckets to the
+          // count read first so that no bucket exceeds +Inf.
+          std::uint64_t count = metric->count();
+          for (unsigned e = metric->min_exponent();
+               e <= metric->max_exponent(); e++) {
+            double bound = std::ldexp(metric->unit(), e);
+            std::ostringstream le;
+            le.precision(9);
+            le << "le=\"" << bound << "\"";
+            out << name << "_bucket" << with_label(labels, le.str()) << " "
+                << std::min(metric->count_up_to_power(e), count) << "\n";
+          }
+          out << name << "_bucket" << with_label(labels, "le=\"+Inf\"")
+              << " " << count << "\n";
+          out << name << "_sum" << labels << " "
+              << metric->sum() * metric->unit() << "\n";
+          out << name << "_count" << labels << " " << count << "\n";
+        }
+        break;
+    }
+  }
+  return out.str();
+}
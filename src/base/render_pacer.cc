@@ -0,0 +1,72 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/render_pacer.h"
+
+#include <algorithm>
+
+RenderPacer::RenderPacer(std::chrono::nanoseconds frame_interval)
+    : m_frame_interval(frame_interval) {}
+
+RenderPacer::clock::time_point RenderPacer::reserve(unsigned requests_per_frame,
+                                                    bool *late) {
+  std::scoped_lock lock{m_mutex};
+  const auto now = clock::now();
+  const auto lead = lead_locked();
+  const bool behind =
+      m_next_slot != clock::time_point{} &&
+      m_next_slot - lead + m_frame_interval < now;
+  if (m_next_slot == clock::time_point{} || behind) {
+    // Start the schedule with a request due now.
+    m_next_slot = now + lead;
+    m_slot_requests = 0;
+  }
+  if (late) {
+    *late = behind;
+  }
+  const auto due = m_next_slot - lead;
+  if (++m_slot_requests >= requests_per_frame) {
+    m_slot_requests = 0;
+    m_next_slot += m_frame_interval;
+  }
+  return due;
+}
+
+RenderPacer::clock::time_point RenderPacer::next_due() {
+  std::scoped_lock lock{m_mutex};
+  return due_locked();
+}
+
+RenderPacer::clock::time_point RenderPacer::due_locked() const {
+  if (m_next_slot == clock::time_point{}) {
+    return clock::now();
+  }
+  // A slot whose request is overdue is due now.
+  return std::max(m_next_slot - lead_locked(), clock::now());
+}
+
+void RenderPacer::record_rtt(std::chrono::nanoseconds rtt) {
+  std::scoped_lock lock{m_mutex};
+  if (m_srtt.count() == 0) {
+    m_srtt = rtt;
+    m_rttvar = rtt / 2;
+    return;
+  }
+  // The gains of RFC 6298.
+  const auto deviation = rtt > m_srtt ? rtt - m_srtt : m_srtt - rtt;
+  m_rttvar = (3 * m_rttvar + deviation) / 4;
+  m_srtt = (7 * m_srtt + rtt) / 8;
+}
+
+void RenderPacer::set_frame_interval(std::chrono::nanoseconds frame_interval) {
+  std::scoped_lock lock{m_mutex};
+  m_frame_interval = frame_interval;
+}
+
+std::chrono::nanoseconds RenderPacer::lead() {
+  std::scoped_lock lock{m_mutex};
+  return lead_locked();
+}
+
+std::chrono::nanoseconds RenderPacer::lead_locked() const {
+  return m_srtt + 2 * m_rttvar;
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/renderer_list.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+void check_address(const std::string &renderer) {
+  const auto separator = renderer.find(':');
+  const auto digits = renderer.size() - separator - 1;
+  if (separator == std::string::npos || separator == 0 || digits == 0 ||
+      digits > 5 ||
+      renderer.find_first_not_of("0123456789", separator + 1) !=
+          std::string::npos) {
+    throw std::runtime_error{"RendererList: Invalid renderer address " +
+                             renderer + "; expected ip:port."};
+  }
+  const unsigned long port = std::stoul(renderer.substr(separator + 1));
+  if (port == 0 || port > 65535) {
+    throw std::runtime_error{"RendererList: Invalid port of renderer " +
+                             renderer + "; expected 1 to 65535."};
+  }
+}
+
+}  // namespace
+
+void RendererList::check(const std::vector<std::string> &renderers) {
+  std::for_each(renderers.begin(), renderers.end(), check_address);
+}
+
+RendererList::RendererList(std::vector<std::string> renderers) {
+  set(std::move(renderers));
+}
+
+void RendererList::set(std::vector<std::string> renderers) {
+  check(renderers);
+  std::scoped_lock lock{m_mutex};
+  m_renderers = std::move(renderers);
+}
+
+std::vector<std::string> RendererList::get() {
+  std::scoped_lock lock{m_mutex};
+  return m_renderers;
+}
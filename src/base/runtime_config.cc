@@ -0,0 +1,192 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/runtime_config.h"
+
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "base/logging.h"
+#include "base/video/encoder_backend.h"
+
+namespace {
+
+using CodecInitInfo = types::AVCodecContextManager::CodecInitInfo;
+
+unsigned parse_positive(const std::string &name, const std::string &value) {
+  std::size_t end = 0;
+  unsigned long result = 0;
+  try {
+    result = std::stoul(value, &end);
+  } catch (const std::exception &) {
+    end = 0;
+  }
+  if (end == 0 || end != value.size() || value[0] == '-' || result == 0 ||
+      result > std::numeric_limits<unsigned>::max()) {
+    throw std::runtime_error{"RuntimeConfig: " + name +
+                             " must be a positive integer, got \"" + value +
+                             "\"."};
+  }
+  return (unsigned)result;
+}
+
+bool parse_bool(const std::string &name, const std::string &value) {
+  if (value == "1" || value == "true") {
+    return true;
+  }
+  if (value == "0" || value == "false") {
+    return false;
+  }
+  throw std::runtime_error{"RuntimeConfig: " + name +
+                           " must be true or false, got \"" + value + "\"."};
+}
+
+std::vector<std::string> split_renderers(const std::string &value) {
+  std::vector<std::string> renderers;
+  std::stringstream stream(value);
+  std::string renderer;
+  while (std::getline(stream, renderer, ',')) {
+    if (!renderer.empty()) {
+      renderers.push_back(renderer);
+    }
+  }
+  return renderers;
+}
+
+void check_preset(const CodecInitInfo &info, const std::string &preset) {
+  if (!EncoderBackend::find(info.encoder)->accepts_preset(preset)) {
+    throw std::runtime_error{"RuntimeConfig: Encoder " + info.encoder +
+                             " does not accept the preset " + preset + "."};
+  }
+}
+
+void check_tune(const CodecInitInfo &info, const std::string &tune) {
+  if (!EncoderBackend::find(info.encoder)->accepts_tune(tune)) {
+    throw std::runtime_error{"RuntimeConfig: Encoder " + info.encoder +
+                             " does not accept the tune \"" + tune + "\"."};
+  }
+}
+
+void check_intra_refresh(const CodecInitInfo &info) {
+  if (!EncoderBackend::find(info.encoder)->capabilities().intra_refresh) {
+    throw std::runtime_error{"RuntimeConfig: Encoder " + info.encoder +
+                             " does not support intra refresh."};
+  }
+}
+
+std::string json_string(const std::string &value) {
+  std::string result = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result + "\"";
+}
+
+}  // namespace
+
+RuntimeConfig::RuntimeConfig(std::shared_ptr<SessionManager> session_manager,
+                             std::shared_ptr<RendererList> renderers)
+    : m_session_manager(session_manager), m_renderers(renderers) {}
+
+void RuntimeConfig::apply(const std::map<std::string, std::string> &params) {
+  std::scoped_lock lock{m_mutex};
+  const CodecInitInfo scene_info = m_session_manager->scene_info();
+  const CodecInitInfo depth_info = m_session_manager->depth_info();
+
+  // Check every value first.
+  std::optional<std::string> preset, tune;
+  std::optional<unsigned> bit_rate, depth_bit_rate, fps, keyint, queue_size;
+  std::optional<bool> intra_refresh;
+  std::optional<std::vector<std::string>> renderers;
+  for (const auto &[name, value] : params) {
+    if (name == "preset") {
+      check_preset(scene_info, value);
+      check_preset(depth_info, value);
+      preset = value;
+    } else if (name == "tune") {
+      check_tune(scene_info, value);
+      check_tune(depth_info, value);
+      tune = value;
+    } else if (name == "bitrate") {
+      bit_rate = parse_positive(name, value);
+    } else if (name == "depth_bitrate") {
+      depth_bit_rate = parse_positive(name, value);
+    } else if (name == "fps") {
+      fps = parse_positive(name, value);
+    } else if (name == "keyint") {
+      keyint = parse_positive(name, value);
+    } else if (name == "intra_refresh") {
+      intra_refresh = parse_bool(name, value);
+      if (*intra_refresh) {
+        check_intra_refresh(scene_info);
+        check_intra_refresh(depth_info);
+      }
+    } else if (name == "queue_size") {
+      queue_size = parse_positive(name, value);
+    } else if (name == "renderers") {
+      if (!m_renderers) {
+        throw std::runtime_error{
+            "RuntimeConfig: The server has no renderers to change."};
+      }
+      renderers = split_renderers(value);
+      RendererList::check(*renderers);
+    } else {
+      throw std::runtime_error{"RuntimeConfig: Unknown parameter " + name +
+                               "."};
+    }
+  }
+  auto edit = [&](std::optional<unsigned> stream_bit_rate) {
+    return [&, stream_bit_rate](CodecInitInfo &info) {
+      info.encode_preset = preset.value_or(info.encode_preset);
+      info.encode_tune = tune.value_or(info.encode_tune);
+      info.bit_rate = stream_bit_rate.value_or(info.bit_rate);
+      info.fps = fps.value_or(info.fps);
+      info.keyframe_interval = keyint.value_or(info.keyframe_interval);
+      info.intra_refresh = intra_refresh.value_or(info.intra_refresh);
+    };
+  };
+  if (preset || tune || bit_rate || depth_bit_rate || fps || keyint ||
+      intra_refresh) {
+    m_session_manager->reconfigure(edit(bit_rate), edit(depth_bit_rate));
+  }
+  if (queue_size) {
+    m_session_manager->set_queue_size(*queue_size);
+  }
+  if (renderers) {
+    m_renderers->set(*renderers);
+  }
+  tlog::info() << "RuntimeConfig: Applied " << params.size()
+               << " parameter(s).";
+}
+
+std::string RuntimeConfig::json() {
+  const CodecInitInfo scene_info = m_session_manager->scene_info();
+  const CodecInitInfo depth_info = m_session_manager->depth_info();
+  std::ostringstream body;
+  body << "{\"scene_encoder\":" << json_string(scene_info.encoder)
+       << ",\"depth_encoder\":" << json_string(depth_info.encoder)
+       << ",\"preset\":" << json_string(scene_info.encode_preset)
+       << ",\"tune\":" << json_string(scene_info.encode_tune)
+       << ",\"bitrate\":" << scene_info.bit_rate
+       << ",\"depth_bitrate\":" << depth_info.bit_rate
+       << ",\"fps\":" << scene_info.fps
+       << ",\"keyint\":" << scene_info.keyframe_interval
+       << ",\"intra_refresh\":"
+       << (scene_info.intra_refresh ? "true" : "false")
+       << ",\"queue_size\":" << m_session_manager->queue_size()
+       << ",\"renderers\":[";
+  if (m_renderers) {
+    bool first = true;
+    for (const auto &renderer : m_renderers->get()) {
+      body << (first ? "" : ",") << json_string(renderer);
+      first = false;
+    }
+  }
+  body << "]}\n";
+  return body.str();
+}
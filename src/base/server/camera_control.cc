@@ -6,8 +6,9 @@
 #include "nes.pb.h"
 
 CameraControlServer::CameraControlServer(
-    std::shared_ptr<CameraManager> cameramgr, uint16_t bind_port)
-    : WebSocketServer(std::string("CameraControlServer"), bind_port),
+    std::shared_ptr<CameraManager> cameramgr, uint16_t bind_port,
+    std::shared_ptr<IoContextPool> io_pool)
+    : WebSocketServer(std::string("CameraControlServer"), bind_port, io_pool),
       m_camera_manager(cameramgr) {}
 
 void CameraControlServer::message_handler(websocketpp::connection_hdl hdl,
@@ -15,11 +16,7 @@ void CameraControlServer::message_handler(websocketpp::connection_hdl hdl,
   nesproto::Camera cam;
 
   if (cam.ParseFromString(msg->get_raw_payload())) {
-    if (cam.is_left()) {
-      m_camera_manager->set_camera_left(cam);
-    } else {
-      m_camera_manager->set_camera_right(cam);
-    }
+    m_camera_manager->set_camera(cam);
     if (m_message_count % kReceivedLoggingInterval == 0) {
       tlog::success() << "CameraControlServer: Receiving camera matrix...";
     }
@@ -0,0 +1,29 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/server/connection_registry.h"
+
+#include <memory>
+#include <mutex>
+
+void ConnectionRegistry::insert(std::shared_ptr<ConnectionContext> context) {
+  std::scoped_lock lock{m_writer_mutex};
+  auto next = std::make_shared<con_list>(*snapshot());
+  next->insert_or_assign(context->hdl, context);
+  m_snapshot.store(std::move(next), std::memory_order_release);
+}
+
+void ConnectionRegistry::erase(websocketpp::connection_hdl hdl) {
+  std::scoped_lock lock{m_writer_mutex};
+  auto next = std::make_shared<con_list>(*snapshot());
+  next->erase(hdl);
+  m_snapshot.store(std::move(next), std::memory_order_release);
+}
+
+std::shared_ptr<ConnectionContext> ConnectionRegistry::find(
+    websocketpp::connection_hdl hdl) const {
+  const auto connections = snapshot();
+  if (auto it = connections->find(hdl); it != connections->end()) {
+    return it->second;
+  }
+  return nullptr;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/server/io_context_pool.h"
+
+#include <stdexcept>
+
+#include "base/logging.h"
+#include "base/trace.h"
+
+IoContextPool::IoContextPool(unsigned thread_count)
+    : m_thread_count(thread_count) {
+  if (m_thread_count == 0) {
+    throw std::runtime_error{"IoContextPool: thread_count must be positive."};
+  }
+}
+
+void IoContextPool::start() {
+  if (!m_threads.empty()) {
+    throw std::runtime_error{"IoContextPool: Pool is already running."};
+  }
+  m_work = std::make_unique<io_service::work>(m_service);
+  for (unsigned i = 0; i < m_thread_count; i++) {
+    m_threads.emplace_back([this, i] {
+      Tracer::name_thread("io:" + std::to_string(i));
+      m_service.run();
+    });
+  }
+  tlog::success() << "IoContextPool: Started " << m_thread_count
+                  << " io thread(s).";
+}
+
+void IoContextPool::stop() {
+  // Let the threads return once the servers have closed their connections
+  // and every pending handler has run.
+  m_work.reset();
+  for (auto &thread : m_threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  m_threads.clear();
+  tlog::info() << "IoContextPool: Stopped all io threads.";
+}
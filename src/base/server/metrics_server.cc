@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/server/metrics_server.h"
+
+#include <cctype>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "base/logging.h"
+#include "base/trace.h"
+
+namespace {
+
+// Decode the %XX escapes and '+' of a URL encoded string.
+std::string url_decode(const std::string &value) {
+  std::string result;
+  for (std::size_t i = 0; i < value.size(); i++) {
+    if (value[i] == '+') {
+      result += ' ';
+    } else if (value[i] == '%' && i + 2 < value.size() &&
+               std::isxdigit((unsigned char)value[i + 1]) &&
+               std::isxdigit((unsigned char)value[i + 2])) {
+      result += (char)std::stoi(value.substr(i + 1, 2), nullptr, 16);
+      i += 2;
+    } else {
+      result += value[i];
+    }
+  }
+  return result;
+}
+
+// Add the name=value pairs of a query string or form body to params.
+void parse_query(const std::string &query,
+                 std::map<std::string, std::string> &params) {
+  std::stringstream stream(query);
+  std::string pair;
+  while (std::getline(stream, pair, '&')) {
+    if (pair.empty()) {
+      continue;
+    }
+    const auto separator = pair.find('=');
+    const std::string name = url_decode(pair.substr(0, separator));
+    params[name] = separator == std::string::npos
+                       ? ""
+                       : url_decode(pair.substr(separator + 1));
+  }
+}
+
+}  // namespace
+
+MetricsServer::MetricsServer(MetricsRegistry &registry, uint16_t bind_port,
+                             std::shared_ptr<IoContextPool> io_pool,
+                             std::shared_ptr<RuntimeConfig> config)
+    : WebSocketServer(std::string("MetricsServer"), bind_port, io_pool),
+      m_registry(registry),
+      m_config(config) {}
+
+void MetricsServer::http_handler(server_notls::connection_ptr connection) {
+  std::string resource = connection->get_resource();
+  // Ignore the query string, e.g. /metrics?name[]=...
+  resource = resource.substr(0, resource.find('?'));
+  if (resource == "/config" && m_config) {
+    config_handler(connection);
+  } else if (resource == "/metrics") {
+    connection->set_status(websocketpp::http::status_code::ok);
+    connection->append_header("Content-Type",
+                              "text/plain; version=0.0.4; charset=utf-8");
+    connection->set_body(m_registry.exposition());
+  } else if (resource == "/trace/start" || resource == "/trace/stop") {
+    Tracer::enable(resource == "/trace/start");
+    tlog::info() << "MetricsServer: Tracing "
+                 << (Tracer::enabled() ? "started." : "stopped.");
+    connection->set_status(websocketpp::http::status_code::ok);
+    connection->set_body(Tracer::enabled() ? "tracing\n" : "stopped\n");
+  } else if (resource == "/trace") {
+    std::ostringstream body;
+    Tracer::write_chrome_json(body);
+    connection->set_status(websocketpp::http::status_code::ok);
+    connection->append_header("Content-Type", "application/json");
+    connection->set_body(body.str());
+  } else {
+    connection->set_status(websocketpp::http::status_code::not_found);
+  }
+}
+
+void MetricsServer::config_handler(server_notls::connection_ptr connection) {
+  const std::string method = connection->get_request().get_method();
+  if (method == "POST") {
+    std::map<std::string, std::string> params;
+    const std::string resource = connection->get_resource();
+    if (auto query = resource.find('?'); query != std::string::npos) {
+      parse_query(resource.substr(query + 1), params);
+    }
+    parse_query(connection->get_request_body(), params);
+    try {
+      m_config->apply(params);
+    } catch (const std::runtime_error &e) {
+      tlog::warning() << "MetricsServer: Rejected configuration: " << e.what();
+      connection->set_status(websocketpp::http::status_code::bad_request);
+      connection->set_body(std::string(e.what()) + "\n");
+      return;
+    }
+  } else if (method != "GET") {
+    connection->set_status(websocketpp::http::status_code::method_not_allowed);
+    return;
+  }
+  connection->set_status(websocketpp::http::status_code::ok);
+  connection->append_header("Content-Type", "application/json");
+  connection->set_body(m_config->json());
+}
@@ -0,0 +1,256 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/server/multiplex_server.h"
+
+#include <cstring>
+#include <string>
+
+#include "base/logging.h"
+#include "nes.pb.h"
+
+MultiplexServer::MultiplexServer(
+    std::shared_ptr<SessionManager> session_manager, uint16_t bind_port,
+    std::shared_ptr<IoContextPool> io_pool)
+    : WebSocketServer(std::string("MultiplexServer"), bind_port, io_pool),
+      m_session_manager(session_manager) {
+  m_admission_thread = std::thread(&MultiplexServer::admission_loop, this);
+}
+
+MultiplexServer::~MultiplexServer() {
+  {
+    std::scoped_lock lock{m_admission_mutex};
+    m_admission_stopping = true;
+  }
+  m_admission_cv.notify_all();
+  m_admission_thread.join();
+}
+
+void MultiplexServer::message_handler(websocketpp::connection_hdl hdl,
+                                      message_ptr msg) {
+  const std::string &payload = msg->get_raw_payload();
+  if (payload.empty() || payload[0] != STREAM_ID_CONTROL) {
+    tlog::error() << "MultiplexServer: Received message for an unknown stream.";
+    return;
+  }
+
+  auto context = connection_context(hdl);
+  if (!context) {
+    return;
+  }
+
+  nesproto::ControlMessage control;
+  if (!control.ParseFromArray(payload.data() + 1, payload.size() - 1)) {
+    tlog::error() << "MultiplexServer: Failed to parse control message.";
+    return;
+  }
+
+  switch (control.message_case()) {
+    case nesproto::ControlMessage::kCamera:
+      if (auto session = m_session_manager->find(context->session_id)) {
+        session->camera_manager()->set_camera(control.camera());
+      }
+      if (m_message_count % kReceivedLoggingInterval == 0) {
+        tlog::success() << "MultiplexServer: Receiving camera matrix...";
+      }
+      m_message_count++;
+      break;
+    case nesproto::ControlMessage::kSubscription: {
+      const std::uint32_t streams = control.subscription().streams();
+      const std::uint32_t previous = context->subscriptions.exchange(streams);
+      // Only the streams the client starts receiving need a key frame.
+      request_keyframes(context->session_id, streams & ~previous);
+      tlog::info() << "MultiplexServer: Client subscribed to streams=0x"
+                   << std::hex << streams << std::dec;
+      break;
+    }
+    case nesproto::ControlMessage::kSessionRequest:
+      if (control.session_request().dedicated()) {
+        handle_session_request(context);
+      }
+      break;
+    case nesproto::ControlMessage::kFeedback:
+      if (auto session = m_session_manager->find(context->session_id)) {
+        session->report_feedback(context.get(), control.feedback());
+      }
+      break;
+    case nesproto::ControlMessage::kKeyframeRequest:
+      request_keyframes(context->session_id,
+                        control.keyframe_request().streams());
+      break;
+    default:
+      tlog::error() << "MultiplexServer: Received empty control message.";
+      break;
+  }
+}
+
+void MultiplexServer::handle_session_request(
+    std::shared_ptr<ConnectionContext> context) {
+  if (context->owns_session) {
+    send_session_status(context);
+    return;
+  }
+  {
+    std::scoped_lock lock{m_admission_mutex};
+    m_admissions.push_back(context);
+  }
+  m_admission_cv.notify_one();
+}
+
+void MultiplexServer::admission_loop() {
+  std::unique_lock lock{m_admission_mutex};
+  while (true) {
+    m_admission_cv.wait(lock, [this] {
+      return m_admission_stopping || !m_admissions.empty();
+    });
+    if (m_admission_stopping) {
+      return;
+    }
+    auto context = m_admissions.front();
+    m_admissions.pop_front();
+    lock.unlock();
+    admit_session(context);
+    lock.lock();
+  }
+}
+
+void MultiplexServer::admit_session(
+    std::shared_ptr<ConnectionContext> context) {
+  // The connection may have asked twice, or closed while waiting.
+  if (context->owns_session || !connection_context(context->hdl)) {
+    send_session_status(context);
+    return;
+  }
+  if (auto session = m_session_manager->admit()) {
+    session->start(session_sinks(session->id()));
+    std::scoped_lock lock{m_attach_mutex};
+    if (!connection_context(context->hdl)) {
+      // close_handler() has run without seeing the session.
+      m_session_manager->close(session->id());
+      return;
+    }
+    if (auto shared = m_session_manager->find(context->session_id)) {
+      shared->forget_client(context.get());
+    }
+    context->session_id = session->id();
+    context->owns_session = true;
+    request_keyframes(context->session_id, context->subscriptions);
+  }
+  send_session_status(context);
+}
+
+void MultiplexServer::send_session_status(
+    std::shared_ptr<ConnectionContext> context) {
+  nesproto::ServerControlMessage response;
+  auto status = response.mutable_session_status();
+  status->set_session_id(context->session_id);
+  status->set_admitted(context->owns_session);
+  if (auto session = m_session_manager->find(context->session_id)) {
+    for (int stream = 0; stream < Session::STREAM_COUNT; stream++) {
+      status->add_encoders(
+          session->encoder_name(static_cast<Session::StreamIndex>(stream)));
+    }
+    status->set_stereo_layout(stereo_layout_name(session->layout()));
+  }
+  send_control(context, response);
+}
+
+void MultiplexServer::open_handler(
+    std::shared_ptr<ConnectionContext> context) {
+  request_keyframes(context->session_id, context->subscriptions);
+}
+
+void MultiplexServer::close_handler(
+    std::shared_ptr<ConnectionContext> context) {
+  std::scoped_lock lock{m_attach_mutex};
+  if (auto session = m_session_manager->find(context->session_id)) {
+    session->forget_client(context.get());
+  }
+  if (context->owns_session) {
+    m_session_manager->close(context->session_id);
+  }
+}
+
+std::array<Session::sink_list, Session::STREAM_COUNT>
+MultiplexServer::session_sinks(std::uint64_t session_id) {
+  std::array<Session::sink_list, Session::STREAM_COUNT> sinks;
+  for (int stream = 0; stream < Session::STREAM_COUNT; stream++) {
+    sinks[stream].push_back(
+        stream_sink(session_id, static_cast<StreamId>(1 + stream)));
+  }
+  return sinks;
+}
+
+void MultiplexServer::request_keyframes(std::uint64_t session_id,
+                                        std::uint32_t streams) {
+  auto session = m_session_manager->find(session_id);
+  if (!session) {
+    return;
+  }
+  for (int stream = 0; stream < Session::STREAM_COUNT; stream++) {
+    if (streams & (1u << (1 + stream))) {
+      session->request_keyframe(static_cast<Session::StreamIndex>(stream));
+    }
+  }
+}
+
+void MultiplexServer::send_control(
+    const std::shared_ptr<ConnectionContext> &context,
+    const nesproto::ServerControlMessage &message) {
+  auto framed = std::make_shared<std::string>(1, (char)STREAM_ID_CONTROL);
+  message.AppendToString(framed.get());
+  post(context, framed);
+}
+
+void MultiplexServer::send_packet(std::uint64_t session_id, StreamId stream_id,
+                                  const nesproto::PacketMetadata &metadata,
+                                  const char *data, size_t size) {
+  const auto connections = this->connections();
+  std::shared_ptr<std::string> message;
+  for (const auto &[hdl, context] : *connections) {
+    if (context->session_id.load(std::memory_order_relaxed) != session_id ||
+        !(context->subscriptions.load(std::memory_order_relaxed) &
+          (1u << stream_id))) {
+      continue;
+    }
+    // Frame the packet once, and only if at least one connection wants it.
+    if (!message) {
+      const std::size_t metadata_size = metadata.ByteSizeLong();
+      message = std::make_shared<std::string>();
+      message->reserve(kPacketHeaderSize + metadata_size + size);
+      message->push_back(static_cast<char>(stream_id));
+      message->push_back(static_cast<char>(metadata_size & 0xff));
+      message->push_back(static_cast<char>((metadata_size >> 8) & 0xff));
+      metadata.AppendToString(message.get());
+      message->append(data, size);
+    }
+    post(context, message);
+  }
+}
+
+bool MultiplexServer::has_subscribers(std::uint64_t session_id,
+                                      StreamId stream_id) const {
+  const auto connections = this->connections();
+  for (const auto &[hdl, context] : *connections) {
+    if (context->session_id.load(std::memory_order_relaxed) == session_id &&
+        (context->subscriptions.load(std::memory_order_relaxed) &
+         (1u << stream_id))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MultiplexServer::StreamSink::consume_packet(AVPacket *pkt,
+                                                 const FrameTrace &trace) {
+  tag_keyframe(pkt);
+  nesproto::PacketMetadata metadata;
+  metadata.set_index(trace.frame_index);
+  metadata.set_keyframe(pkt->flags & AV_PKT_FLAG_KEY);
+  metadata.set_recovery_point(is_recovery_point(pkt));
+  metadata.set_pts(pkt->pts);
+  metadata.set_pose_id(trace.pose_id);
+  metadata.set_client_timestamp(trace.client_timestamp);
+  trace.to_proto(metadata.mutable_trace());
+  m_server.send_packet(m_session_id, m_stream_id, metadata,
+                       (const char *)pkt->data, pkt->size);
+}
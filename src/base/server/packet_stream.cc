@@ -8,9 +8,70 @@ extern "C" {
 #include "libavcodec/avcodec.h"  // AVPacket, AV_PKT_FLAG_KEY
 }
 
-void PacketStreamServer::consume_packet(AVPacket *pkt) {
-  // TODO: Find better way to indicate key frame.
-  pkt->data[0] = pkt->flags == AV_PKT_FLAG_KEY ? 0 : 1;
-  send_to_all((const char *)pkt->data, pkt->size);
-  // tlog::debug() << "PacketStreamServer: sent packet.";
+void PacketStreamServer::consume_packet(AVPacket *pkt,
+                                        const FrameTrace &trace) {
+  tag_keyframe(pkt);
+  if (!m_gop_cache_enabled) {
+    send_to_all((const char *)pkt->data, pkt->size);
+    // tlog::debug() << "PacketStreamServer: sent packet.";
+    return;
+  }
+
+  auto message =
+      std::make_shared<const std::string>((const char *)pkt->data, pkt->size);
+  std::lock_guard<std::mutex> lock(m_gop_mutex);
+  if (pkt->flags & AV_PKT_FLAG_KEY) {
+    m_gop_cache.clear();
+    m_gop_cache_bytes = 0;
+    m_gop_complete = true;
+  }
+  if (m_gop_complete) {
+    if (m_gop_cache_bytes + message->size() <= kMaxGopCacheBytes) {
+      m_gop_cache.push_back(message);
+      m_gop_cache_bytes += message->size();
+    } else {
+      // A partial GOP cannot be decoded; wait for the next key frame.
+      m_gop_cache.clear();
+      m_gop_cache_bytes = 0;
+      m_gop_complete = false;
+    }
+  }
+
+  // Clients whose backlog is not sent yet get this packet with the backlog.
+  const auto connections = this->connections();
+  for (const auto &[hdl, context] : *connections) {
+    if (context->joined.load(std::memory_order_relaxed)) {
+      post(context, message);
+    }
+  }
+}
+
+void PacketStreamServer::open_handler(
+    std::shared_ptr<ConnectionContext> context) {
+  if (!m_gop_cache_enabled) {
+    request_keyframe();
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_gop_mutex);
+  if (m_gop_cache.empty()) {
+    request_keyframe();
+  }
+  for (const auto &message : m_gop_cache) {
+    post(context, message);
+  }
+  context->joined.store(true, std::memory_order_relaxed);
+  tlog::info() << server_name() << ": Sent " << m_gop_cache.size()
+               << " cached packets to the new client.";
+}
+
+void PacketStreamServer::close_handler(
+    std::shared_ptr<ConnectionContext> context) {
+  if (!m_gop_cache_enabled || connection_count() > 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_gop_mutex);
+  m_gop_cache.clear();
+  m_gop_cache_bytes = 0;
+  m_gop_complete = false;
 }
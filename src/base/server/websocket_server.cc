@@ -6,23 +6,46 @@
 #include <string>
 
 #include "base/logging.h"
+#include "base/trace.h"
 
-WebSocketServer::WebSocketServer(std::string server_name, uint16_t bind_port)
-    : m_server_name(server_name), m_bind_port(bind_port) {
+WebSocketServer::WebSocketServer(std::string server_name, uint16_t bind_port,
+                                 std::shared_ptr<IoContextPool> io_pool)
+    : m_io_pool(io_pool),
+      m_server_name(server_name),
+      m_bind_port(bind_port),
+      m_connections_gauge(MetricsRegistry::global().gauge(
+          "nes_websocket_connections", "Open websocket connections.",
+          {{"server", server_name}})) {
   m_server.clear_access_channels(alevel::all);
-  m_server.init_asio();
+  m_server.init_asio(&m_io_pool->service());
   m_server.set_reuse_addr(true);
 
   m_server.set_open_handler([&](websocketpp::connection_hdl hdl) {
-    m_connections.insert(hdl);
+    auto context =
+        std::make_shared<ConnectionContext>(hdl, m_io_pool->service());
+    m_connections.insert(context);
+    m_connections_gauge->add(1);
     tlog::success() << m_server_name << "(" << m_bind_port
                     << "): Accepted client connection.";
+    open_handler(context);
   });
 
   m_server.set_close_handler([&](websocketpp::connection_hdl hdl) {
+    auto context = m_connections.find(hdl);
     m_connections.erase(hdl);
     tlog::warning() << m_server_name << "(" << m_bind_port
                     << "): Client connection closed.";
+    if (context) {
+      m_connections_gauge->add(-1);
+      close_handler(context);
+    }
+  });
+  m_server.set_http_handler([&](websocketpp::connection_hdl hdl) {
+    websocketpp::lib::error_code ec;
+    auto connection = m_server.get_con_from_hdl(hdl, ec);
+    if (!ec) {
+      http_handler(connection);
+    }
   });
   m_server.set_message_handler(
       [&](websocketpp::connection_hdl hdl, message_ptr msg) {
@@ -38,8 +61,6 @@ void WebSocketServer::start() {
   m_server.listen(m_bind_port);
   m_server.start_accept();
 
-  m_thread = websocketpp::lib::make_shared<websocketpp::lib::thread>(run_server,
-                                                                     &m_server);
   m_running = true;
   tlog::success() << m_server_name << "(" << m_bind_port
                   << "): Successfully initialized websocket server.";
@@ -51,10 +72,12 @@ void WebSocketServer::stop() {
                              std::string(" websocket server is not running.")};
   }
   m_server.stop_listening();
-  for (auto it : m_connections) {
-    m_server.close(it, websocketpp::close::status::going_away, "");
+  for (const auto &[hdl, context] : *m_connections.snapshot()) {
+    websocketpp::lib::error_code ec;
+    m_server.close(hdl, websocketpp::close::status::going_away, "", ec);
   }
-  m_thread->join();
+  // The io threads belong to m_io_pool and keep running for the other
+  // servers; they are joined by IoContextPool::stop().
   m_running = false;
   tlog::info() << m_server_name << "(" << m_bind_port
                << "): Successfully closed websocket server.";
@@ -65,7 +88,31 @@ void WebSocketServer::send_to_all(const char *data, size_t size) {
     throw std::runtime_error{m_server_name +
                              std::string(" websocket server is not running.")};
   }
-  for (auto it : m_connections) {
-    m_server.send(it, data, size, websocketpp::frame::opcode::binary);
+  // Hold the snapshot for the whole iteration. A close handler running
+  // concurrently publishes a new snapshot and leaves this one intact.
+  const auto connections = m_connections.snapshot();
+  if (connections->empty()) {
+    return;
+  }
+  auto message = std::make_shared<const std::string>(data, size);
+  for (const auto &[hdl, context] : *connections) {
+    post(context, message);
   }
 }
+
+void WebSocketServer::post(const std::shared_ptr<ConnectionContext> &context,
+                           std::shared_ptr<const std::string> message) {
+  // The handler keeps the context alive until the message is sent.
+  context->strand.post(
+      [this, context, message] { send_now(context->hdl, *message); });
+}
+
+void WebSocketServer::send_now(websocketpp::connection_hdl hdl,
+                               const std::string &message) {
+  NES_TRACE_ZONE("WebSocketServer::send_now");
+  // The snapshot may still hold a connection that is closing; sending to it
+  // fails with an error code that is safe to ignore.
+  websocketpp::lib::error_code ec;
+  m_server.send(hdl, message.data(), message.size(),
+                websocketpp::frame::opcode::binary, ec);
+}
@@ -0,0 +1,447 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/session.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "base/logging.h"
+#include "base/trace.h"
+#include "base/video/encoder_backend.h"
+#include "encode.h"
+#include "nes.pb.h"
+
+namespace {
+
+std::shared_ptr<Gauge> queue_depth(const char *queue, const char *eye) {
+  return MetricsRegistry::global().gauge(
+      "nes_queue_depth", "Frames waiting in the queues of all sessions.",
+      {{"queue", queue}, {"eye", eye}});
+}
+
+// Number of encoders of each stream type.
+unsigned encoders_per_type(StereoLayout layout) {
+  return layout == StereoLayout::NONE ? 2 : 1;
+}
+
+// Share of the depth stream in the bitrate of a pair of encoders.
+double depth_share(unsigned scene_bit_rate, unsigned depth_bit_rate) {
+  if (scene_bit_rate + depth_bit_rate == 0) {
+    throw std::runtime_error{
+        "Session: Scene and depth bitrates must not both be zero."};
+  }
+  return (double)depth_bit_rate / (scene_bit_rate + depth_bit_rate);
+}
+
+std::chrono::nanoseconds frame_interval(unsigned fps) {
+  if (fps == 0) {
+    throw std::runtime_error{"Session: Frame rate must be positive."};
+  }
+  return std::chrono::nanoseconds(1000000000) / fps;
+}
+
+}  // namespace
+
+Session::Session(std::uint64_t id,
+                 types::AVCodecContextManager::CodecInitInfo scene_info,
+                 types::AVCodecContextManager::CodecInitInfo depth_info,
+                 std::shared_ptr<RenderTextContext> etctx,
+                 std::shared_ptr<LatencyStats> latency_stats,
+                 std::size_t queue_size, StereoLayout layout,
+                 BandwidthEstimator::Options bit_rate_limits,
+                 bool render_pacing, bool idle_suspension)
+    : m_id(id),
+      m_layout(layout),
+      m_codec_scene_left(std::make_shared<types::AVCodecContextManager>(
+          packed_info(layout, scene_info))),
+      m_codec_depth_left(std::make_shared<types::AVCodecContextManager>(
+          packed_info(layout, depth_info))),
+      m_codec_scene_right(
+          layout == StereoLayout::NONE
+              ? std::make_shared<types::AVCodecContextManager>(scene_info)
+              : m_codec_scene_left),
+      m_codec_depth_right(
+          layout == StereoLayout::NONE
+              ? std::make_shared<types::AVCodecContextManager>(depth_info)
+              : m_codec_depth_left),
+      m_etctx(etctx),
+      m_latency_stats(latency_stats),
+      m_camera_manager(std::make_shared<CameraManager>(
+          m_codec_scene_left, m_codec_depth_left, m_codec_scene_right,
+          m_codec_depth_right, scene_info.width, scene_info.height, layout)),
+      m_frame_queue_left(std::make_shared<FrameQueue>(
+          queue_depth("frame_queue", "left"), queue_size)),
+      m_frame_queue_right(std::make_shared<FrameQueue>(
+          queue_depth("frame_queue", "right"), queue_size)),
+      m_frame_map_left(std::make_shared<FrameMap>(
+          queue_depth("encode_map", "left"), queue_size)),
+      m_frame_map_right(std::make_shared<FrameMap>(
+          queue_depth("encode_map", "right"), queue_size)),
+      m_dropped_stopping(MetricsRegistry::global().counter(
+          "nes_frames_dropped_total", "Frames dropped by the pipeline.",
+          {{"reason", "session_stopping"}})),
+      m_depth_share(depth_share(scene_info.bit_rate, depth_info.bit_rate)),
+      m_bandwidth(bit_rate_limits,
+                  encoders_per_type(layout) *
+                      (scene_info.bit_rate + depth_info.bit_rate),
+                  std::chrono::duration_cast<std::chrono::microseconds>(
+                      frame_interval(scene_info.fps))),
+      m_bit_rate_changes(MetricsRegistry::global().counter(
+          "nes_bit_rate_changes_total",
+          "Bitrate changes of the sessions following client feedback.")),
+      m_pacer(render_pacing ? std::make_unique<RenderPacer>(
+                                  frame_interval(scene_info.fps))
+                            : nullptr),
+      m_late_requests(MetricsRegistry::global().counter(
+          "nes_render_requests_late_total",
+          "Paced render requests that fell a frame interval behind and "
+          "skipped slots.")),
+      m_idle_suspension(idle_suspension),
+      m_suspensions(MetricsRegistry::global().counter(
+          "nes_stream_suspensions_total",
+          "Streams suspended because no client received them.")) {
+  if (scene_info.width != depth_info.width ||
+      scene_info.height != depth_info.height) {
+    throw std::runtime_error{
+        "Session: Scene and depth streams must have the same resolution."};
+  }
+}
+
+Session::~Session() { stop(); }
+
+void Session::start(std::array<sink_list, STREAM_COUNT> sinks) {
+  if (!m_threads.empty()) {
+    throw std::runtime_error{"Session: Session is already running."};
+  }
+  {
+    std::scoped_lock lock{m_sinks_mutex};
+    m_sinks = sinks;
+  }
+
+  for (int stream = 0; stream < STREAM_COUNT; stream++) {
+    // The sinks are owned by the threads of the session; a weak reference
+    // keeps them from owning the encoder in turn.
+    std::weak_ptr<types::AVCodecContextManager> weak_codec =
+        codec(static_cast<StreamIndex>(stream));
+    for (auto &sink : sinks[stream]) {
+      sink->set_keyframe_requester([weak_codec] {
+        if (auto codec = weak_codec.lock()) {
+          codec->request_keyframe();
+        }
+      });
+    }
+  }
+
+  m_threads.emplace_back(process_frame_thread, m_codec_scene_left,
+                         m_frame_queue_left, m_frame_map_left, m_etctx,
+                         std::ref(m_shutdown_requested));
+  m_threads.emplace_back(process_frame_thread, m_codec_scene_right,
+                         m_frame_queue_right, m_frame_map_right, m_etctx,
+                         std::ref(m_shutdown_requested));
+
+  if (m_layout != StereoLayout::NONE) {
+    // One encoder per stream type carries both eyes.
+    m_threads.emplace_back(receive_packet_thread, m_codec_scene_left,
+                           sinks[STREAM_SCENE_LEFT], m_latency_stats,
+                           stream_name(STREAM_SCENE_LEFT),
+                           std::ref(m_shutdown_requested));
+    m_threads.emplace_back(receive_packet_thread, m_codec_depth_left,
+                           sinks[STREAM_DEPTH_LEFT], m_latency_stats,
+                           stream_name(STREAM_DEPTH_LEFT),
+                           std::ref(m_shutdown_requested));
+    m_threads.emplace_back(send_packed_frame_thread, m_codec_scene_left,
+                           m_codec_depth_left, m_frame_map_left,
+                           m_frame_map_right, m_layout,
+                           std::ref(m_shutdown_requested));
+    tlog::success() << "Session (id=" << m_id << "): Started with "
+                    << stereo_layout_name(m_layout) << " stereo packing.";
+    return;
+  }
+
+  m_threads.emplace_back(receive_packet_thread, m_codec_scene_left,
+                         sinks[STREAM_SCENE_LEFT], m_latency_stats,
+                         stream_name(STREAM_SCENE_LEFT),
+                         std::ref(m_shutdown_requested));
+  m_threads.emplace_back(receive_packet_thread, m_codec_depth_left,
+                         sinks[STREAM_DEPTH_LEFT], m_latency_stats,
+                         stream_name(STREAM_DEPTH_LEFT),
+                         std::ref(m_shutdown_requested));
+  m_threads.emplace_back(receive_packet_thread, m_codec_scene_right,
+                         sinks[STREAM_SCENE_RIGHT], m_latency_stats,
+                         stream_name(STREAM_SCENE_RIGHT),
+                         std::ref(m_shutdown_requested));
+  m_threads.emplace_back(receive_packet_thread, m_codec_depth_right,
+                         sinks[STREAM_DEPTH_RIGHT], m_latency_stats,
+                         stream_name(STREAM_DEPTH_RIGHT),
+                         std::ref(m_shutdown_requested));
+
+  m_threads.emplace_back(send_frame_thread, m_codec_scene_left,
+                         m_codec_depth_left, m_frame_map_left,
+                         std::ref(m_shutdown_requested));
+  m_threads.emplace_back(send_frame_thread, m_codec_scene_right,
+                         m_codec_depth_right, m_frame_map_right,
+                         std::ref(m_shutdown_requested));
+
+  tlog::success() << "Session (id=" << m_id << "): Started.";
+}
+
+void Session::stop() {
+  request_stop();
+  for (auto &thread : m_threads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  if (!m_threads.empty()) {
+    m_threads.clear();
+    tlog::info() << "Session (id=" << m_id << "): All threads are terminated.";
+  }
+}
+
+void Session::record(std::shared_ptr<CaptureWriter> capture) {
+  m_capture = capture;
+  m_camera_manager->set_capture(capture);
+}
+
+bool Session::refresh_viewers() {
+  if (!m_idle_suspension || m_capture) {
+    return true;
+  }
+  std::uint32_t watched = 0;
+  {
+    std::scoped_lock lock{m_sinks_mutex};
+    for (int stream = 0; stream < STREAM_COUNT; stream++) {
+      for (const auto &sink : m_sinks[stream]) {
+        if (sink->has_viewers()) {
+          watched |= 1u << stream;
+          break;
+        }
+      }
+    }
+  }
+  if (m_layout != StereoLayout::NONE) {
+    // The left streams carry both eyes.
+    watched |= (watched & (1u << STREAM_SCENE_LEFT))
+               << (STREAM_SCENE_RIGHT - STREAM_SCENE_LEFT);
+    watched |= (watched & (1u << STREAM_DEPTH_LEFT))
+               << (STREAM_DEPTH_RIGHT - STREAM_DEPTH_LEFT);
+  }
+
+  const std::uint32_t previous = m_watched_streams.exchange(watched);
+  if (watched == previous) {
+    return watched != 0;
+  }
+  const int streams = m_layout == StereoLayout::NONE ? STREAM_COUNT : 2;
+  for (int stream = 0; stream < streams; stream++) {
+    const bool suspend = !(watched & (1u << stream));
+    if (suspend && (previous & (1u << stream))) {
+      m_suspensions->inc();
+    }
+    codec(static_cast<StreamIndex>(stream))->set_suspended(suspend);
+  }
+  if (watched == 0 || previous == 0) {
+    tlog::info() << "Session (id=" << m_id << "): "
+                 << (watched ? "Resumed for new viewers."
+                             : "Suspended; no viewers.");
+  }
+  return watched != 0;
+}
+
+bool Session::eye_watched(bool is_left, std::uint32_t watched_streams) const {
+  const std::uint32_t eye_streams =
+      is_left ? (1u << STREAM_SCENE_LEFT) | (1u << STREAM_DEPTH_LEFT)
+              : (1u << STREAM_SCENE_RIGHT) | (1u << STREAM_DEPTH_RIGHT);
+  return watched_streams & eye_streams;
+}
+
+void Session::pace_request() {
+  if (!m_pacer) {
+    return;
+  }
+  const std::uint32_t watched = m_watched_streams;
+  const unsigned eyes =
+      eye_watched(true, watched) + eye_watched(false, watched);
+  bool late = false;
+  const auto due = m_pacer->reserve(std::max(eyes, 1u), &late);
+  if (late) {
+    m_late_requests->inc();
+  }
+  NES_TRACE_ZONE("Session::pace_request");
+  std::this_thread::sleep_until(due);
+}
+
+RenderPacer::clock::time_point Session::next_request_due() {
+  return m_pacer ? m_pacer->next_due() : RenderPacer::clock::now();
+}
+
+void Session::record_render_time(std::chrono::nanoseconds rtt) {
+  if (m_pacer) {
+    m_pacer->record_rtt(rtt);
+  }
+}
+
+nesproto::FrameRequest Session::next_request(FrameTrace *trace) {
+  nesproto::FrameRequest req;
+  //  is_left xor true op has same effect as not op
+  //    t xor t = f (not t)
+  //    f xor t = t (not f)
+  bool is_left_val = m_is_left.fetch_xor(true);
+  const std::uint32_t watched = m_watched_streams;
+  if (!eye_watched(is_left_val, watched) &&
+      eye_watched(!is_left_val, watched)) {
+    is_left_val = !is_left_val;
+  }
+  req.set_is_left(is_left_val);
+
+  if (is_left_val) {
+    req.set_index(m_frame_index_left.fetch_add(1));
+  } else {
+    req.set_index(m_frame_index_right.fetch_add(1));
+  }
+  CameraState camera = is_left_val ? m_camera_manager->get_camera_left()
+                                   : m_camera_manager->get_camera_right();
+  camera.to_proto(is_left_val, req.mutable_camera());
+
+  *trace = FrameTrace{};
+  trace->frame_index = req.index();
+  trace->pose_received = camera.timestamp_ns;
+  trace->pose_id = camera.pose_id;
+  trace->client_timestamp = camera.client_timestamp;
+  return req;
+}
+
+void Session::push_frame(const nesproto::RenderedFrame &frame,
+                         const FrameTrace &trace) {
+  NES_TRACE_ZONE("Session::push_frame");
+  // The frame belongs to a session that is going away. Nobody will pop it.
+  if (stop_requested()) {
+    m_dropped_stopping->inc();
+    return;
+  }
+
+  std::unique_ptr<RenderedFrame> frame_o;
+  if (frame.is_left()) {
+    frame_o = std::make_unique<RenderedFrame>(
+        frame, AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8, m_codec_scene_left,
+        m_codec_depth_left, m_layout);
+    frame_o->trace() = trace;
+    m_frame_queue_left->push(std::move(frame_o));
+  } else {
+    frame_o = std::make_unique<RenderedFrame>(
+        frame, AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8, m_codec_scene_right,
+        m_codec_depth_right, m_layout);
+    frame_o->trace() = trace;
+    m_frame_queue_right->push(std::move(frame_o));
+  }
+}
+
+std::shared_ptr<types::AVCodecContextManager> Session::codec(
+    StreamIndex stream) const {
+  switch (stream) {
+    case STREAM_SCENE_LEFT:
+      return m_codec_scene_left;
+    case STREAM_DEPTH_LEFT:
+      return m_codec_depth_left;
+    case STREAM_SCENE_RIGHT:
+      return m_codec_scene_right;
+    case STREAM_DEPTH_RIGHT:
+      return m_codec_depth_right;
+    default:
+      throw std::runtime_error{"Session: Unknown stream."};
+  }
+}
+
+void Session::report_feedback(const void *client,
+                              const nesproto::ClientFeedback &feedback) {
+  if (auto bit_rate = m_bandwidth.report(client, feedback)) {
+    set_bit_rate(*bit_rate);
+  }
+}
+
+void Session::forget_client(const void *client) {
+  if (auto bit_rate = m_bandwidth.forget(client)) {
+    set_bit_rate(*bit_rate);
+  }
+}
+
+void Session::set_bit_rate(unsigned bit_rate) {
+  const unsigned encoders = encoders_per_type(m_layout);
+  const unsigned depth = bit_rate * m_depth_share / encoders;
+  const unsigned scene = bit_rate / encoders - depth;
+  // With a StereoLayout, the right encoders are the left ones.
+  m_codec_scene_left->set_bit_rate(scene);
+  m_codec_depth_left->set_bit_rate(depth);
+  m_codec_scene_right->set_bit_rate(scene);
+  m_codec_depth_right->set_bit_rate(depth);
+  m_bit_rate_changes->inc();
+  tlog::info() << "Session (id=" << m_id << "): Bitrate changed to "
+               << bit_rate / 1000 << " kbps; scene=" << scene / 1000
+               << " kbps depth=" << depth / 1000 << " kbps per encoder.";
+}
+
+void Session::reconfigure(
+    const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+        &scene_edit,
+    const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+        &depth_edit) {
+  // The encoders of the same type share their configuration but the size.
+  unsigned scene_before = 0, scene = 0, depth_before = 0, depth = 0;
+  unsigned fps_before = 0, fps = 0;
+  m_codec_scene_left->reconfigure([&](auto &info) {
+    scene_before = info.bit_rate;
+    fps_before = info.fps;
+    scene_edit(info);
+    scene = info.bit_rate;
+    fps = info.fps;
+  });
+  m_codec_depth_left->reconfigure([&](auto &info) {
+    depth_before = info.bit_rate;
+    depth_edit(info);
+    depth = info.bit_rate;
+  });
+  if (m_layout == StereoLayout::NONE) {
+    m_codec_scene_right->reconfigure(scene_edit);
+    m_codec_depth_right->reconfigure(depth_edit);
+  }
+
+  // Keep the previous share and interval for values the encoders cannot use.
+  if ((scene != scene_before || depth != depth_before) && scene + depth > 0) {
+    m_depth_share = depth_share(scene, depth);
+    m_bandwidth.reset(encoders_per_type(m_layout) * (scene + depth));
+  }
+  if (fps != fps_before && fps > 0 && m_pacer) {
+    m_pacer->set_frame_interval(frame_interval(fps));
+  }
+}
+
+void Session::set_queue_size(std::size_t queue_size) {
+  m_frame_queue_left->set_max_size(queue_size);
+  m_frame_queue_right->set_max_size(queue_size);
+  m_frame_map_left->set_max_size(queue_size);
+  m_frame_map_right->set_max_size(queue_size);
+}
+
+const char *Session::encoder_name(StreamIndex stream) const {
+  return codec(stream)->backend().name();
+}
+
+void Session::request_keyframe(StreamIndex stream) {
+  codec(stream)->request_keyframe();
+}
+
+const char *Session::stream_name(StreamIndex stream) {
+  switch (stream) {
+    case STREAM_SCENE_LEFT:
+      return "scene_left";
+    case STREAM_DEPTH_LEFT:
+      return "depth_left";
+    case STREAM_SCENE_RIGHT:
+      return "scene_right";
+    case STREAM_DEPTH_RIGHT:
+      return "depth_right";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,280 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/session_manager.h"
+
+#include <memory>
+#include <mutex>
+#include <optional>
+
+#include "base/logging.h"
+
+SessionManager::SessionManager(
+    types::AVCodecContextManager::CodecInitInfo scene_info,
+    types::AVCodecContextManager::CodecInitInfo depth_info,
+    std::shared_ptr<RenderTextContext> etctx, unsigned max_sessions,
+    std::size_t queue_size, StereoLayout layout,
+    BandwidthEstimator::Options bit_rate_limits, bool render_pacing,
+    bool idle_suspension)
+    : m_scene_info(scene_info),
+      m_depth_info(depth_info),
+      m_etctx(etctx),
+      m_max_sessions(max_sessions),
+      m_queue_size(queue_size),
+      m_layout(layout),
+      m_bit_rate_limits(bit_rate_limits),
+      m_render_pacing(render_pacing),
+      m_idle_suspension(idle_suspension),
+      m_latency_stats(std::make_shared<LatencyStats>()),
+      m_sessions_gauge(MetricsRegistry::global().gauge(
+          "nes_sessions", "Active sessions including the primary session.")),
+      m_primary(std::make_shared<Session>(kPrimarySessionId, scene_info,
+                                          depth_info, etctx, m_latency_stats,
+                                          queue_size, layout, bit_rate_limits,
+                                          render_pacing, idle_suspension)) {
+  if (m_max_sessions == 0) {
+    throw std::runtime_error{"SessionManager: max_sessions must be positive."};
+  }
+  m_sessions.insert({kPrimarySessionId, m_primary});
+  m_sessions_gauge->set(m_sessions.size());
+}
+
+std::shared_ptr<Session> SessionManager::admit() {
+  std::uint64_t id;
+  std::optional<types::AVCodecContextManager::CodecInitInfo> scene_info;
+  std::optional<types::AVCodecContextManager::CodecInitInfo> depth_info;
+  std::size_t queue_size;
+  {
+    std::scoped_lock lock{m_mutex};
+    if (m_sessions.size() >= m_max_sessions) {
+      tlog::warning() << "SessionManager: Rejected session; "
+                      << m_sessions.size() << " of " << m_max_sessions
+                      << " sessions are active.";
+      return nullptr;
+    }
+    id = m_next_id++;
+    // Reserve the slot while the encoders are initialized outside the lock.
+    m_sessions.insert({id, nullptr});
+    scene_info = m_scene_info;
+    depth_info = m_depth_info;
+    queue_size = m_queue_size;
+  }
+
+  std::shared_ptr<Session> session;
+  try {
+    session = std::make_shared<Session>(id, *scene_info, *depth_info,
+                                        m_etctx, m_latency_stats, queue_size,
+                                        m_layout, m_bit_rate_limits,
+                                        m_render_pacing, m_idle_suspension);
+  } catch (const std::exception &e) {
+    tlog::error() << "SessionManager: Failed to create session: " << e.what();
+    std::scoped_lock lock{m_mutex};
+    m_sessions.erase(id);
+    return nullptr;
+  }
+
+  types::AVCodecContextManager::CodecInitInfo current_scene = *scene_info;
+  types::AVCodecContextManager::CodecInitInfo current_depth = *depth_info;
+  std::size_t current_queue_size;
+  {
+    std::scoped_lock lock{m_mutex};
+    m_sessions[id] = session;
+    m_sessions_gauge->set(m_sessions.size());
+    tlog::success() << "SessionManager: Admitted session (id=" << id << "); "
+                    << m_sessions.size() << " of " << m_max_sessions
+                    << " sessions are active.";
+    current_scene = m_scene_info;
+    current_depth = m_depth_info;
+    current_queue_size = m_queue_size;
+  }
+  // Catch up with a reconfiguration made while the session was created.
+  if (current_scene != *scene_info || current_depth != *depth_info) {
+    auto assign = [](const types::AVCodecContextManager::CodecInitInfo &to) {
+      return [to](types::AVCodecContextManager::CodecInitInfo &info) {
+        // The resolution belongs to the session.
+        const unsigned width = info.width, height = info.height;
+        info = to;
+        info.width = width;
+        info.height = height;
+      };
+    };
+    session->reconfigure(assign(current_scene), assign(current_depth));
+  }
+  if (current_queue_size != queue_size) {
+    session->set_queue_size(current_queue_size);
+  }
+  return session;
+}
+
+void SessionManager::reconfigure(
+    const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+        &scene_edit,
+    const std::function<void(types::AVCodecContextManager::CodecInitInfo &)>
+        &depth_edit) {
+  std::vector<std::shared_ptr<Session>> sessions;
+  {
+    std::scoped_lock lock{m_mutex};
+    scene_edit(m_scene_info);
+    depth_edit(m_depth_info);
+    for (const auto &[id, session] : m_sessions) {
+      if (session) {
+        sessions.push_back(session);
+      }
+    }
+  }
+  // A session being admitted catches up in admit().
+  for (const auto &session : sessions) {
+    session->reconfigure(scene_edit, depth_edit);
+  }
+}
+
+void SessionManager::set_queue_size(std::size_t queue_size) {
+  std::vector<std::shared_ptr<Session>> sessions;
+  {
+    std::scoped_lock lock{m_mutex};
+    m_queue_size = queue_size;
+    for (const auto &[id, session] : m_sessions) {
+      if (session) {
+        sessions.push_back(session);
+      }
+    }
+  }
+  for (const auto &session : sessions) {
+    session->set_queue_size(queue_size);
+  }
+}
+
+types::AVCodecContextManager::CodecInitInfo SessionManager::scene_info() {
+  std::scoped_lock lock{m_mutex};
+  return m_scene_info;
+}
+
+types::AVCodecContextManager::CodecInitInfo SessionManager::depth_info() {
+  std::scoped_lock lock{m_mutex};
+  return m_depth_info;
+}
+
+std::size_t SessionManager::queue_size() {
+  std::scoped_lock lock{m_mutex};
+  return m_queue_size;
+}
+
+std::shared_ptr<Session> SessionManager::find(std::uint64_t id) {
+  std::scoped_lock lock{m_mutex};
+  if (auto it = m_sessions.find(id); it != m_sessions.end()) {
+    return it->second;
+  }
+  return nullptr;
+}
+
+void SessionManager::close(std::uint64_t id) {
+  if (id == kPrimarySessionId) {
+    throw std::runtime_error{"SessionManager: Cannot close primary session."};
+  }
+  std::scoped_lock lock{m_mutex};
+  auto it = m_sessions.find(id);
+  if (it == m_sessions.end()) {
+    return;
+  }
+  if (it->second) {
+    it->second->request_stop();
+    m_retired.push_back(std::move(it->second));
+  }
+  m_sessions.erase(it);
+  m_sessions_gauge->set(m_sessions.size());
+  tlog::info() << "SessionManager: Closed session (id=" << id << "); "
+               << m_sessions.size() << " of " << m_max_sessions
+               << " sessions are active.";
+}
+
+std::shared_ptr<Session> SessionManager::next() {
+  std::scoped_lock lock{m_mutex};
+  // Visit the sessions in round-robin order from the cursor. Without render
+  // pacing, the first started session with viewers is taken; with it, the
+  // one due first, ties going to the first visited.
+  std::shared_ptr<Session> chosen;
+  RenderPacer::clock::time_point chosen_due;
+  auto consider = [&](const std::shared_ptr<Session> &session) {
+    if (!session || !session->watched()) {
+      return false;
+    }
+    if (!m_render_pacing) {
+      chosen = session;
+      return true;
+    }
+    const auto due = session->next_request_due();
+    if (!chosen || due < chosen_due) {
+      chosen = session;
+      chosen_due = due;
+    }
+    return false;
+  };
+  const auto cursor = m_sessions.upper_bound(m_cursor);
+  bool done = false;
+  for (auto it = cursor; !done && it != m_sessions.end(); it++) {
+    done = consider(it->second);
+  }
+  for (auto it = m_sessions.begin(); !done && it != cursor; it++) {
+    done = consider(it->second);
+  }
+  if (!chosen) {
+    return nullptr;
+  }
+  m_cursor = chosen->id();
+  m_requested_frames++;
+  return chosen;
+}
+
+void SessionManager::refresh_viewers() {
+  std::vector<std::shared_ptr<Session>> sessions;
+  {
+    std::scoped_lock lock{m_mutex};
+    for (auto &[id, session] : m_sessions) {
+      if (session) {
+        sessions.push_back(session);
+      }
+    }
+  }
+  // Asking the sinks takes their locks; keep them out of m_mutex, which every
+  // render request takes.
+  for (auto &session : sessions) {
+    session->refresh_viewers();
+  }
+}
+
+void SessionManager::reap() {
+  std::vector<std::shared_ptr<Session>> retired;
+  {
+    std::scoped_lock lock{m_mutex};
+    retired.swap(m_retired);
+  }
+  // Joining may take up to the lock timeout of the queues; do it without
+  // holding m_mutex.
+  for (auto &session : retired) {
+    session->stop();
+  }
+}
+
+void SessionManager::stop_all() {
+  std::vector<std::shared_ptr<Session>> sessions;
+  {
+    std::scoped_lock lock{m_mutex};
+    for (auto &[id, session] : m_sessions) {
+      if (session) {
+        session->request_stop();
+        sessions.push_back(session);
+      }
+    }
+    for (auto &session : m_retired) {
+      sessions.push_back(session);
+    }
+    m_retired.clear();
+  }
+  for (auto &session : sessions) {
+    session->stop();
+  }
+}
+
+std::size_t SessionManager::size() {
+  std::scoped_lock lock{m_mutex};
+  return m_sessions.size();
+}
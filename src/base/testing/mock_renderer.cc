@@ -0,0 +1,274 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/testing/mock_renderer.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+
+#include "base/logging.h"
+#include "base/lpf_socket.h"
+#include "nes.pb.h"
+
+namespace {
+
+// Samples the render latency of a request in milliseconds.
+class LatencySampler {
+ public:
+  LatencySampler(const MockRenderer::Options &options, std::uint64_t seed)
+      : m_options(options), m_engine(seed) {
+    // Parameters of the log-normal distribution with the given mean and
+    // standard deviation.
+    double mean = std::max(options.latency_ms, 1e-3);
+    double variance = options.jitter_ms * options.jitter_ms;
+    double sigma2 = std::log(1 + variance / (mean * mean));
+    m_lognormal = std::lognormal_distribution<double>(
+        std::log(mean) - sigma2 / 2, std::sqrt(sigma2));
+  }
+
+  double sample() {
+    double latency = m_options.latency_ms;
+    switch (m_options.distribution) {
+      case MockRenderer::LATENCY_CONSTANT:
+        break;
+      case MockRenderer::LATENCY_UNIFORM:
+        latency = std::uniform_real_distribution<double>(
+            m_options.latency_ms - m_options.jitter_ms,
+            m_options.latency_ms + m_options.jitter_ms)(m_engine);
+        break;
+      case MockRenderer::LATENCY_NORMAL:
+        latency = std::normal_distribution<double>(
+            m_options.latency_ms, m_options.jitter_ms)(m_engine);
+        break;
+      case MockRenderer::LATENCY_LOGNORMAL:
+        latency = m_lognormal(m_engine);
+        break;
+    }
+    return std::max(latency, 0.0);
+  }
+
+  bool chance(double probability) {
+    return probability > 0 &&
+           std::uniform_real_distribution<double>(0, 1)(m_engine) <
+               probability;
+  }
+
+  std::mt19937_64 &engine() { return m_engine; }
+
+ private:
+  const MockRenderer::Options &m_options;
+  std::mt19937_64 m_engine;
+  std::lognormal_distribution<double> m_lognormal;
+};
+
+// Fill frame (RGB24) and depth (GRAY8) with a pattern that moves with the
+// index, so consecutive frames differ like a moving camera.
+void render_frame(nesproto::RenderedFrame *frame, unsigned width,
+                  unsigned height, bool noise, std::mt19937_64 &engine) {
+  std::string *rgb = frame->mutable_frame();
+  std::string *depth = frame->mutable_depth();
+  rgb->resize((std::size_t)width * height * 3);
+  depth->resize((std::size_t)width * height);
+
+  if (noise) {
+    for (std::size_t i = 0; i < rgb->size(); i += 8) {
+      std::uint64_t value = engine();
+      std::memcpy(rgb->data() + i, &value,
+                  std::min<std::size_t>(8, rgb->size() - i));
+    }
+    for (std::size_t i = 0; i < depth->size(); i += 8) {
+      std::uint64_t value = engine();
+      std::memcpy(depth->data() + i, &value,
+                  std::min<std::size_t>(8, depth->size() - i));
+    }
+    return;
+  }
+
+  unsigned shift = (unsigned)frame->index() * 4 + (frame->is_left() ? 0 : 64);
+  for (unsigned y = 0; y < height; y++) {
+    char *row = rgb->data() + (std::size_t)y * width * 3;
+    char *depth_row = depth->data() + (std::size_t)y * width;
+    for (unsigned x = 0; x < width; x++) {
+      row[x * 3] = (char)(x + shift);
+      row[x * 3 + 1] = (char)(y + shift);
+      row[x * 3 + 2] = (char)((x + y) / 2);
+      depth_row[x] = (char)((x * 255) / std::max(width, 1u));
+    }
+  }
+}
+
+// CPU time of the calling thread in nanoseconds.
+std::int64_t thread_cpu_ns() {
+  struct timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+}  // namespace
+
+MockRenderer::LatencyDistribution MockRenderer::parse_distribution(
+    const std::string &name) {
+  if (name == "constant") {
+    return LATENCY_CONSTANT;
+  } else if (name == "uniform") {
+    return LATENCY_UNIFORM;
+  } else if (name == "normal") {
+    return LATENCY_NORMAL;
+  } else if (name == "lognormal") {
+    return LATENCY_LOGNORMAL;
+  }
+  throw std::runtime_error{"MockRenderer: Unknown latency distribution: " +
+                           name};
+}
+
+MockRenderer::MockRenderer(Options options, uint16_t port, bool loopback_only)
+    : m_options(options) {
+  if ((m_listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    throw std::runtime_error{std::string("MockRenderer: Failed to create "
+                                         "socket: ") +
+                             std::strerror(errno)};
+  }
+  int reuse = 1;
+  setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+  addr.sin_port = htons(port);
+  socklen_t addr_len = sizeof(addr);
+  if (bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(m_listen_fd, 16) < 0 ||
+      getsockname(m_listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    int error = errno;
+    close(m_listen_fd);
+    throw std::runtime_error{"MockRenderer: Failed to listen on port " +
+                             std::to_string(port) + ": " +
+                             std::strerror(error)};
+  }
+  m_port = ntohs(addr.sin_port);
+  m_accept_thread = std::thread(&MockRenderer::accept_loop, this);
+  tlog::success() << "MockRenderer: Listening on port " << m_port << ".";
+}
+
+MockRenderer::~MockRenderer() {
+  m_stopping = true;
+  // Wake accept() and every blocking read.
+  shutdown(m_listen_fd, SHUT_RDWR);
+  m_accept_thread.join();
+  close(m_listen_fd);
+  {
+    std::scoped_lock lock{m_mutex};
+    for (int fd : m_connection_fds) {
+      if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+  }
+  // No thread is added once the accept thread has exited.
+  for (auto &thread : m_connection_threads) {
+    thread.join();
+  }
+}
+
+void MockRenderer::accept_loop() {
+  std::uint64_t seed = m_options.seed;
+  while (!m_stopping) {
+    int fd = accept(m_listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (!m_stopping) {
+        tlog::error() << "MockRenderer: Failed to accept: "
+                      << std::strerror(errno);
+      }
+      break;
+    }
+    std::scoped_lock lock{m_mutex};
+    m_connection_fds.push_back(fd);
+    m_connection_threads.emplace_back(&MockRenderer::serve, this,
+                                      m_connection_fds.size() - 1, seed++);
+  }
+}
+
+void MockRenderer::serve(std::size_t slot, std::uint64_t seed) {
+  int fd;
+  {
+    std::scoped_lock lock{m_mutex};
+    fd = m_connection_fds[slot];
+  }
+  tlog::info() << "MockRenderer (fd=" << fd << "): Serving requests.";
+  LatencySampler sampler(m_options, seed);
+  std::uint64_t served = 0;
+  std::int64_t cpu_last = thread_cpu_ns();
+
+  while (!m_stopping) {
+    nesproto::FrameRequest request;
+    try {
+      if (!request.ParseFromString(socket_receive_blocking_lpf(fd))) {
+        tlog::error() << "MockRenderer (fd=" << fd
+                      << "): Failed to parse request.";
+        continue;
+      }
+    } catch (const std::runtime_error &) {
+      break;
+    }
+
+    std::this_thread::sleep_for(
+        std::chrono::duration<double, std::milli>(sampler.sample()));
+
+    if (sampler.chance(m_options.disconnect_rate)) {
+      tlog::warning() << "MockRenderer (fd=" << fd
+                      << "): Dropping connection.";
+      break;
+    }
+
+    std::string response;
+    if (sampler.chance(m_options.failure_rate)) {
+      // Wire type 7 does not exist; the server fails to parse the frame.
+      response = "\xff\xff\xff\xff";
+    } else {
+      nesproto::RenderedFrame frame;
+      frame.set_index(request.index());
+      frame.set_is_left(request.is_left());
+      *frame.mutable_camera() = request.camera();
+      unsigned width =
+          m_options.width ? m_options.width : request.camera().width();
+      unsigned height =
+          m_options.height ? m_options.height : request.camera().height();
+      frame.mutable_camera()->set_width(width);
+      frame.mutable_camera()->set_height(height);
+      render_frame(&frame, width, height, m_options.noise, sampler.engine());
+      response = frame.SerializeAsString();
+    }
+
+    if (socket_send_blocking_lpf(fd, (uint8_t *)response.data(),
+                                 response.size()) < 0) {
+      break;
+    }
+    served++;
+    m_frames_served++;
+    const std::int64_t cpu_now = thread_cpu_ns();
+    m_cpu_ns += cpu_now - cpu_last;
+    cpu_last = cpu_now;
+  }
+  m_cpu_ns += thread_cpu_ns() - cpu_last;
+
+  {
+    std::scoped_lock lock{m_mutex};
+    close(fd);
+    m_connection_fds[slot] = -1;
+  }
+  tlog::info() << "MockRenderer (fd=" << fd << "): Closed after " << served
+               << " frame(s).";
+}
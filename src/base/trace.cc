@@ -0,0 +1,146 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/trace.h"
+
+#include <fstream>
+#include <mutex>
+
+std::atomic<bool> Tracer::s_enabled{false};
+std::mutex Tracer::s_mutex;
+std::vector<std::shared_ptr<Tracer::ThreadBuffer>> Tracer::s_buffers;
+
+void Tracer::enable(bool enabled) {
+  s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+Tracer::ThreadBuffer &Tracer::thread_buffer() {
+  // The registry keeps the buffer after the thread exits so that its zones
+  // are still written.
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto buffer = std::make_shared<ThreadBuffer>();
+    std::scoped_lock lock{s_mutex};
+    buffer->tid = s_buffers.size() + 1;
+    buffer->name = "thread-" + std::to_string(buffer->tid);
+    s_buffers.push_back(buffer);
+    return buffer;
+  }();
+  return *buffer;
+}
+
+void Tracer::name_thread(const std::string &name) {
+  ThreadBuffer &buffer = thread_buffer();
+  std::scoped_lock lock{buffer.name_mutex};
+  buffer.name = name;
+}
+
+void Tracer::record(const char *name, std::int64_t begin_ns,
+                    std::int64_t end_ns) {
+  ThreadBuffer &buffer = thread_buffer();
+  std::uint64_t head = buffer.head.load(std::memory_order_relaxed);
+  Zone &zone = buffer.zones[head % kThreadBufferSize];
+  // Order the publication of the previous zone before overwriting the slot,
+  // so a reader that sees the new fields also sees the head that covers them.
+  std::atomic_thread_fence(std::memory_order_release);
+  zone.name.store(name, std::memory_order_relaxed);
+  zone.begin_ns.store(begin_ns, std::memory_order_relaxed);
+  zone.end_ns.store(end_ns, std::memory_order_relaxed);
+  // Publish the zone.
+  buffer.head.store(head + 1, std::memory_order_release);
+}
+
+namespace {
+
+void write_json_string(std::ostream &out, const std::string &value) {
+  out << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      out << ' ';
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+}  // namespace
+
+void Tracer::write_chrome_json(std::ostream &out) {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::scoped_lock lock{s_mutex};
+    buffers = s_buffers;
+  }
+
+  struct Copy {
+    const char *name;
+    std::int64_t begin_ns;
+    std::int64_t end_ns;
+  };
+
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  auto separator = [&] {
+    if (!first) {
+      out << ",\n";
+    }
+    first = false;
+  };
+
+  for (const auto &buffer : buffers) {
+    std::string name;
+    {
+      std::scoped_lock lock{buffer->name_mutex};
+      name = buffer->name;
+    }
+    separator();
+    out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+        << buffer->tid << ",\"args\":{\"name\":";
+    write_json_string(out, name);
+    out << "}}";
+
+    std::uint64_t head = buffer->head.load(std::memory_order_acquire);
+    std::uint64_t begin = head > kThreadBufferSize ? head - kThreadBufferSize
+                                                   : 0;
+    std::vector<Copy> zones;
+    zones.reserve(head - begin);
+    for (std::uint64_t i = begin; i < head; i++) {
+      const Zone &zone = buffer->zones[i % kThreadBufferSize];
+      zones.push_back({zone.name.load(std::memory_order_relaxed),
+                       zone.begin_ns.load(std::memory_order_relaxed),
+                       zone.end_ns.load(std::memory_order_relaxed)});
+    }
+    // The zone i shares its slot with the zone i + kThreadBufferSize. Zones
+    // whose slot the thread reached during the copy, including the one it
+    // may be writing now, may be torn.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    std::uint64_t after = buffer->head.load(std::memory_order_relaxed);
+
+    out.precision(3);
+    out << std::fixed;
+    for (std::uint64_t i = begin; i < head; i++) {
+      if (i + kThreadBufferSize <= after) {
+        continue;
+      }
+      const Copy &zone = zones[i - begin];
+      separator();
+      // Timestamps are in microseconds with nanosecond precision.
+      out << "{\"ph\":\"X\",\"name\":";
+      write_json_string(out, zone.name);
+      out << ",\"pid\":1,\"tid\":" << buffer->tid
+          << ",\"ts\":" << zone.begin_ns / 1e3
+          << ",\"dur\":" << (zone.end_ns - zone.begin_ns) / 1e3 << "}";
+    }
+  }
+  out << "]}\n";
+}
+
+bool Tracer::write_chrome_json(const std::string &path) {
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  write_chrome_json(out);
+  return bool(out);
+}
@@ -0,0 +1,251 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/video/encoder_backend.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+extern "C" {
+#include "libavutil/dict.h"  // av_dict_set()
+}
+
+namespace {
+
+// Presets from the fastest to the slowest.
+constexpr const char *kPresets[] = {"ultrafast", "superfast", "veryfast",
+                                    "faster",    "fast",      "medium",
+                                    "slow",      "slower",    "veryslow"};
+constexpr int kSlowestPreset = std::size(kPresets) - 1;
+
+// Tunes of x264 that change the psychovisual settings. A setting takes one of
+// them at most, along with fastdecode and zerolatency.
+constexpr const char *kPsyTunes[] = {"film", "animation",  "grain",
+                                     "psnr", "stillimage", "ssim"};
+
+// Position of preset in kPresets. Throws std::runtime_error if it is unknown.
+int preset_level(const std::string &preset) {
+  for (int i = 0; i <= kSlowestPreset; i++) {
+    if (preset == kPresets[i]) {
+      return i;
+    }
+  }
+  throw std::runtime_error{"EncoderBackend: Unknown preset " + preset + "."};
+}
+
+std::vector<std::string> split_tunes(const std::string &tunes) {
+  std::vector<std::string> result;
+  std::stringstream stream(tunes);
+  std::string tune;
+  while (std::getline(stream, tune, ',')) {
+    if (!tune.empty()) {
+      result.push_back(tune);
+    }
+  }
+  return result;
+}
+
+bool has_tune(const std::string &tunes, const std::string &tune) {
+  auto list = split_tunes(tunes);
+  return std::find(list.begin(), list.end(), tune) != list.end();
+}
+
+class X264Backend : public EncoderBackend {
+ public:
+  const char *name() const override { return "libx264"; }
+  AVCodecID codec_id() const override { return AV_CODEC_ID_H264; }
+  Capabilities capabilities() const override {
+    // libavcodec reconfigures x264 when AVCodecContext.bit_rate changes.
+    return {.annex_b = true,
+            .zero_latency = true,
+            .intra_refresh = true,
+            .bit_rate_reconfig = true};
+  }
+
+  bool accepts_preset(const std::string &preset) const override {
+    return preset == "placebo" || EncoderBackend::accepts_preset(preset);
+  }
+
+  void configure(const types::AVCodecContextManager::CodecInitInfo &info,
+                 AVCodecContext *ctx, AVDictionary **options) const override {
+    // x264 takes the settings as they are, including several tunes.
+    av_dict_set(options, "preset", info.encode_preset.c_str(), 0);
+    if (!info.encode_tune.empty()) {
+      av_dict_set(options, "tune", info.encode_tune.c_str(), 0);
+    }
+    if (info.intra_refresh) {
+      // Key frames are recovery points starting a refresh sweep of
+      // keyframe_interval frames. x264 marks them as key frames, and turns
+      // key frames forced through AVFrame.pict_type into new sweeps.
+      av_dict_set(options, "intra-refresh", "1", 0);
+    } else {
+      // Key frames forced through AVFrame.pict_type are IDR frames.
+      av_dict_set(options, "forced-idr", "1", 0);
+    }
+    ctx->gop_size = info.keyframe_interval;
+  }
+};
+
+class X265Backend : public EncoderBackend {
+ public:
+  const char *name() const override { return "libx265"; }
+  AVCodecID codec_id() const override { return AV_CODEC_ID_HEVC; }
+  Capabilities capabilities() const override {
+    return {.annex_b = true, .zero_latency = true, .intra_refresh = true};
+  }
+
+  bool accepts_preset(const std::string &preset) const override {
+    return preset == "placebo" || EncoderBackend::accepts_preset(preset);
+  }
+
+  void configure(const types::AVCodecContextManager::CodecInitInfo &info,
+                 AVCodecContext *ctx, AVDictionary **options) const override {
+    av_dict_set(options, "preset", info.encode_preset.c_str(), 0);
+    // x265 takes a single tune and has no tune for still images.
+    constexpr const char *kTunes[] = {"zerolatency", "fastdecode", "psnr",
+                                      "ssim",        "grain",      "animation"};
+    for (const auto &tune : split_tunes(info.encode_tune)) {
+      if (std::find(std::begin(kTunes), std::end(kTunes), tune) !=
+          std::end(kTunes)) {
+        av_dict_set(options, "tune", tune.c_str(), 0);
+        break;
+      }
+    }
+    if (info.intra_refresh) {
+      av_dict_set(options, "x265-params", "log-level=error:intra-refresh=1",
+                  0);
+    } else {
+      av_dict_set(options, "forced-idr", "1", 0);
+      av_dict_set(options, "x265-params", "log-level=error", 0);
+    }
+    ctx->gop_size = info.keyframe_interval;
+  }
+};
+
+class Vp9Backend : public EncoderBackend {
+ public:
+  const char *name() const override { return "libvpx-vp9"; }
+  AVCodecID codec_id() const override { return AV_CODEC_ID_VP9; }
+  Capabilities capabilities() const override {
+    return {.annex_b = false, .zero_latency = true, .intra_refresh = false};
+  }
+
+  void configure(const types::AVCodecContextManager::CodecInitInfo &info,
+                 AVCodecContext *ctx, AVDictionary **options) const override {
+    // cpu-used goes from 0 (slowest) to 8 in realtime mode and to 5 otherwise.
+    const bool realtime = has_tune(info.encode_tune, "zerolatency");
+    int cpu_used = kSlowestPreset - preset_level(info.encode_preset);
+    if (!realtime) {
+      cpu_used = std::min(cpu_used, 5);
+    }
+    av_dict_set(options, "deadline", realtime ? "realtime" : "good", 0);
+    av_dict_set(options, "cpu-used", std::to_string(cpu_used).c_str(), 0);
+    if (realtime) {
+      av_dict_set(options, "lag-in-frames", "0", 0);
+    }
+    av_dict_set(options, "row-mt", "1", 0);
+    ctx->gop_size = info.keyframe_interval;
+  }
+};
+
+class AomBackend : public EncoderBackend {
+ public:
+  const char *name() const override { return "libaom-av1"; }
+  AVCodecID codec_id() const override { return AV_CODEC_ID_AV1; }
+  Capabilities capabilities() const override {
+    return {.annex_b = false, .zero_latency = true, .intra_refresh = false};
+  }
+
+  void configure(const types::AVCodecContextManager::CodecInitInfo &info,
+                 AVCodecContext *ctx, AVDictionary **options) const override {
+    // cpu-used goes from 5 to 10 (fastest) in realtime mode and from 0 to 8
+    // otherwise.
+    const bool realtime = has_tune(info.encode_tune, "zerolatency");
+    const int level = preset_level(info.encode_preset);
+    const int cpu_used = realtime ? 10 - level * 5 / kSlowestPreset
+                                  : kSlowestPreset - level;
+    av_dict_set(options, "usage", realtime ? "realtime" : "good", 0);
+    av_dict_set(options, "cpu-used", std::to_string(cpu_used).c_str(), 0);
+    if (realtime) {
+      av_dict_set(options, "lag-in-frames", "0", 0);
+    }
+    av_dict_set(options, "row-mt", "1", 0);
+    ctx->gop_size = info.keyframe_interval;
+  }
+};
+
+class SvtAv1Backend : public EncoderBackend {
+ public:
+  const char *name() const override { return "libsvtav1"; }
+  AVCodecID codec_id() const override { return AV_CODEC_ID_AV1; }
+  Capabilities capabilities() const override {
+    return {.annex_b = false, .zero_latency = true, .intra_refresh = false};
+  }
+
+  void configure(const types::AVCodecContextManager::CodecInitInfo &info,
+                 AVCodecContext *ctx, AVDictionary **options) const override {
+    // Presets go from 0 (slowest) to 13; ultrafast maps to 12.
+    const int preset = 12 - preset_level(info.encode_preset);
+    av_dict_set(options, "preset", std::to_string(preset).c_str(), 0);
+    if (has_tune(info.encode_tune, "zerolatency")) {
+      // Low delay prediction structure without reordering.
+      av_dict_set(options, "svtav1-params", "pred-struct=1", 0);
+    }
+    ctx->gop_size = info.keyframe_interval;
+  }
+};
+
+}  // namespace
+
+bool EncoderBackend::available() const {
+  return avcodec_find_encoder_by_name(name()) != nullptr;
+}
+
+bool EncoderBackend::accepts_tune(const std::string &tunes) const {
+  int psy_tunes = 0;
+  for (const auto &tune : split_tunes(tunes)) {
+    if (std::find(std::begin(kPsyTunes), std::end(kPsyTunes), tune) !=
+        std::end(kPsyTunes)) {
+      psy_tunes++;
+    } else if (tune != "fastdecode" && tune != "zerolatency") {
+      return false;
+    }
+  }
+  return psy_tunes <= 1;
+}
+
+bool EncoderBackend::accepts_preset(const std::string &preset) const {
+  return std::find(std::begin(kPresets), std::end(kPresets), preset) !=
+         std::end(kPresets);
+}
+
+const std::vector<std::shared_ptr<const EncoderBackend>>
+    &EncoderBackend::all() {
+  static const std::vector<std::shared_ptr<const EncoderBackend>> backends = {
+      std::make_shared<X264Backend>(), std::make_shared<X265Backend>(),
+      std::make_shared<Vp9Backend>(), std::make_shared<AomBackend>(),
+      std::make_shared<SvtAv1Backend>()};
+  return backends;
+}
+
+std::shared_ptr<const EncoderBackend> EncoderBackend::find(
+    const std::string &name) {
+  for (const auto &backend : all()) {
+    if (name == backend->name()) {
+      if (!backend->available()) {
+        throw std::runtime_error{"EncoderBackend: libavcodec was built "
+                                 "without the encoder " +
+                                 name + "."};
+      }
+      return backend;
+    }
+  }
+  std::string names;
+  for (const auto &backend : all()) {
+    names += names.empty() ? "" : ", ";
+    names += backend->name();
+  }
+  throw std::runtime_error{"EncoderBackend: Unknown encoder " + name +
+                           ". Known encoders: " + names + "."};
+}
@@ -8,14 +8,32 @@
 
 #include "base/exceptions/lock_timeout.h"
 #include "base/logging.h"
+#include "base/trace.h"
+
+FrameMap::FrameMap(std::shared_ptr<Gauge> depth, std::size_t max_size)
+    : m_depth(depth),
+      m_max_size(max_size),
+      m_dropped(MetricsRegistry::global().counter(
+          "nes_frames_dropped_total", "Frames dropped by the pipeline.",
+          {{"reason", "stale"}})) {}
+
+FrameMap::~FrameMap() {
+  if (m_depth) {
+    m_depth->add(-(std::int64_t)m_map.size());
+  }
+}
 
 void FrameMap::insert(FrameMap::keytype index, FrameMap::element&& item) {
+  NES_TRACE_ZONE("FrameMap::insert");
   unique_lock lock(m_mutex);
   // Acquire the lock when the mutex is released and the map is not full.
   // If lock timeout is reached, throw LockTimeout exception.
   if (m_inserter.wait_for(lock, kFrameMapLockTimeout,
-                          [&] { return m_map.size() < kFrameMapMaxSize; })) {
-    m_map.insert({index, std::forward<FrameMap::element>(item)});
+                          [&] { return m_map.size() < m_max_size; })) {
+    if (m_map.insert({index, std::forward<FrameMap::element>(item)}).second &&
+        m_depth) {
+      m_depth->add(1);
+    }
     // Notify one of the threads waiting to get from the map.
     m_getter.notify_all();
   } else {
@@ -24,6 +42,7 @@ void FrameMap::insert(FrameMap::keytype index, FrameMap::element&& item) {
 }
 
 FrameMap::element FrameMap::get_delete(FrameMap::keytype index) {
+  NES_TRACE_ZONE("FrameMap::get_delete");
   unique_lock lock(m_mutex);
   // Acquire a lock when the mutex is released and there is a frame of requested
   // index. If lock timeout is reached, throw LockTimeout exception.
@@ -31,6 +50,9 @@ FrameMap::element FrameMap::get_delete(FrameMap::keytype index) {
                         [&] { return m_map.contains(index); })) {
     element elem = std::move(m_map.at(index));
     m_map.erase(index);
+    if (m_depth) {
+      m_depth->add(-1);
+    }
     // When interval is reached, delete frames where frame_index < index to
     // clean up unused frames.
     if (index % kFrameMapDropFramesInterval == 0) {
@@ -39,7 +61,11 @@ FrameMap::element FrameMap::get_delete(FrameMap::keytype index) {
         return key < index;
       });
 
+      if (m_depth) {
+        m_depth->add(-(std::int64_t)count);
+      }
       if (count) {
+        m_dropped->inc(count);
         tlog::error() << "FrameMap: " << count
                       << " frame(s) dropped; current index=" << index;
       }
@@ -51,3 +77,17 @@ FrameMap::element FrameMap::get_delete(FrameMap::keytype index) {
     throw LockTimeout{};
   }
 }
+
+std::optional<FrameMap::keytype> FrameMap::next_index(FrameMap::keytype from) {
+  unique_lock lock(m_mutex);
+  if (auto it = m_map.lower_bound(from); it != m_map.end()) {
+    return it->first;
+  }
+  return std::nullopt;
+}
+
+void FrameMap::set_max_size(std::size_t max_size) {
+  unique_lock lock(m_mutex);
+  m_max_size = max_size;
+  m_inserter.notify_all();
+}
@@ -7,14 +7,28 @@
 #include <mutex>
 
 #include "base/exceptions/lock_timeout.h"
+#include "base/trace.h"
+
+FrameQueue::FrameQueue(std::shared_ptr<Gauge> depth, std::size_t max_size)
+    : m_depth(depth), m_max_size(max_size) {}
+
+FrameQueue::~FrameQueue() {
+  if (m_depth) {
+    m_depth->add(-(std::int64_t)m_queue.size());
+  }
+}
 
 void FrameQueue::push(element &&el) {
+  NES_TRACE_ZONE("FrameQueue::push");
   unique_lock lock(m_mutex);
   // Acquire the lock when the mutex is released and the queue is not full.
   // If lock timeout is reached, throw LockTimeout exception.
   if (m_pusher.wait_for(lock, kFrameQueueLockTimeout,
-                        [&] { return m_queue.size() < kFrameQueueMaxSize; })) {
+                        [&] { return m_queue.size() < m_max_size; })) {
     m_queue.push(std::forward<element>(el));
+    if (m_depth) {
+      m_depth->add(1);
+    }
     // Notify one of the threads waiting to pop from the queue.
     m_popper.notify_one();
   } else {
@@ -23,6 +37,7 @@ void FrameQueue::push(element &&el) {
 }
 
 FrameQueue::element FrameQueue::pop() {
+  NES_TRACE_ZONE("FrameQueue::pop");
   unique_lock lock(m_mutex);
   // Acquire a lock when the mutex is released and the queue is not empty.
   // If lock timeout is reached, throw LockTimeout exception.
@@ -30,6 +45,9 @@ FrameQueue::element FrameQueue::pop() {
                         [&] { return m_queue.size() > 0; })) {
     element item = std::move(m_queue.front());
     m_queue.pop();
+    if (m_depth) {
+      m_depth->add(-1);
+    }
     // Notify one of the threads waiting to push to the queue.
     m_pusher.notify_one();
     return item;
@@ -37,3 +55,9 @@ FrameQueue::element FrameQueue::pop() {
     throw LockTimeout{};
   }
 }
+
+void FrameQueue::set_max_size(std::size_t max_size) {
+  unique_lock lock(m_mutex);
+  m_max_size = max_size;
+  m_pusher.notify_all();
+}
@@ -2,49 +2,112 @@
 
 #include "base/video/render_text.h"
 
+#include <algorithm>
+
+#include "base/trace.h"
+
 extern "C" {
 #include "freetype2/ft2build.h"
 #include FT_FREETYPE_H
 }
 
+namespace {
+
+// Blend a run of coverage values toward white: dst += (255 - dst) * alpha /
+// 255. The loop has no branches or aliasing so that the compiler vectorizes
+// it.
+void blend_white(std::uint8_t *__restrict dst,
+                 const std::uint8_t *__restrict alpha, int size) {
+  for (int i = 0; i < size; i++) {
+    unsigned x = (255u - dst[i]) * alpha[i];
+    // Exact x / 255 for x <= 255 * 255.
+    dst[i] += (x + 1 + (x >> 8)) >> 8;
+  }
+}
+
+}  // namespace
+
 RenderTextContext::RenderTextContext(std::string font_location) {
+  FT_Library library;
+  FT_Face face;
   FT_Error ret;
-  if ((ret = FT_Init_FreeType(&_library)) < 0) {
+  if ((ret = FT_Init_FreeType(&library)) < 0) {
     throw std::runtime_error{
         std::string("EncodeTextContext: Failed to init freetype: ") +
         std::string(FT_Error_String(ret))};
   }
 
-  if ((ret = FT_New_Face(_library, font_location.c_str(), 0, &_face)) < 0) {
+  if ((ret = FT_New_Face(library, font_location.c_str(), 0, &face)) < 0) {
+    FT_Done_FreeType(library);
     throw std::runtime_error{
         std::string("EncodeTextContext: Failed to init font face: ") +
         std::string(FT_Error_String(ret))};
   }
-  if ((ret = FT_Set_Char_Size(_face,   /* handle to face object */
+  if ((ret = FT_Set_Char_Size(face,    /* handle to face object */
                               0,       /* char_width in 1/64th of points  */
                               20 * 64, /* char_height in 1/64th of points */
                               0,       /* horizontal device resolution    */
                               0)       /* vertical device resolution      */
        ) < 0) {
+    FT_Done_FreeType(library);
     throw std::runtime_error{
         std::string("EncodeTextContext: Failed to set character size: ") +
         std::string(FT_Error_String(ret))};
   }
+
+  FT_GlyphSlot slot = face->glyph;
+  for (char ch = kFirstChar; ch <= kLastChar; ch++) {
+    Glyph &glyph = m_glyphs[ch - kFirstChar];
+    glyph = Glyph{};
+    glyph.offset = m_atlas.size();
+    if ((ret = FT_Load_Char(face, ch, FT_LOAD_RENDER))) {
+      tlog::info() << "Error while rendering character=" << ch
+                   << " error=" << ret;
+      continue;
+    }
+    glyph.left = slot->bitmap_left;
+    glyph.top = slot->bitmap_top;
+    glyph.width = slot->bitmap.width;
+    glyph.rows = slot->bitmap.rows;
+    glyph.advance = slot->advance.x >> 6;
+
+    for (int y = 0; y < glyph.rows; y++) {
+      const std::uint8_t *row = slot->bitmap.buffer + y * slot->bitmap.pitch;
+      m_atlas.insert(m_atlas.end(), row, row + glyph.width);
+    }
+  }
+
+  FT_Done_FreeType(library);
+}
+
+const RenderTextContext::Glyph &RenderTextContext::glyph(char ch) const {
+  if (ch < kFirstChar || ch > kLastChar) {
+    ch = '?';
+  }
+  return m_glyphs[ch - kFirstChar];
 }
 
 void RenderTextContext::render_string_to_frame(
     types::FrameManager &frame, RenderTextContext::RenderPosition opt,
-    std::string content) {
-  unique_lock lock(m_mutex);
-  m_wait.wait(lock, [] { return true; });
+    const std::string &content) const {
+  NES_TRACE_ZONE("RenderTextContext::render_string_to_frame");
+  switch (frame.context().pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_GRAY8:
+      break;
+    default:
+      throw std::runtime_error{
+          "RenderTextContext: Text can only be drawn on 8-bit luma planes."};
+  }
   uint8_t *surface = frame.data().data[0];
-  uint32_t width = frame.context().width;
-  uint32_t height = frame.context().height;
-  FT_Error ret;
-  FT_GlyphSlot slot = _face->glyph;
-  FT_UInt glyph_index;
+  const int linesize = frame.data().linesize[0];
+  const int width = frame.context().width;
+  const int height = frame.context().height;
 
-  int pen_x, pen_y, n;
+  int pen_x, pen_y;
   int x_box = 300;
   int y_box = 100;
   int margin = 50;
@@ -78,36 +141,29 @@ void RenderTextContext::render_string_to_frame(
 
   int orig_pen_x = pen_x;
 
-  for (auto &ch : content) {
+  for (char ch : content) {
     if (ch == '\n') {
       pen_x = orig_pen_x;
       pen_y = pen_y + 20;
       continue;
     }
-    /* load glyph image into the slot (erase previous one) */
-    ret = FT_Load_Char(_face, ch, FT_LOAD_RENDER);
-    if (ret) {
-      tlog::info() << "Error while rendering character=" << ch
-                   << " error=" << ret;
-    }
+    const Glyph &g = glyph(ch);
 
-    FT_Int i, j, p, q;
-    FT_Int x_max = pen_x + slot->bitmap_left + slot->bitmap.width;
-    FT_Int y_max = pen_y - slot->bitmap_top + slot->bitmap.rows;
-    for (j = pen_y - slot->bitmap_top, q = 0; j < y_max; j++, q++) {
-      for (i = pen_x + slot->bitmap_left, p = 0; i < x_max; i++, p++) {
-        if (i < 0 || j < 0 || i >= width || j >= height) continue;
-        if (slot->bitmap.buffer[q * slot->bitmap.width + p]) {
-          surface[(j * width + i) * 3] = 255;
-          surface[(j * width + i) * 3 + 1] = 255;
-          surface[(j * width + i) * 3 + 2] = 255;
-        }
+    // Clip the glyph to the frame once instead of testing every pixel.
+    const int x0 = pen_x + g.left;
+    const int y0 = pen_y - g.top;
+    const int p_begin = std::max(0, -x0);
+    const int p_end = std::min(g.width, width - x0);
+    const int q_begin = std::max(0, -y0);
+    const int q_end = std::min(g.rows, height - y0);
+    if (p_begin < p_end) {
+      for (int q = q_begin; q < q_end; q++) {
+        blend_white(surface + (y0 + q) * linesize + x0 + p_begin,
+                    m_atlas.data() + g.offset + q * g.width + p_begin,
+                    p_end - p_begin);
       }
     }
 
-    /* increment pen position */
-    pen_x += slot->advance.x >> 6;
+    pen_x += g.advance;
   }
 }
-
-RenderTextContext::~RenderTextContext() { FT_Done_FreeType(_library); }
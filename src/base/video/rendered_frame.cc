@@ -2,26 +2,76 @@
 
 #include "base/video/rendered_frame.h"
 
+namespace {
+
+// Replace frame with a copy scaled to the size of info. Returns whether the
+// frame was scaled.
+bool fit_frame(std::unique_ptr<types::FrameManager> &frame,
+               const types::AVCodecContextManager::CodecInitInfo &info) {
+  if (frame->context().width == info.width &&
+      frame->context().height == info.height) {
+    return false;
+  }
+  auto scaled = std::make_unique<types::FrameManager>(
+      types::FrameManager::FrameContext(info));
+  types::SwsContextManager sws_context(*frame, *scaled);
+  frame = std::move(scaled);
+  return true;
+}
+
+}  // namespace
+
 RenderedFrame::RenderedFrame(
     nesproto::RenderedFrame frame, AVPixelFormat pix_fmt_scene,
     AVPixelFormat pix_fmt_depth,
     std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth)
+    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
+    StereoLayout layout)
     : m_frame_response(frame),
-      m_pix_fmt_scene(pix_fmt_scene),
-      m_pix_fmt_depth(pix_fmt_depth),
-      m_converted(false),
+      m_ctxmgr_scene(ctxmgr_scene),
+      m_ctxmgr_depth(ctxmgr_depth),
+      m_layout(layout),
       m_source_avframe_scene(
           types::FrameManager::FrameContext(m_frame_response.camera().width(),
                                             m_frame_response.camera().height(),
                                             pix_fmt_scene),
           (uint8_t *)m_frame_response.frame().data()),
-      m_converted_avframe_scene(
-          types::FrameManager::FrameContext(ctxmgr_scene->get_codec_info())),
+      m_pix_fmt_scene(pix_fmt_scene),
       m_source_avframe_depth(
           types::FrameManager::FrameContext(m_frame_response.camera().width(),
                                             m_frame_response.camera().height(),
                                             pix_fmt_depth),
           (uint8_t *)m_frame_response.depth().data()),
-      m_converted_avframe_depth(
-          types::FrameManager::FrameContext(ctxmgr_depth->get_codec_info())) {}
+      m_pix_fmt_depth(pix_fmt_depth),
+      m_converted(false) {}
+
+void RenderedFrame::convert_frame() {
+  NES_TRACE_ZONE("RenderedFrame::convert_frame");
+  if (m_converted) {
+    throw std::runtime_error{"Tried to convert a converted RenderedFrame."};
+  }
+  m_converted_avframe_scene =
+      std::make_unique<types::FrameManager>(types::FrameManager::FrameContext(
+          eye_info(m_layout, m_ctxmgr_scene->frame_info())));
+  m_converted_avframe_depth =
+      std::make_unique<types::FrameManager>(types::FrameManager::FrameContext(
+          eye_info(m_layout, m_ctxmgr_depth->frame_info())));
+  types::SwsContextManager sws_context_scene(m_source_avframe_scene,
+                                             *m_converted_avframe_scene);
+  types::SwsContextManager sws_context_depth(m_source_avframe_depth,
+                                             *m_converted_avframe_depth);
+  m_converted = true;
+}
+
+bool RenderedFrame::fit_converted(
+    const types::AVCodecContextManager::CodecInitInfo &scene_info,
+    const types::AVCodecContextManager::CodecInitInfo &depth_info) {
+  NES_TRACE_ZONE("RenderedFrame::fit_converted");
+  if (!m_converted) {
+    throw std::runtime_error{"Tried to fit an unconverted RenderedFrame."};
+  }
+  bool scaled = fit_frame(m_converted_avframe_scene, scene_info);
+  // Evaluate both; the depth frame may need scaling on its own.
+  scaled = fit_frame(m_converted_avframe_depth, depth_info) || scaled;
+  return scaled;
+}
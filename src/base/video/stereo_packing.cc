@@ -0,0 +1,89 @@
+// Copyright (c) 2022 Moonsik Park.
+
+#include "base/video/stereo_packing.h"
+
+#include <stdexcept>
+
+#include "base/trace.h"
+
+extern "C" {
+#include "libavutil/common.h"    // AV_CEIL_RSHIFT()
+#include "libavutil/imgutils.h"  // av_image_copy_plane()
+#include "libavutil/pixdesc.h"   // av_pix_fmt_desc_get()
+}
+
+StereoLayout parse_stereo_layout(const std::string &name) {
+  for (auto layout : {StereoLayout::NONE, StereoLayout::SIDE_BY_SIDE,
+                      StereoLayout::TOP_BOTTOM}) {
+    if (name == stereo_layout_name(layout)) {
+      return layout;
+    }
+  }
+  throw std::runtime_error{"Unknown stereo layout " + name +
+                           ". Expected none, side_by_side or top_bottom."};
+}
+
+const char *stereo_layout_name(StereoLayout layout) {
+  switch (layout) {
+    case StereoLayout::NONE:
+      return "none";
+    case StereoLayout::SIDE_BY_SIDE:
+      return "side_by_side";
+    case StereoLayout::TOP_BOTTOM:
+      return "top_bottom";
+    default:
+      return "unknown";
+  }
+}
+
+types::AVCodecContextManager::CodecInitInfo packed_info(
+    StereoLayout layout, types::AVCodecContextManager::CodecInitInfo info) {
+  if (layout == StereoLayout::SIDE_BY_SIDE) {
+    info.width *= 2;
+  } else if (layout == StereoLayout::TOP_BOTTOM) {
+    info.height *= 2;
+  }
+  return info;
+}
+
+types::AVCodecContextManager::CodecInitInfo eye_info(
+    StereoLayout layout, types::AVCodecContextManager::CodecInitInfo info) {
+  if (layout == StereoLayout::SIDE_BY_SIDE) {
+    info.width /= 2;
+  } else if (layout == StereoLayout::TOP_BOTTOM) {
+    info.height /= 2;
+  }
+  return info;
+}
+
+void pack_eye(StereoLayout layout, bool is_left, types::FrameManager &eye,
+              types::FrameManager &packed) {
+  NES_TRACE_ZONE("pack_eye");
+  const unsigned width = eye.context().width;
+  const unsigned height = eye.context().height;
+  const AVPixelFormat pix_fmt = eye.context().pix_fmt;
+  const bool side_by_side = layout == StereoLayout::SIDE_BY_SIDE;
+  if (layout == StereoLayout::NONE || pix_fmt != packed.context().pix_fmt ||
+      packed.context().width != (side_by_side ? width * 2 : width) ||
+      packed.context().height != (side_by_side ? height : height * 2)) {
+    throw std::runtime_error{
+        "pack_eye: The eye frame does not fit the packed frame."};
+  }
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+  const int planes = av_pix_fmt_count_planes(pix_fmt);
+  for (int plane = 0; plane < planes; plane++) {
+    // The chroma planes of subsampled formats have fewer rows.
+    const bool chroma = plane == 1 || plane == 2;
+    const int rows =
+        chroma ? AV_CEIL_RSHIFT((int)height, desc->log2_chroma_h) : height;
+    const int bytes = av_image_get_linesize(pix_fmt, width, plane);
+    std::uint8_t *dst = packed.data().data[plane];
+    if (!is_left) {
+      dst += side_by_side ? bytes : rows * packed.data().linesize[plane];
+    }
+    av_image_copy_plane(dst, packed.data().linesize[plane],
+                        eye.data().data[plane], eye.data().linesize[plane],
+                        bytes, rows);
+  }
+}
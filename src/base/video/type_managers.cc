@@ -2,17 +2,22 @@
 
 #include "base/video/type_managers.h"
 
+#include "base/trace.h"
+#include "base/video/encoder_backend.h"
+
 extern "C" {
 #include "libavcodec/avcodec.h"
-// avcodec_free_context(), avcodec_find_encoder(), avcodec_alloc_context3(),
+// avcodec_free_context(), avcodec_find_encoder_by_name(),
+// avcodec_alloc_context3(),
 // avcodec_open2(), avcodec_send_frame(), avcodec_receive_packet(),
 // avcodec_free_context()
-#include "libavutil/dict.h"      // av_dict_set()
-#include "libavutil/error.h"     // av_strerror()
-#include "libavutil/imgutils.h"  // av_image_alloc(), av_image_get_linesize()
-#include "libavutil/mem.h"       // av_freep()
-#include "libavutil/opt.h"       // av_opt_set()
-#include "libswscale/swscale.h"  // sws_getContext(), sws_scale()
+#include "libavutil/dict.h"         // av_dict_set()
+#include "libavutil/error.h"        // av_strerror()
+#include "libavutil/imgutils.h"     // av_image_alloc(), av_image_get_linesize()
+#include "libavutil/mathematics.h"  // av_rescale_q()
+#include "libavutil/mem.h"          // av_freep()
+#include "libavutil/opt.h"          // av_opt_set()
+#include "libswscale/swscale.h"     // sws_getContext(), sws_scale()
 }
 
 namespace types {
@@ -40,76 +45,312 @@ AVDictionaryManager::~AVDictionaryManager() { av_dict_free(&m_dict); }
 
 AVCodecContextManager::AVCodecContextManager(
     AVCodecContextManager::CodecInitInfo info)
-    : m_info(info) {
-  this->codec_ctx_init();
-}
-
-void AVCodecContextManager::codec_ctx_init() {
-  if (m_opened) {
-    avcodec_free_context(&m_ctx);
+    : m_info(info), m_backend(EncoderBackend::find(info.encoder)) {
+  if (m_info.intra_refresh && !m_backend->capabilities().intra_refresh) {
+    throw std::runtime_error{std::string{"Encoder "} + m_backend->name() +
+                             " does not support intra refresh."};
   }
+  m_ctx = open_encoder(m_info);
+}
 
-  AVCodec *codec = avcodec_find_encoder(m_info.codec_id);
+AVCodecContext *AVCodecContextManager::open_encoder(
+    const CodecInitInfo &info) const {
+  const AVCodec *codec = avcodec_find_encoder_by_name(m_backend->name());
   if (codec == nullptr) {
-    throw std::runtime_error{"Failed to find encoder."};
+    throw std::runtime_error{std::string{"Failed to find encoder "} +
+                             m_backend->name() + "."};
   }
 
-  m_ctx = avcodec_alloc_context3(codec);
-  if (m_ctx == nullptr) {
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  if (ctx == nullptr) {
     throw std::runtime_error{"Failed to allocate codec context."};
   }
 
-  m_ctx->bit_rate = m_info.bit_rate;
-  m_ctx->width = m_info.width;
-  m_ctx->height = m_info.height;
-  m_ctx->time_base = (AVRational){1, (int)m_info.fps};
-  m_ctx->pix_fmt = m_info.pix_fmt;
-
-  av_opt_set(m_ctx->priv_data, "x264opts", "keyint", m_info.keyframe_interval);
+  ctx->bit_rate = info.bit_rate;
+  ctx->width = info.width;
+  ctx->height = info.height;
+  // The frames carry their real timing in a fine time base. fps is the
+  // nominal rate the rate control plans with.
+  ctx->time_base = kTimeBase;
+  ctx->framerate = (AVRational){(int)info.fps, 1};
+  ctx->pix_fmt = info.pix_fmt;
 
   {
     AVDictionaryManager dict;
-    AVDictionary *options = dict();
-    av_dict_set(&options, "preset", m_info.x264_encode_preset.c_str(), 0);
-    av_dict_set(&options, "tune", m_info.x264_encode_tune.c_str(), 0);
+    m_backend->configure(info, ctx, dict.address());
 
-    if (int ret = avcodec_open2(m_ctx, (const AVCodec *)codec, &options);
-        ret < 0) {
+    if (int ret = avcodec_open2(ctx, codec, dict.address()); ret < 0) {
+      avcodec_free_context(&ctx);
       throw std::runtime_error{std::string{"Failed to open codec: "} +
                                averror_explain(ret)};
     }
   }  // Context for AVDictionaryManager
-  m_opened = true;
-  tlog::debug() << "codec_ctx_init() success; width=" << m_info.width
-                << " height=" << m_info.height
-                << " bit_rate=" << m_info.bit_rate << " fps=" << m_info.fps
-                << " keyframe_interval=" << m_info.keyframe_interval;
+  tlog::debug() << "open_encoder() success; encoder=" << m_backend->name()
+                << " width=" << info.width << " height=" << info.height
+                << " bit_rate=" << info.bit_rate << " fps=" << info.fps
+                << " keyframe_interval=" << info.keyframe_interval
+                << " intra_refresh=" << info.intra_refresh;
+  return ctx;
 }
 
 void AVCodecContextManager::change_resolution(unsigned width, unsigned height) {
+  reconfigure([&](CodecInitInfo &info) {
+    info.width = width;
+    info.height = height;
+  });
+}
+
+void AVCodecContextManager::reconfigure(
+    const std::function<void(CodecInitInfo &)> &edit) {
+  std::scoped_lock lock{m_build_mutex};
+  CodecInitInfo current = [&] {
+    std::shared_lock info_lock{m_codec_info_mutex};
+    return m_info;
+  }();
+  // The latest configuration requested, which the edit applies to.
+  CodecInitInfo requested =
+      m_pending ? *m_pending : (m_ready_info ? *m_ready_info : current);
+  CodecInitInfo target = requested;
+  edit(target);
+  if (target.encoder != current.encoder || target.pix_fmt != current.pix_fmt) {
+    throw std::runtime_error{
+        "AVCodecContextManager: The encoder and the pixel format cannot be "
+        "changed."};
+  }
+  if (target.intra_refresh && !m_backend->capabilities().intra_refresh) {
+    throw std::runtime_error{std::string{"Encoder "} + m_backend->name() +
+                             " does not support intra refresh."};
+  }
+
+  // The bitrate is changed in place. cut_over() carries it over to an encoder
+  // that is being opened.
+  if (target.bit_rate != current.bit_rate) {
+    set_bit_rate(target.bit_rate);
+    current.bit_rate = target.bit_rate;
+  }
+  requested.bit_rate = target.bit_rate;
+  if (target == requested) {
+    return;
+  }
+
+  m_generation++;
+  avcodec_free_context(&m_ready);
+  m_ready_info.reset();
+  if (target == current) {
+    // Back to the configuration in use before the change completed.
+    m_pending.reset();
+    return;
+  }
+  m_pending = target;
+
+  if (!m_building) {
+    // The previous builder has finished or was never started.
+    if (m_builder.joinable()) {
+      m_builder.join();
+    }
+    m_building = true;
+    m_builder = std::thread(&AVCodecContextManager::build_encoders, this);
+  }
+}
+
+void AVCodecContextManager::build_encoders() {
+  Tracer::name_thread("encoder_builder");
+  std::unique_lock lock{m_build_mutex};
+  while (m_pending) {
+    CodecInitInfo info = *m_pending;
+    std::uint64_t generation = m_generation;
+    m_pending.reset();
+    lock.unlock();
+
+    AVCodecContext *ctx = nullptr;
+    {
+      NES_TRACE_ZONE("AVCodecContextManager::open_encoder");
+      try {
+        ctx = open_encoder(info);
+      } catch (const std::exception &e) {
+        tlog::error() << "AVCodecContextManager: Failed to open encoder for "
+                      << info.width << "x" << info.height << " preset "
+                      << info.encode_preset
+                      << "; keeping the encoder in use: " << e.what();
+      }
+    }
+
+    lock.lock();
+    if (ctx != nullptr && generation != m_generation) {
+      // Superseded by a request made while opening.
+      avcodec_free_context(&ctx);
+    } else if (ctx != nullptr) {
+      m_ready = ctx;
+      m_ready_info = info;
+    }
+  }
+  m_building = false;
+}
+
+AVCodecContextManager::CodecInitInfo AVCodecContextManager::frame_info() {
+  {
+    std::scoped_lock lock{m_build_mutex};
+    if (m_ready_info) {
+      return *m_ready_info;
+    }
+  }
+  std::shared_lock info_lock{m_codec_info_mutex};
+  return m_info;
+}
+
+AVCodecContextManager::CodecInitInfo AVCodecContextManager::cut_over() {
+  AVCodecContext *ready;
+  std::optional<CodecInitInfo> ready_info;
+  {
+    std::scoped_lock lock{m_build_mutex};
+    ready = m_ready;
+    ready_info = m_ready_info;
+    m_ready = nullptr;
+    m_ready_info.reset();
+  }
+  if (ready == nullptr) {
+    std::shared_lock info_lock{m_codec_info_mutex};
+    return m_info;
+  }
+
+  NES_TRACE_ZONE("AVCodecContextManager::cut_over");
+  std::scoped_lock lock{m_codec_info_mutex, m_codec_context_mutex};
+  // Drain the old encoder; its packets precede those of the new one. The
+  // first frame of the new encoder is an IDR frame.
+  avcodec_send_frame(m_ctx, nullptr);
+  m_retired.push_back(m_ctx);
+  m_ctx = ready;
+  // The new encoder starts with a key frame anyway.
+  m_keyframe_requested.store(false, std::memory_order_relaxed);
+  // The bitrate may have changed while the encoder was opened.
+  if (ready_info->bit_rate != m_info.bit_rate) {
+    ready_info->bit_rate = m_info.bit_rate;
+    if (m_backend->capabilities().bit_rate_reconfig) {
+      m_ctx->bit_rate = m_info.bit_rate;
+    }
+  }
+  tlog::info() << "AVCodecContextManager: Switched from " << m_info.width
+               << "x" << m_info.height << " preset " << m_info.encode_preset
+               << " to " << ready_info->width << "x" << ready_info->height
+               << " preset " << ready_info->encode_preset << ".";
+  m_info = *ready_info;
+  return m_info;
+}
+
+void AVCodecContextManager::set_bit_rate(unsigned bit_rate) {
   std::scoped_lock lock{m_codec_info_mutex, m_codec_context_mutex};
-  m_info.width = width;
-  m_info.height = height;
-  this->codec_ctx_init();
+  if (m_info.bit_rate == bit_rate) {
+    return;
+  }
+  m_info.bit_rate = bit_rate;
+  if (m_backend->capabilities().bit_rate_reconfig) {
+    m_ctx->bit_rate = bit_rate;
+  }
+}
+
+void AVCodecContextManager::set_suspended(bool suspended) {
+  if (m_suspended.exchange(suspended) && !suspended) {
+    m_resuming = true;
+  }
 }
 
-int AVCodecContextManager::send_frame(AVFrame *frm) {
+int AVCodecContextManager::send_frame(AVFrame *frm, const FrameTrace &trace) {
+  NES_TRACE_ZONE("AVCodecContextManager::send_frame");
+  if (m_suspended.load(std::memory_order_relaxed)) {
+    return 0;
+  }
   unique_lock lock{m_codec_context_mutex};
   m_codec_context_waiter.wait(lock, [] { return true; });
+  const bool resuming = m_resuming.exchange(false);
+  if (resuming) {
+    // The clients that made the stream resume wait for a key frame.
+    frm->pict_type = AV_PICTURE_TYPE_I;
+    m_keyframe_requested.store(false, std::memory_order_relaxed);
+    m_last_forced_keyframe = std::chrono::steady_clock::now();
+  } else if (m_keyframe_requested.load(std::memory_order_relaxed)) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now - m_last_forced_keyframe >= kMinForcedKeyframeInterval) {
+      // The backends open the encoders so that a forced I frame is an IDR,
+      // or the start of a refresh sweep with intra refresh.
+      frm->pict_type = AV_PICTURE_TYPE_I;
+      m_keyframe_requested.store(false, std::memory_order_relaxed);
+      m_last_forced_keyframe = now;
+    }
+  }
+  const std::int64_t frame_time =
+      trace.frame_time != 0 ? trace.frame_time : FrameTrace::now();
+  frm->pts = av_rescale_q(frame_time, AVRational{1, 1000000000}, kTimeBase) -
+             m_pts_offset;
+  if (resuming && m_last_pts != AV_NOPTS_VALUE) {
+    const std::int64_t next =
+        m_last_pts + av_rescale_q(1, av_inv_q(m_ctx->framerate), kTimeBase);
+    m_pts_offset += frm->pts - next;
+    frm->pts = next;
+  }
+  if (m_last_pts != AV_NOPTS_VALUE && frm->pts <= m_last_pts) {
+    frm->pts = m_last_pts + 1;
+  }
   int ret = avcodec_send_frame(m_ctx, frm);
+  if (ret == 0) {
+    m_last_pts = frm->pts;
+    m_traces.insert_or_assign(frm->pts, trace);
+  }
   m_codec_context_waiter.notify_one();
   return ret;
 }
 
-int AVCodecContextManager::receive_packet(AVPacket *pkt) {
+int AVCodecContextManager::receive_packet(AVPacket *pkt, FrameTrace *trace) {
   unique_lock lock{m_codec_context_mutex};
   m_codec_context_waiter.wait(lock, [] { return true; });
-  int ret = avcodec_receive_packet(m_ctx, pkt);
+  int ret;
+  while (true) {
+    if (m_retired.empty()) {
+      ret = avcodec_receive_packet(m_ctx, pkt);
+      break;
+    }
+    ret = avcodec_receive_packet(m_retired.front(), pkt);
+    if (ret == 0) {
+      break;
+    }
+    // A flushed encoder either returns its remaining packets or reports
+    // AVERROR_EOF. It is freed on anything else as well.
+    if (ret != AVERROR_EOF) {
+      tlog::error() << "AVCodecContextManager: Failed to drain encoder: "
+                    << averror_explain(ret);
+    }
+    avcodec_free_context(&m_retired.front());
+    m_retired.pop_front();
+  }
+  if (ret == 0) {
+    if (auto it = m_traces.find(pkt->pts); it != m_traces.end()) {
+      *trace = it->second;
+      m_traces.erase(it);
+    } else {
+      *trace = FrameTrace{};
+    }
+    // Forget the oldest traces of frames the encoder dropped.
+    while (m_traces.size() > kMaxPendingTraces) {
+      m_traces.erase(m_traces.begin());
+    }
+  }
   m_codec_context_waiter.notify_one();
   return ret;
 }
 
 AVCodecContextManager::~AVCodecContextManager() {
+  {
+    std::scoped_lock lock{m_build_mutex};
+    // Let a running builder discard what it opens.
+    m_generation++;
+    m_pending.reset();
+  }
+  if (m_builder.joinable()) {
+    m_builder.join();
+  }
+  avcodec_free_context(&m_ready);
+  for (auto &ctx : m_retired) {
+    avcodec_free_context(&ctx);
+  }
   avcodec_free_context(&m_ctx);
 }
 
@@ -5,39 +5,115 @@
  *  @author Moonsik Park, Korea Institute of Science and Technology
  **/
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <ctime>
-#include <iomanip>
-#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "base/camera_manager.h"
 #include "base/exceptions/lock_timeout.h"
+#include "base/frame_trace.h"
+#include "base/latency_stats.h"
+#include "base/metrics.h"
 #include "base/scoped_timer.h"
-#include "base/server/packet_stream.h"
+#include "base/server/packet_sink.h"
+#include "base/session_manager.h"
+#include "base/trace.h"
 #include "base/video/frame_map.h"
 #include "base/video/frame_queue.h"
 #include "base/video/render_text.h"
+#include "base/video/stereo_packing.h"
 #include "base/video/type_managers.h"
 
-std::string timestamp() {
-  using namespace std::chrono;
-  using clock = system_clock;
-
-  const auto current_time_point{clock::now()};
-  const auto current_time{clock::to_time_t(current_time_point)};
-  const auto current_localtime{*std::localtime(&current_time)};
-  const auto current_time_since_epoch{current_time_point.time_since_epoch()};
-  const auto current_milliseconds{
-      duration_cast<milliseconds>(current_time_since_epoch).count() % 1000};
-
-  std::ostringstream stream;
-  stream << std::put_time(&current_localtime, "%T") << "." << std::setw(3)
-         << std::setfill('0') << current_milliseconds;
-  return stream.str();
+static constexpr unsigned kLogStatsIntervalFrame = 100;
+
+#ifdef NES_ENABLE_OVERLAY
+namespace {
+
+// OverlayText formats the debug overlay of the frames of one process thread.
+// Consecutive frames mostly share their camera and the clock, so the strings
+// are formatted again only when those change.
+class OverlayText {
+ public:
+  // Camera matrix as a 4x4 matrix with the implicit last row, one row per
+  // line.
+  const std::string &camera(const nesproto::Camera &camera) {
+    if (m_camera_text.empty() ||
+        !std::equal(camera.matrix().begin(), camera.matrix().end(),
+                    m_matrix.begin(), m_matrix.end())) {
+      m_matrix.assign(camera.matrix().begin(), camera.matrix().end());
+      m_camera_text.clear();
+      char value[32];
+      for (std::size_t i = 0; i < m_matrix.size(); i++) {
+        std::snprintf(value, sizeof(value), "%+.5f ", m_matrix[i]);
+        m_camera_text += value;
+        if (i % 4 == 3) {
+          m_camera_text += '\n';
+        }
+      }
+      m_camera_text += "+0.00000 +0.00000 +0.00000 +1.00000 ";
+    }
+    return m_camera_text;
+  }
+
+  // Local time of day with milliseconds, e.g. 13:04:59.120.
+  const std::string &clock() {
+    using namespace std::chrono;
+    const auto now = system_clock::now();
+    const std::int64_t milliseconds =
+        duration_cast<std::chrono::milliseconds>(now.time_since_epoch())
+            .count();
+    if (milliseconds == m_clock_ms) {
+      return m_clock_text;
+    }
+    const std::time_t seconds = system_clock::to_time_t(now);
+    if (seconds != m_clock_seconds) {
+      std::tm local;
+      localtime_r(&seconds, &local);
+      std::strftime(m_clock_prefix, sizeof(m_clock_prefix), "%T", &local);
+      m_clock_seconds = seconds;
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), "%s.%03d", m_clock_prefix,
+                  (int)(milliseconds % 1000));
+    m_clock_text = text;
+    m_clock_ms = milliseconds;
+    return m_clock_text;
+  }
+
+ private:
+  std::vector<float> m_matrix;
+  std::string m_camera_text;
+  std::int64_t m_clock_ms = -1;
+  std::time_t m_clock_seconds = -1;
+  char m_clock_prefix[16] = {};
+  std::string m_clock_text;
+};
+
+// Draw the debug overlay into the luma plane of the converted scene.
+void draw_overlay(const RenderTextContext &etctx, RenderedFrame &frame,
+                  OverlayText &text) {
+  NES_TRACE_ZONE("draw_overlay");
+  types::FrameManager &target = frame.converted_frame_scene();
+  etctx.render_string_to_frame(
+      target, RenderTextContext::RenderPosition::RENDER_POSITION_CENTER,
+      text.camera(frame.get_cam()));
+  etctx.render_string_to_frame(
+      target, RenderTextContext::RenderPosition::RENDER_POSITION_LEFT_BOTTOM,
+      "index=" + std::to_string(frame.index()));
+  etctx.render_string_to_frame(
+      target, RenderTextContext::RenderPosition::RENDER_POSITION_LEFT_TOP,
+      text.clock());
+  etctx.render_string_to_frame(
+      target, RenderTextContext::RenderPosition::RENDER_POSITION_RIGHT_TOP,
+      frame.is_left() ? "direction=left" : "direction=right");
 }
 
-static constexpr unsigned kLogStatsIntervalFrame = 100;
+}  // namespace
+#endif  // NES_ENABLE_OVERLAY
 
 void process_frame_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
                           std::shared_ptr<FrameQueue> frame_queue,
@@ -45,57 +121,26 @@ void process_frame_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
                           std::shared_ptr<RenderTextContext> etctx,
                           std::atomic<bool> &shutdown_requested) {
   // set_thread_name("process_frame");
-  int ret;
+  Tracer::name_thread("process_frame");
   unsigned index = 0;
   uint64_t elapsed = 0;
+#ifdef NES_ENABLE_OVERLAY
+  OverlayText overlay_text;
+#endif
   while (!shutdown_requested) {
     try {
       std::unique_ptr<RenderedFrame> frame = frame_queue->pop();
       {
+        NES_TRACE_ZONE("process_frame");
         ScopedTimer timer;
         uint64_t frame_index = frame->index();
-        std::stringstream cam_matrix;
-        int idx = 0;
-        for (auto it : frame->get_cam().matrix()) {
-          idx++;
-          cam_matrix << std::fixed << std::showpos << std::setw(7)
-                     << std::setprecision(5) << std::setfill('0') << it << ' ';
-          if (idx % 4 == 0) {
-            cam_matrix << '\n';
-          }
-        }
-        cam_matrix << std::fixed << std::showpos << std::setw(7)
-                   << std::setprecision(5) << std::setfill('0') << 0.f << ' '
-                   << std::fixed << std::showpos << std::setw(7)
-                   << std::setprecision(5) << std::setfill('0') << 0.f << ' '
-                   << std::fixed << std::showpos << std::setw(7)
-                   << std::setprecision(5) << std::setfill('0') << 0.f << ' '
-                   << std::fixed << std::showpos << std::setw(7)
-                   << std::setprecision(5) << std::setfill('0') << 1.f << ' ';
-
-        etctx->render_string_to_frame(
-            frame->source_frame_scene(),
-            RenderTextContext::RenderPosition::RENDER_POSITION_CENTER,
-            cam_matrix.str());
-
-        etctx->render_string_to_frame(
-            frame->source_frame_scene(),
-            RenderTextContext::RenderPosition::RENDER_POSITION_LEFT_BOTTOM,
-            std::string("index=") + std::to_string(frame->index()));
-
-        etctx->render_string_to_frame(
-            frame->source_frame_scene(),
-            RenderTextContext::RenderPosition::RENDER_POSITION_LEFT_TOP,
-            timestamp());
-
-        std::string direction =
-            frame->is_left() ? "direction=left" : "direction=right";
-
-        etctx->render_string_to_frame(
-            frame->source_frame_scene(),
-            RenderTextContext::RenderPosition::RENDER_POSITION_RIGHT_TOP,
-            direction);
         frame->convert_frame();
+#ifdef NES_ENABLE_OVERLAY
+        if (etctx) {
+          draw_overlay(*etctx, *frame, overlay_text);
+        }
+#endif
+        frame->trace().processed = FrameTrace::now();
 
         encode_queue->insert(frame_index, std::move(frame));
         index++;
@@ -105,7 +150,7 @@ void process_frame_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
           tlog::info()
               << "process_frame_thread: frame processing average time of "
               << kLogStatsIntervalFrame
-              << " frames: " << elapsed / kLogStatsIntervalFrame << " msec.";
+              << " frames: " << elapsed / kLogStatsIntervalFrame << " usec.";
           index = 0;
           elapsed = 0;
         }
@@ -124,6 +169,13 @@ void send_frame_thread(
     std::shared_ptr<FrameMap> encode_queue,
     std::atomic<bool> &shutdown_requested) {
   // set_thread_name("send_frame");
+  Tracer::name_thread("send_frame");
+  auto dropped = MetricsRegistry::global().counter(
+      "nes_frames_dropped_total", "Frames dropped by the pipeline.",
+      {{"reason", "not_rendered"}});
+  auto rescaled = MetricsRegistry::global().counter(
+      "nes_frames_rescaled_total",
+      "Frames scaled to the resolution of a new encoder before encoding.");
   uint64_t frame_index = 0;
   unsigned index = 0;
   uint64_t elapsed = 0;
@@ -132,61 +184,36 @@ void send_frame_thread(
       ScopedTimer timer;
       std::unique_ptr<RenderedFrame> processed_frame =
           encode_queue->get_delete(frame_index);
+      NES_TRACE_ZONE("send_frame");
 
-      switch (scene_codecctx->send_frame(
-          processed_frame->converted_frame_scene().to_avframe().get())) {
-        case AVERROR(EINVAL):
-          // Codec not opened, it is a decoder, or requires flush.
-          std::runtime_error{
-              "Codec not opened, it is a decoder, or requires flush."};
-          break;
-        case AVERROR(ENOMEM):
-          // Failed to add packet to internal queue, or similar other errors:
-          // legitimate encoding errors.
-          std::runtime_error{
-              "Failed to add packet to internal queue, or other."};
-          break;
-        case AVERROR_EOF:
-          // The encoder has been flushed, and no new frames can be sent to it.
-          std::runtime_error{
-              "The encoder has been flushed, and no new frames can be sent to "
-              "it."};
-          break;
-        case AVERROR(EAGAIN):
-          // Input is not accepted in the current state - user must read output
-          // with avcodec_receive_packet() (once all output is read, the packet
-          // should be resent, and the call will not fail with EAGAIN).
-        default:
-          // Success.
-          break;
+      // Switch to the encoders opened for a new resolution at this frame
+      // boundary. Frames converted for the previous resolution are scaled.
+      auto scene_info = scene_codecctx->cut_over();
+      auto depth_info = depth_codecctx->cut_over();
+      if (processed_frame->fit_converted(scene_info, depth_info)) {
+        rescaled->inc();
       }
 
-      switch (depth_codecctx->send_frame(
-          processed_frame->converted_frame_depth().to_avframe().get())) {
-        case AVERROR(EINVAL):
-          // Codec not opened, it is a decoder, or requires flush.
-          std::runtime_error{
-              "Codec not opened, it is a decoder, or requires flush."};
-          break;
-        case AVERROR(ENOMEM):
-          // Failed to add packet to internal queue, or similar other errors:
-          // legitimate encoding errors.
-          std::runtime_error{
-              "Failed to add packet to internal queue, or other."};
-          break;
-        case AVERROR_EOF:
-          // The encoder has been flushed, and no new frames can be sent to it.
-          std::runtime_error{
-              "The encoder has been flushed, and no new frames can be sent to "
-              "it."};
-          break;
-        case AVERROR(EAGAIN):
-          // Input is not accepted in the current state - user must read output
-          // with avcodec_receive_packet() (once all output is read, the packet
-          // should be resent, and the call will not fail with EAGAIN).
-        default:
-          // Success.
-          break;
+      // The encoders set the pts from the frame time of the trace.
+      auto avframe_scene =
+          processed_frame->converted_frame_scene().to_avframe();
+      auto avframe_depth =
+          processed_frame->converted_frame_depth().to_avframe();
+      processed_frame->trace().encoder_in = FrameTrace::now();
+
+      // EAGAIN only asks for the packets to be read first, which
+      // receive_packet_thread does.
+      if (int ret = scene_codecctx->send_frame(avframe_scene.get(),
+                                               processed_frame->trace());
+          ret < 0 && ret != AVERROR(EAGAIN)) {
+        tlog::error() << "send_frame_thread: Failed to send scene: "
+                      << types::averror_explain(ret);
+      }
+      if (int ret = depth_codecctx->send_frame(avframe_depth.get(),
+                                               processed_frame->trace());
+          ret < 0 && ret != AVERROR(EAGAIN)) {
+        tlog::error() << "send_frame_thread: Failed to send depth: "
+                      << types::averror_explain(ret);
       }
       index++;
       elapsed += timer.elapsed().count();
@@ -196,14 +223,23 @@ void send_frame_thread(
                         "encoder of "
                      << kLogStatsIntervalFrame
                      << " frames: " << elapsed / kLogStatsIntervalFrame
-                     << " msec.";
+                     << " usec.";
         index = 0;
         elapsed = 0;
       }
     } catch (const LockTimeout &) {
-      // If the frame is not located until timeout, go to next frame.
-      tlog::error() << "send_frame_thread (index=" << frame_index
-                    << "): Timeout reached while waiting for frame. Skipping.";
+      // Continue with the oldest frame rendered since. Nothing arrives while
+      // the eye is suspended, and the requests resume at this index.
+      auto next = encode_queue->next_index(frame_index);
+      if (next && *next > frame_index) {
+        dropped->inc(*next - frame_index);
+        tlog::error() << "send_frame_thread (index=" << frame_index
+                      << "): Timeout reached while waiting for frame. "
+                         "Skipping to index "
+                      << *next << ".";
+        frame_index = *next;
+      }
+      continue;
     }
     frame_index++;
   }
@@ -211,14 +247,154 @@ void send_frame_thread(
   tlog::info() << "send_frame_thread: Exiting thread.";
 }
 
-int receive_packet_handler(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
-                           AVPacket *pkt,
-                           std::shared_ptr<PacketStreamServer> mctx,
-                           std::atomic<bool> &shutdown_requested) {
+void send_packed_frame_thread(
+    std::shared_ptr<types::AVCodecContextManager> scene_codecctx,
+    std::shared_ptr<types::AVCodecContextManager> depth_codecctx,
+    std::shared_ptr<FrameMap> encode_queue_left,
+    std::shared_ptr<FrameMap> encode_queue_right, StereoLayout layout,
+    std::atomic<bool> &shutdown_requested) {
+  Tracer::name_thread("send_packed_frame");
+  auto dropped = MetricsRegistry::global().counter(
+      "nes_frames_dropped_total", "Frames dropped by the pipeline.",
+      {{"reason", "not_rendered"}});
+  auto rescaled = MetricsRegistry::global().counter(
+      "nes_frames_rescaled_total",
+      "Frames scaled to the resolution of a new encoder before encoding.");
+  // The packed frames are reused; the encoder copies frames it keeps.
+  std::unique_ptr<types::FrameManager> packed_scene;
+  std::unique_ptr<types::FrameManager> packed_depth;
+  auto fit = [](std::unique_ptr<types::FrameManager> &frame,
+                const types::AVCodecContextManager::CodecInitInfo &info) {
+    if (!frame || frame->context().width != info.width ||
+        frame->context().height != info.height) {
+      frame = std::make_unique<types::FrameManager>(
+          types::FrameManager::FrameContext(info));
+    }
+  };
+  uint64_t frame_index = 0;
+  unsigned index = 0;
+  uint64_t elapsed = 0;
+  while (!shutdown_requested) {
+    try {
+      ScopedTimer timer;
+      std::unique_ptr<RenderedFrame> left =
+          encode_queue_left->get_delete(frame_index);
+      std::unique_ptr<RenderedFrame> right;
+      try {
+        right = encode_queue_right->get_delete(frame_index);
+      } catch (const LockTimeout &) {
+        // The left eye cannot be sent alone.
+        dropped->inc();
+        frame_index++;
+        throw;
+      }
+      NES_TRACE_ZONE("send_packed_frame");
+
+      auto scene_info = scene_codecctx->cut_over();
+      auto depth_info = depth_codecctx->cut_over();
+      for (RenderedFrame *frame : {left.get(), right.get()}) {
+        if (frame->fit_converted(eye_info(layout, scene_info),
+                                 eye_info(layout, depth_info))) {
+          rescaled->inc();
+        }
+      }
+      fit(packed_scene, scene_info);
+      fit(packed_depth, depth_info);
+      try {
+        pack_eye(layout, true, left->converted_frame_scene(), *packed_scene);
+        pack_eye(layout, false, right->converted_frame_scene(), *packed_scene);
+        pack_eye(layout, true, left->converted_frame_depth(), *packed_depth);
+        pack_eye(layout, false, right->converted_frame_depth(),
+                 *packed_depth);
+      } catch (const std::runtime_error &e) {
+        // The eyes may not fit the packed frames while the resolution changes.
+        dropped->inc();
+        tlog::error() << "send_packed_frame_thread (index=" << frame_index
+                      << "): " << e.what() << " Skipping.";
+        frame_index++;
+        continue;
+      }
+
+      auto avframe_scene = packed_scene->to_avframe();
+      auto avframe_depth = packed_depth->to_avframe();
+      // The left eye is requested first, so its trace stands for the pair.
+      FrameTrace trace = left->trace();
+      trace.encoder_in = FrameTrace::now();
+
+      if (int ret = scene_codecctx->send_frame(avframe_scene.get(), trace);
+          ret < 0 && ret != AVERROR(EAGAIN)) {
+        tlog::error() << "send_packed_frame_thread: Failed to send scene: "
+                      << types::averror_explain(ret);
+      }
+      if (int ret = depth_codecctx->send_frame(avframe_depth.get(), trace);
+          ret < 0 && ret != AVERROR(EAGAIN)) {
+        tlog::error() << "send_packed_frame_thread: Failed to send depth: "
+                      << types::averror_explain(ret);
+      }
+      index++;
+      elapsed += timer.elapsed().count();
+
+      if (index == kLogStatsIntervalFrame) {
+        tlog::info() << "send_packed_frame_thread: average time of sending "
+                        "packed frame to encoder of "
+                     << kLogStatsIntervalFrame
+                     << " frames: " << elapsed / kLogStatsIntervalFrame
+                     << " usec.";
+        index = 0;
+        elapsed = 0;
+      }
+    } catch (const LockTimeout &) {
+      // Continue with the oldest pair rendered since, as send_frame_thread()
+      // does. Both eyes are suspended and resumed together.
+      auto next = encode_queue_left->next_index(frame_index);
+      if (next && *next > frame_index) {
+        dropped->inc(*next - frame_index);
+        tlog::error() << "send_packed_frame_thread (index=" << frame_index
+                      << "): Timeout reached while waiting for frame. "
+                         "Skipping to index "
+                      << *next << ".";
+        frame_index = *next;
+      }
+      continue;
+    }
+    frame_index++;
+  }
+
+  tlog::info() << "send_packed_frame_thread: Exiting thread.";
+}
+
+namespace {
+
+// Encoder output of a stream. The bitrate is the rate of bytes.
+struct PacketMetrics {
+  explicit PacketMetrics(const std::string &stream)
+      : bytes(MetricsRegistry::global().counter(
+            "nes_encoded_bytes_total", "Bytes of encoded packets.",
+            {{"stream", stream}})),
+        packets(MetricsRegistry::global().counter(
+            "nes_encoded_packets_total", "Encoded packets.",
+            {{"stream", stream}})),
+        keyframes(MetricsRegistry::global().counter(
+            "nes_encoded_keyframes_total", "Encoded key frames.",
+            {{"stream", stream}})) {}
+
+  std::shared_ptr<Counter> bytes;
+  std::shared_ptr<Counter> packets;
+  std::shared_ptr<Counter> keyframes;
+};
+
+}  // namespace
+
+int receive_packet_handler(
+    std::shared_ptr<types::AVCodecContextManager> ctxmgr, AVPacket *pkt,
+    const std::vector<std::shared_ptr<PacketSink>> &sinks,
+    std::shared_ptr<LatencyStats> latency_stats, PacketMetrics &metrics,
+    std::atomic<bool> &shutdown_requested) {
   int ret;
+  FrameTrace trace;
 
   while (!shutdown_requested) {
-    ret = ctxmgr->receive_packet(pkt);
+    ret = ctxmgr->receive_packet(pkt, &trace);
 
     switch (ret) {
       case AVERROR(EAGAIN):  // output is not available in the current state -
@@ -227,9 +403,20 @@ int receive_packet_handler(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
         // AVCodecContext.
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
         break;
-      case 0:
-        mctx->consume_packet(pkt);
+      case 0: {
+        NES_TRACE_ZONE("consume_packet");
+        trace.packet_out = FrameTrace::now();
+        latency_stats->record(trace);
+        metrics.bytes->inc(pkt->size);
+        metrics.packets->inc();
+        if (pkt->flags & AV_PKT_FLAG_KEY) {
+          metrics.keyframes->inc();
+        }
+        for (auto &sink : sinks) {
+          sink->consume_packet(pkt, trace);
+        }
         return 0;
+      }
       case AVERROR(EINVAL):  // codec not opened, or it is a decoder other
                              // errors: legitimate encoding errors
       default:
@@ -246,13 +433,17 @@ int receive_packet_handler(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
 }
 
 void receive_packet_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
-                           std::shared_ptr<PacketStreamServer> mctx,
+                           std::vector<std::shared_ptr<PacketSink>> sinks,
+                           std::shared_ptr<LatencyStats> latency_stats,
+                           std::string stream_name,
                            std::atomic<bool> &shutdown_requested) {
   // set_thread_name("receive_packet");
+  Tracer::name_thread("receive_packet:" + stream_name);
+  PacketMetrics metrics(stream_name);
   while (!shutdown_requested) {
     types::AVPacketManager pkt;
     try {
-      if (receive_packet_handler(ctxmgr, pkt(), mctx,
+      if (receive_packet_handler(ctxmgr, pkt(), sinks, latency_stats, metrics,
                                  std::ref(shutdown_requested)) < 0) {
         shutdown_requested = true;
       }
@@ -269,20 +460,24 @@ void receive_packet_thread(std::shared_ptr<types::AVCodecContextManager> ctxmgr,
 
 static constexpr unsigned kEncodeStatsLogIntervalSeconds = 10;
 
-void encode_stats_thread(std::atomic<std::uint64_t> &frame_index_left,
-                         std::atomic<std::uint64_t> &frame_index_right,
+void encode_stats_thread(std::shared_ptr<SessionManager> session_manager,
                          std::atomic<bool> &shutdown_requested) {
   // set_thread_name("encode_stats");
+  Tracer::name_thread("encode_stats");
   uint64_t previous_index = 0;
   uint64_t seconds = 0;
   while (!shutdown_requested) {
     seconds++;
-    uint64_t current_index = frame_index_left.load() + frame_index_right.load();
+    uint64_t current_index = session_manager->requested_frames();
     if (seconds == kEncodeStatsLogIntervalSeconds) {
       tlog::info() << "encode_stats_thread: Average frame rate of the last "
                    << kEncodeStatsLogIntervalSeconds
                    << " seconds: " << (current_index - previous_index) / seconds
-                   << " fps.";
+                   << " fps; " << session_manager->size()
+                   << " active session(s).";
+      tlog::info() << "encode_stats_thread: Frame latency of the last "
+                   << LatencyStats::kWindowSize << " packets:"
+                   << session_manager->latency_stats()->summary();
       previous_index = current_index;
       seconds = 0;
     }
@@ -290,3 +485,36 @@ void encode_stats_thread(std::atomic<std::uint64_t> &frame_index_left,
   }
   tlog::info() << "encode_stats_thread: Exiting thread.";
 }
+
+static constexpr std::chrono::milliseconds kSessionReapInterval{500};
+
+void session_reaper_thread(std::shared_ptr<SessionManager> session_manager,
+                           std::atomic<bool> &shutdown_requested) {
+  // set_thread_name("session_reaper");
+  Tracer::name_thread("session_reaper");
+  while (!shutdown_requested) {
+    session_manager->reap();
+    // The primary session stops itself on an unrecoverable encoder error.
+    // Nothing can be served without it.
+    if (session_manager->primary()->stop_requested()) {
+      tlog::error() << "session_reaper_thread: Primary session stopped. "
+                       "Shutting down.";
+      shutdown_requested = true;
+    }
+    std::this_thread::sleep_for(kSessionReapInterval);
+  }
+  tlog::info() << "session_reaper_thread: Exiting thread.";
+}
+
+// Delay of suspending or resuming a stream after its viewers change.
+static constexpr std::chrono::milliseconds kViewerRefreshInterval{20};
+
+void viewer_monitor_thread(std::shared_ptr<SessionManager> session_manager,
+                           std::atomic<bool> &shutdown_requested) {
+  Tracer::name_thread("viewer_monitor");
+  while (!shutdown_requested) {
+    session_manager->refresh_viewers();
+    std::this_thread::sleep_for(kViewerRefreshInterval);
+  }
+  tlog::info() << "viewer_monitor_thread: Exiting thread.";
+}
@@ -11,11 +11,20 @@
 #include <csignal>
 #include <thread>
 
+#include "base/bandwidth_estimator.h"
 #include "base/camera_manager.h"
+#include "base/renderer_list.h"
+#include "base/runtime_config.h"
 #include "base/server/camera_control.h"
+#include "base/server/io_context_pool.h"
+#include "base/server/metrics_server.h"
+#include "base/server/multiplex_server.h"
 #include "base/server/packet_stream.h"
-#include "base/video/frame_queue.h"
+#include "base/session_manager.h"
+#include "base/trace.h"
+#include "base/video/encoder_backend.h"
 #include "base/video/render_text.h"
+#include "base/video/stereo_packing.h"
 #include "base/video/type_managers.h"
 #include "encode.h"
 #include "server.h"
@@ -84,7 +93,9 @@ int main(int argc, char **argv) {
         parser,
         "ENCODE_PRESET",
         "Encode preset {ultrafast, superfast, veryfast, faster, fast, medium, "
-        "slow, slower, veryslow (default), placebo}",
+        "slow, slower, veryslow, placebo}. placebo is for libx264 and libx265 "
+        "only; the other encoders map a preset to their nearest speed "
+        "setting. default: ultrafast",
         {"encode_preset"},
         "ultrafast",
     };
@@ -98,6 +109,40 @@ int main(int argc, char **argv) {
         "stillimage,zerolatency",
     };
 
+    ValueFlag<std::string> scene_encoder_flag{
+        parser,
+        "SCENE_ENCODER",
+        "Encoder of the scene streams {libx264, libx265, libvpx-vp9, "
+        "libaom-av1, libsvtav1}. default: libx264",
+        {"scene_encoder"},
+        "libx264",
+    };
+
+    ValueFlag<std::string> depth_encoder_flag{
+        parser,
+        "DEPTH_ENCODER",
+        "Encoder of the depth streams, see --scene_encoder. default: libx264",
+        {"depth_encoder"},
+        "libx264",
+    };
+
+    ValueFlag<std::string> stereo_packing_flag{
+        parser,
+        "STEREO_PACKING",
+        "Pack both eyes into one frame per stream type {none, side_by_side, "
+        "top_bottom}, halving the encoders. Packed streams are sent on the "
+        "left streams. default: none",
+        {"stereo_packing"},
+        "none",
+    };
+
+    Flag list_encoders_flag{
+        parser,
+        "LIST_ENCODERS",
+        "List the encoders and whether libavcodec was built with them.",
+        {"list_encoders"},
+    };
+
     ValueFlag<unsigned int> width_flag{
         parser, "WIDTH", "Width of requesting image.", {"width"}, 1280,
     };
@@ -107,14 +152,47 @@ int main(int argc, char **argv) {
     };
 
     ValueFlag<unsigned int> bitrate_flag{
-        parser, "BITRATE", "Bitrate of output stream.", {"bitrate"}, 400000,
+        parser,
+        "BITRATE",
+        "Initial bitrate of each scene stream. The bitrate adapts to the "
+        "feedback of the clients.",
+        {"bitrate"},
+        400000,
+    };
+
+    ValueFlag<unsigned int> depth_bitrate_flag{
+        parser,
+        "DEPTH_BITRATE",
+        "Initial bitrate of each depth stream. The adapted bitrate is split "
+        "between the scene and depth streams in the ratio of BITRATE to "
+        "DEPTH_BITRATE. default: BITRATE",
+        {"depth_bitrate"},
+        0,
+    };
+
+    ValueFlag<unsigned int> min_bitrate_flag{
+        parser,
+        "MIN_BITRATE",
+        "Lowest bitrate of all streams of a session the feedback of the "
+        "clients can lead to.",
+        {"min_bitrate"},
+        BandwidthEstimator::Options{}.min_bit_rate,
+    };
+
+    ValueFlag<unsigned int> max_bitrate_flag{
+        parser,
+        "MAX_BITRATE",
+        "Highest bitrate of all streams of a session the feedback of the "
+        "clients can lead to.",
+        {"max_bitrate"},
+        BandwidthEstimator::Options{}.max_bit_rate,
     };
 
     ValueFlag<unsigned int> fps_flag{
         parser,
         "FPS",
         "Frame per second of output stream. This does not guarantee that n "
-        "frames will be present.",
+        "frames will be present unless --render_pacing is set.",
         {"fps"},
         30,
     };
@@ -122,6 +200,15 @@ int main(int argc, char **argv) {
         parser, "KEYINT", "Group of picture (GOP) size", {"keyint"}, 250,
     };
 
+    Flag intra_refresh_flag{
+        parser,
+        "INTRA_REFRESH",
+        "Replace the periodic key frames with a column of intra blocks "
+        "sweeping the frame every KEYINT frames, avoiding the bitrate spike "
+        "of key frames. Requires libx264 or libx265.",
+        {"intra_refresh"},
+    };
+
     ValueFlag<std::string> font_flag{
         parser,
         "FONT",
@@ -138,6 +225,144 @@ int main(int argc, char **argv) {
         9998,
     };
 
+    ValueFlag<uint16_t> multiplex_server_port{
+        parser,
+        "MULTIPLEX_SERVER_PORT",
+        "Port the multiplexed websocket server should bind to. It carries "
+        "camera control and every packet stream over a single connection.",
+        {"multiplex_server_port"},
+        9997,
+    };
+
+    ValueFlag<uint16_t> metrics_port_flag{
+        parser,
+        "METRICS_PORT",
+        "Port the HTTP server exposing metrics at /metrics and the runtime "
+        "configuration at /config should bind to. 0 disables it.",
+        {"metrics_port"},
+        9996,
+    };
+
+    Flag trace_flag{
+        parser,
+        "TRACE",
+        "Record trace zones from the start. Tracing can also be switched at "
+        "/trace/start and /trace/stop of the metrics server.",
+        {"trace"},
+    };
+
+    ValueFlag<std::string> trace_file_flag{
+        parser,
+        "TRACE_FILE",
+        "Write the recorded trace zones to this file in the Chrome trace "
+        "event format on exit.",
+        {"trace_file"},
+        "",
+    };
+
+    ValueFlag<std::string> record_flag{
+        parser,
+        "RECORD",
+        "Record the cameras and the rendered frames of the primary session to "
+        "this capture file.",
+        {"record"},
+        "",
+    };
+
+    ValueFlag<std::string> replay_flag{
+        parser,
+        "REPLAY",
+        "Feed the primary session from this capture file instead of the "
+        "renderers.",
+        {"replay"},
+        "",
+    };
+
+    ValueFlag<double> replay_speed_flag{
+        parser,
+        "REPLAY_SPEED",
+        "Pace of the replay relative to the recording. 0 replays as fast as "
+        "the encoders take the frames.",
+        {"replay_speed"},
+        1.0,
+    };
+
+    ValueFlag<unsigned int> replay_loops_flag{
+        parser,
+        "REPLAY_LOOPS",
+        "Number of times the capture file is replayed.",
+        {"replay_loops"},
+        1,
+    };
+
+    ValueFlag<unsigned int> io_threads_flag{
+        parser,
+        "IO_THREADS",
+        "Number of threads shared by the websocket servers to accept, read "
+        "and write connections.",
+        {"io_threads"},
+        4,
+    };
+
+    ValueFlag<unsigned int> max_sessions_flag{
+        parser,
+        "MAX_SESSIONS",
+        "Maximum number of sessions including the primary session. Every "
+        "session has its own camera and encoders and shares the renderers.",
+        {"max_sessions"},
+        4,
+    };
+
+    ValueFlag<unsigned int> queue_size_flag{
+        parser,
+        "QUEUE_SIZE",
+        "Frames each eye of a session may hold while waiting to be processed "
+        "and while waiting to be encoded.",
+        {"queue_size"},
+        FrameQueue::kFrameQueueMaxSize,
+    };
+
+    Flag render_pacing_flag{
+        parser,
+        "RENDER_PACING",
+        "Request frames from the renderers at FPS frames per second per eye, "
+        "timed to arrive just before they are encoded, instead of as fast as "
+        "the renderers answer.",
+        {"render_pacing"},
+    };
+
+    Flag no_idle_suspension_flag{
+        parser,
+        "NO_IDLE_SUSPENSION",
+        "Keep rendering and encoding every stream while no client receives "
+        "it. Always set when replaying a capture.",
+        {"no_idle_suspension"},
+    };
+
+    Flag no_overlay_flag{
+        parser,
+        "NO_OVERLAY",
+        "Do not draw the debug overlay (camera matrix, frame index, time and "
+        "eye) on the scene frames.",
+        {"no_overlay"},
+    };
+
+    Flag no_legacy_servers_flag{
+        parser,
+        "NO_LEGACY_SERVERS",
+        "Do not start the camera control and per-stream packet stream "
+        "servers. Clients must use the multiplexed server.",
+        {"no_legacy_servers"},
+    };
+
+    Flag gop_cache_flag{
+        parser,
+        "GOP_CACHE",
+        "Send new clients of the per-stream packet stream servers the packets "
+        "since the last key frame instead of forcing a key frame.",
+        {"gop_cache"},
+    };
+
     ValueFlag<uint16_t> server_packet_stream_scene_left_port{
         parser,
         "SCENE_PACKET_STREAM_SERVER_PORT",
@@ -190,141 +415,217 @@ int main(int argc, char **argv) {
       return 0;
     }
 
-    tlog::info() << "Initalizing encoder.";
-
-    auto codec_scene_left = std::make_shared<types::AVCodecContextManager>(
-        types::AVCodecContextManager::CodecInitInfo(
-            AV_CODEC_ID_H264, AV_PIX_FMT_YUV420P, get(encode_preset_flag),
-            get(encode_tune_flag), get(width_flag), get(height_flag),
-            get(bitrate_flag), get(fps_flag), get(keyint_flag)));
-
-    auto codec_depth_left = std::make_shared<types::AVCodecContextManager>(
-        types::AVCodecContextManager::CodecInitInfo(
-            AV_CODEC_ID_H264, AV_PIX_FMT_YUV420P, get(encode_preset_flag),
-            get(encode_tune_flag), get(width_flag), get(height_flag),
-            get(bitrate_flag), get(fps_flag), get(keyint_flag)));
-
-    auto codec_scene_right = std::make_shared<types::AVCodecContextManager>(
-        types::AVCodecContextManager::CodecInitInfo(
-            AV_CODEC_ID_H264, AV_PIX_FMT_YUV420P, get(encode_preset_flag),
-            get(encode_tune_flag), get(width_flag), get(height_flag),
-            get(bitrate_flag), get(fps_flag), get(keyint_flag)));
-
-    auto codec_depth_right = std::make_shared<types::AVCodecContextManager>(
-        types::AVCodecContextManager::CodecInitInfo(
-            AV_CODEC_ID_H264, AV_PIX_FMT_YUV420P, get(encode_preset_flag),
-            get(encode_tune_flag), get(width_flag), get(height_flag),
-            get(bitrate_flag), get(fps_flag), get(keyint_flag)));
-
-    auto etctx = std::make_shared<RenderTextContext>(get(font_flag));
-    tlog::info() << "Initialized text renderer.";
-
-    auto server_packet_stream_scene_left = std::make_shared<PacketStreamServer>(
-        get(server_packet_stream_scene_left_port),
-        std::string("server_packet_stream_scene_left"));
-
-    auto server_packet_stream_depth_left = std::make_shared<PacketStreamServer>(
-        get(server_packet_stream_depth_left_port),
-        std::string("server_packet_stream_depth_left"));
-
-    auto server_packet_stream_scene_right =
-        std::make_shared<PacketStreamServer>(
-            get(server_packet_stream_scene_right_port),
-            std::string("server_packet_stream_scene_right"));
-
-    auto server_packet_stream_depth_right =
-        std::make_shared<PacketStreamServer>(
-            get(server_packet_stream_depth_right_port),
-            std::string("server_packet_stream_depth_right"));
-
-    server_packet_stream_scene_left->start();
-    server_packet_stream_depth_left->start();
-    server_packet_stream_scene_right->start();
-    server_packet_stream_depth_right->start();
-
-    tlog::info() << "Initalizing queue.";
-    auto frame_queue_left = std::make_shared<FrameQueue>();
-    auto frame_map_left = std::make_shared<FrameMap>();
-    auto frame_queue_right = std::make_shared<FrameQueue>();
-    auto frame_map_right = std::make_shared<FrameMap>();
-    auto cameramgr = std::make_shared<CameraManager>(
-        codec_scene_left, codec_depth_left, codec_scene_right,
-        codec_depth_right, get(width_flag), get(height_flag));
-
-    tlog::info() << "Initalizing camera control server.";
-    auto ccsvr = std::make_shared<CameraControlServer>(
-        cameramgr, get(camera_control_server_port));
-    ccsvr->start();
-
-    std::atomic<std::uint64_t> frame_index_left = 0;
-    std::atomic<std::uint64_t> frame_index_right = 0;
-    std::atomic<int> is_left{0};
+    if (list_encoders_flag) {
+      for (const auto &backend : EncoderBackend::all()) {
+        auto caps = backend->capabilities();
+        tlog::info() << backend->name() << ": "
+                     << (backend->available() ? "available" : "unavailable")
+                     << " annex_b=" << caps.annex_b
+                     << " zero_latency=" << caps.zero_latency
+                     << " intra_refresh=" << caps.intra_refresh;
+      }
+      return 0;
+    }
+
+    Tracer::name_thread("main");
+    if (trace_flag) {
+      Tracer::enable(true);
+    }
+
+    if (!get(record_flag).empty() && !get(replay_flag).empty()) {
+      tlog::error() << "--record and --replay cannot be used together.";
+      return -1;
+    }
+
+    // Sessions skip the overlay stage without a text renderer.
+    std::shared_ptr<RenderTextContext> etctx;
+#ifdef NES_ENABLE_OVERLAY
+    if (!no_overlay_flag) {
+      etctx = std::make_shared<RenderTextContext>(get(font_flag));
+      tlog::info() << "Initialized text renderer.";
+    }
+#else
+    tlog::info() << "The overlay is not compiled in.";
+#endif
+
+    tlog::info() << "Initalizing primary session; scene_encoder="
+                 << get(scene_encoder_flag)
+                 << " depth_encoder=" << get(depth_encoder_flag);
+    auto codec_info = [&](const std::string &encoder, unsigned bit_rate) {
+      return types::AVCodecContextManager::CodecInitInfo(
+          encoder, AV_PIX_FMT_YUV420P, get(encode_preset_flag),
+          get(encode_tune_flag), get(width_flag), get(height_flag), bit_rate,
+          get(fps_flag), get(keyint_flag),
+          static_cast<bool>(intra_refresh_flag));
+    };
+    const unsigned depth_bitrate = get(depth_bitrate_flag) != 0
+                                       ? get(depth_bitrate_flag)
+                                       : get(bitrate_flag);
+    BandwidthEstimator::Options bit_rate_limits;
+    bit_rate_limits.min_bit_rate = get(min_bitrate_flag);
+    bit_rate_limits.max_bit_rate = get(max_bitrate_flag);
+    auto session_manager = std::make_shared<SessionManager>(
+        codec_info(get(scene_encoder_flag), get(bitrate_flag)),
+        codec_info(get(depth_encoder_flag), depth_bitrate), etctx,
+        get(max_sessions_flag), get(queue_size_flag),
+        parse_stereo_layout(get(stereo_packing_flag)), bit_rate_limits,
+        static_cast<bool>(render_pacing_flag),
+        !no_idle_suspension_flag && get(replay_flag).empty());
+    auto primary_session = session_manager->primary();
+
+    std::shared_ptr<CaptureWriter> capture_writer;
+    if (!get(record_flag).empty()) {
+      capture_writer = std::make_shared<CaptureWriter>(get(record_flag));
+      primary_session->record(capture_writer);
+      tlog::info() << "Recording the primary session to "
+                   << get(record_flag) << ".";
+    }
+
+    std::shared_ptr<CaptureReader> capture_reader;
+    if (!get(replay_flag).empty()) {
+      capture_reader = std::make_shared<CaptureReader>(get(replay_flag));
+    }
+
+    // Renderers can be changed at runtime through the metrics server.
+    std::shared_ptr<RendererList> renderers;
+    if (!capture_reader) {
+      renderers = std::make_shared<RendererList>(get(renderer_addr_flag));
+    }
+
+    tlog::info() << "Initalizing io thread pool.";
+    auto io_pool = std::make_shared<IoContextPool>(get(io_threads_flag));
+    io_pool->start();
+
+    tlog::info() << "Initalizing multiplex server.";
+    auto multiplex_server = std::make_shared<MultiplexServer>(
+        session_manager, get(multiplex_server_port), io_pool);
+
+    std::shared_ptr<MetricsServer> metrics_server;
+    if (get(metrics_port_flag) != 0) {
+      tlog::info() << "Initalizing metrics server.";
+      metrics_server = std::make_shared<MetricsServer>(
+          MetricsRegistry::global(), get(metrics_port_flag), io_pool,
+          std::make_shared<RuntimeConfig>(session_manager, renderers));
+    }
+
+    auto primary_sinks =
+        multiplex_server->session_sinks(SessionManager::kPrimarySessionId);
+
+    std::vector<std::shared_ptr<WebSocketServer>> legacy_servers;
+
+    if (!no_legacy_servers_flag) {
+      const bool gop_cache = static_cast<bool>(gop_cache_flag);
+
+      auto server_packet_stream_scene_left =
+          std::make_shared<PacketStreamServer>(
+              get(server_packet_stream_scene_left_port),
+              std::string("server_packet_stream_scene_left"), io_pool,
+              gop_cache);
+
+      auto server_packet_stream_depth_left =
+          std::make_shared<PacketStreamServer>(
+              get(server_packet_stream_depth_left_port),
+              std::string("server_packet_stream_depth_left"), io_pool,
+              gop_cache);
+
+      auto server_packet_stream_scene_right =
+          std::make_shared<PacketStreamServer>(
+              get(server_packet_stream_scene_right_port),
+              std::string("server_packet_stream_scene_right"), io_pool,
+              gop_cache);
+
+      auto server_packet_stream_depth_right =
+          std::make_shared<PacketStreamServer>(
+              get(server_packet_stream_depth_right_port),
+              std::string("server_packet_stream_depth_right"), io_pool,
+              gop_cache);
+
+      primary_sinks[Session::STREAM_SCENE_LEFT].push_back(
+          server_packet_stream_scene_left);
+      primary_sinks[Session::STREAM_DEPTH_LEFT].push_back(
+          server_packet_stream_depth_left);
+      primary_sinks[Session::STREAM_SCENE_RIGHT].push_back(
+          server_packet_stream_scene_right);
+      primary_sinks[Session::STREAM_DEPTH_RIGHT].push_back(
+          server_packet_stream_depth_right);
+
+      tlog::info() << "Initalizing camera control server.";
+      auto ccsvr = std::make_shared<CameraControlServer>(
+          primary_session->camera_manager(), get(camera_control_server_port),
+          io_pool);
+
+      legacy_servers = {server_packet_stream_scene_left,
+                        server_packet_stream_depth_left,
+                        server_packet_stream_scene_right,
+                        server_packet_stream_depth_right, ccsvr};
+    }
+
+    primary_session->start(primary_sinks);
+
+    multiplex_server->start();
+    if (metrics_server) {
+      metrics_server->start();
+    }
+    for (auto &server : legacy_servers) {
+      server->start();
+    }
 
     tlog::info() << "Done bootstrapping.";
 
     std::vector<std::thread> threads;
 
-    std::thread _socket_main_thread(
-        socket_main_thread, get(renderer_addr_flag), frame_queue_left,
-        frame_queue_right, std::ref(frame_index_left),
-        std::ref(frame_index_right), std::ref(is_left), cameramgr,
-        codec_scene_left, codec_depth_left, std::ref(shutdown_requested));
-    threads.push_back(std::move(_socket_main_thread));
-
-    std::thread _process_frame_thread_left(
-        process_frame_thread, codec_scene_left, frame_queue_left,
-        frame_map_left, etctx, std::ref(shutdown_requested));
-    threads.push_back(std::move(_process_frame_thread_left));
-
-    std::thread _process_frame_thread_right(
-        process_frame_thread, codec_scene_right, frame_queue_right,
-        frame_map_right, etctx, std::ref(shutdown_requested));
-    threads.push_back(std::move(_process_frame_thread_right));
-
-    std::thread _receive_packet_thread_scene_left(
-        receive_packet_thread, codec_scene_left,
-        server_packet_stream_scene_left, std::ref(shutdown_requested));
-    threads.push_back(std::move(_receive_packet_thread_scene_left));
-
-    std::thread _receive_packet_thread_depth_left(
-        receive_packet_thread, codec_depth_left,
-        server_packet_stream_depth_left, std::ref(shutdown_requested));
-    threads.push_back(std::move(_receive_packet_thread_depth_left));
-
-    std::thread _receive_packet_thread_scene_right(
-        receive_packet_thread, codec_scene_right,
-        server_packet_stream_scene_right, std::ref(shutdown_requested));
-    threads.push_back(std::move(_receive_packet_thread_scene_right));
-
-    std::thread _receive_packet_thread_depth_right(
-        receive_packet_thread, codec_depth_right,
-        server_packet_stream_depth_right, std::ref(shutdown_requested));
-    threads.push_back(std::move(_receive_packet_thread_depth_right));
-
-    std::thread _send_frame_thread_left(send_frame_thread, codec_scene_left,
-                                        codec_depth_left, frame_map_left,
-                                        std::ref(shutdown_requested));
-    threads.push_back(std::move(_send_frame_thread_left));
-
-    std::thread _send_frame_thread_right(send_frame_thread, codec_scene_right,
-                                         codec_depth_right, frame_map_right,
+    if (capture_reader) {
+      std::thread _capture_replay_thread(
+          capture_replay_thread, capture_reader, primary_session,
+          get(replay_speed_flag), get(replay_loops_flag),
+          std::ref(shutdown_requested));
+      threads.push_back(std::move(_capture_replay_thread));
+    } else {
+      std::thread _socket_main_thread(
+          socket_main_thread, renderers, session_manager,
+          std::ref(shutdown_requested));
+      threads.push_back(std::move(_socket_main_thread));
+
+      // Replayed frames are encoded whether or not anybody watches.
+      std::thread _viewer_monitor_thread(viewer_monitor_thread, session_manager,
                                          std::ref(shutdown_requested));
-    threads.push_back(std::move(_send_frame_thread_right));
+      threads.push_back(std::move(_viewer_monitor_thread));
+    }
 
-    std::thread _encode_stats_thread(
-        encode_stats_thread, std::ref(frame_index_left),
-        std::ref(frame_index_right), std::ref(shutdown_requested));
+    std::thread _encode_stats_thread(encode_stats_thread, session_manager,
+                                     std::ref(shutdown_requested));
     threads.push_back(std::move(_encode_stats_thread));
 
+    std::thread _session_reaper_thread(
+        session_reaper_thread, session_manager, std::ref(shutdown_requested));
+    threads.push_back(std::move(_session_reaper_thread));
+
     for (auto &th : threads) {
       th.join();
     }
 
-    server_packet_stream_scene_left->stop();
-    server_packet_stream_depth_left->stop();
-    server_packet_stream_scene_right->stop();
-    server_packet_stream_depth_right->stop();
-    ccsvr->stop();
+    // The sessions send to the servers until their threads are joined.
+    session_manager->stop_all();
+    for (auto &server : legacy_servers) {
+      server->stop();
+    }
+    multiplex_server->stop();
+    if (metrics_server) {
+      metrics_server->stop();
+    }
+    io_pool->stop();
+    if (capture_writer) {
+      capture_writer->close();
+    }
+
+    if (!get(trace_file_flag).empty()) {
+      if (Tracer::write_chrome_json(get(trace_file_flag))) {
+        tlog::info() << "Wrote trace to " << get(trace_file_flag) << ".";
+      } else {
+        tlog::error() << "Failed to write trace to " << get(trace_file_flag)
+                      << ".";
+      }
+    }
 
     tlog::info() << "All threads are terminated. Shutting down.";
   } catch (const std::exception &e) {
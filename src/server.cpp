@@ -12,120 +12,57 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <list>
+#include <set>
+#include <string_view>
 #include <thread>
 
-#include "base/camera_manager.h"
+#include "base/capture.h"
 #include "base/exceptions/lock_timeout.h"
+#include "base/frame_trace.h"
+#include "base/lpf_socket.h"
+#include "base/metrics.h"
+#include "base/renderer_list.h"
 #include "base/scoped_timer.h"
-#include "base/video/frame_queue.h"
+#include "base/session_manager.h"
+#include "base/trace.h"
 
-int socket_send_blocking(int targetfd, uint8_t *buf, size_t size) {
-  ssize_t ret;
-  ssize_t sent = 0;
-
-  while (sent < size) {
-    ret = send(targetfd, buf + sent, size - sent, MSG_NOSIGNAL);
-    if (ret < 0) {
-      // Buffer is full. Try again.
-      if (errno == EAGAIN) {
-        continue;
-      }
-      // Misc error. Terminate the socket.
-      tlog::error() << "socket_send_blocking: "
-                    << std::string(std::strerror(errno));
-      return -errno;
-    }
-    sent += ret;
-  }
-
-  return 0;
-}
-
-// Send message with length prefix framing.
-int socket_send_blocking_lpf(int targetfd, uint8_t *buf, size_t size) {
-  int ret;
-  // hack: not very platform portable
-  // but then, the program isn't.
-  if ((ret = socket_send_blocking(targetfd, (uint8_t *)&size, sizeof(size))) <
-      0) {
-    return ret;
-  }
-
-  if ((ret = socket_send_blocking(targetfd, buf, size)) < 0) {
-    return ret;
-  }
-
-  return ret;
-}
-
-int socket_receive_blocking(int targetfd, uint8_t *buf, size_t size) {
-  ssize_t ret;
-  ssize_t recv = 0;
-
-  while (recv < size) {
-    ret = read(targetfd, buf + recv, size - recv);
-    if (ret < 0) {
-      // Buffer is full. Try again.
-      if (errno == EAGAIN) {
-        continue;
-      }
-      // Misc error. Terminate the socket.
-      tlog::error() << "socket_receive_blocking: "
-                    << std::string(std::strerror(errno));
-      return -errno;
-    }
-    if (ret == 0 && recv < size) {
-      // Client disconnected while sending data. Terminate the socket.
-      tlog::error()
-          << "socket_receive_blocking: Received EOF when transfer is not done.";
-      return -1;
-    }
-    recv += ret;
-  }
-
-  return 0;
-}
-
-// Receive message with length prefix framing.
-std::string socket_receive_blocking_lpf(int targetfd) {
-  int ret;
-  size_t size;
-  // hack: not very platform portable
-  // todo: silently fail, do not wail error.
-  if ((ret = socket_receive_blocking(targetfd, (uint8_t *)&size,
-                                     sizeof(size))) < 0) {
-    throw std::runtime_error{
-        "socket_receive_blocking_lpf: Error while "
-        "receiving data size from socket."};
-  }
-
-  auto buffer = std::make_unique<char[]>(size);
-
-  if ((ret = socket_receive_blocking(targetfd, (uint8_t *)buffer.get(), size)) <
-      0) {
-    throw std::runtime_error{
-        "socket_receive_blocking_lpf: Error while receiving data from socket."};
-  }
+static constexpr unsigned kLogStatsIntervalFrame = 100;
 
-  return std::string(buffer.get(), buffer.get() + size);
-}
+// Interval of checking for viewers while every session is suspended.
+static constexpr std::chrono::milliseconds kIdlePollInterval{20};
 
-static constexpr unsigned kLogStatsIntervalFrame = 100;
+// Interval of checking the RendererList for changes.
+static constexpr std::chrono::milliseconds kRendererListPollInterval{200};
 
-void socket_client_thread(
-    int targetfd, std::shared_ptr<FrameQueue> frame_queue_left,
-    std::shared_ptr<FrameQueue> frame_queue_right,
-    std::atomic<std::uint64_t> &frame_index_left,
-    std::atomic<std::uint64_t> &frame_index_right, std::atomic<int> &is_left,
-    std::shared_ptr<CameraManager> cameramgr,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
-    std::atomic<bool> &shutdown_requested) {
+void socket_client_thread(int targetfd, std::string renderer,
+                          std::shared_ptr<SessionManager> session_manager,
+                          std::atomic<bool> &shutdown_requested) {
   // set_thread_name(std::string("socket_client=") + std::to_string(targetfd));
+  Tracer::name_thread("socket_client:" + renderer);
   int ret = 0;
   tlog::info() << "socket_client_thread (fd=" << targetfd << "): Spawned.";
 
+  auto &registry = MetricsRegistry::global();
+  // Buckets from 65 usec to 17 sec.
+  auto rtt = registry.histogram(
+      "nes_renderer_rtt_seconds",
+      "Time from sending a request to receiving its frame.", 1e-9, 16, 34,
+      {{"renderer", renderer}});
+  auto frames = registry.counter("nes_renderer_frames_total",
+                                 "Frames received from a renderer.",
+                                 {{"renderer", renderer}});
+  auto errors = registry.counter(
+      "nes_renderer_errors_total",
+      "Failed requests to a renderer, including malformed frames.",
+      {{"renderer", renderer}});
+  auto dropped = registry.counter("nes_frames_dropped_total",
+                                  "Frames dropped by the pipeline.",
+                                  {{"reason", "frame_queue_full"}});
+
   uint64_t count = 0;
   uint64_t elapsed = 0;
 
@@ -137,26 +74,17 @@ void socket_client_thread(
       break;
     }
 
-    nesproto::FrameRequest req;
-    //  is_left xor true op has same effect as not op
-    //    t xor t = f (not t)
-    //    f xor t = t (not f)
-    bool is_left_val = is_left.fetch_xor(true);
-    req.set_is_left(is_left_val);
-
-    uint64_t frame_index;
-    if (is_left_val) {
-      frame_index = frame_index_left.fetch_add(1);
-    } else {
-      frame_index = frame_index_right.fetch_add(1);
-    }
-    req.set_index(frame_index);
-    // set_allocated_* destroys the object. Use mutable_*()->CopyFrom().
-    if (is_left_val) {
-      req.mutable_camera()->CopyFrom(cameramgr->get_camera_left());
-    } else {
-      req.mutable_camera()->CopyFrom(cameramgr->get_camera_right());
+    // Take turns between the sessions. The rendered frame is returned on the
+    // same socket, so it is routed back to the session that requested it.
+    std::shared_ptr<Session> session = session_manager->next();
+    if (!session) {
+      // Nobody is watching; keep the renderer idle.
+      std::this_thread::sleep_for(kIdlePollInterval);
+      continue;
     }
+    session->pace_request();
+    FrameTrace trace;
+    nesproto::FrameRequest req = session->next_request(&trace);
 
     std::string req_serialized = req.SerializeAsString();
 
@@ -164,46 +92,56 @@ void socket_client_thread(
     if ((ret = socket_send_blocking_lpf(targetfd,
                                         (uint8_t *)req_serialized.data(),
                                         req_serialized.size())) < 0) {
+      errors->inc();
       continue;
     }
+    trace.request_sent = FrameTrace::now();
 
     nesproto::RenderedFrame frame;
+    std::string payload;
     {
       ScopedTimer timer;
 
       try {
-        if (!frame.ParseFromString(socket_receive_blocking_lpf(targetfd))) {
+        payload = socket_receive_blocking_lpf(targetfd);
+        if (!frame.ParseFromString(payload)) {
+          errors->inc();
           continue;
         }
       } catch (const std::runtime_error &) {
+        errors->inc();
         continue;
       }
+      trace.render_received = FrameTrace::now();
+      trace.frame_time = trace.render_received;
+      rtt->record(trace.render_received - trace.request_sent);
+      session->record_render_time(std::chrono::nanoseconds(
+          trace.render_received - trace.request_sent));
+      frames->inc();
       count++;
       elapsed += timer.elapsed().count();
       if (count == kLogStatsIntervalFrame) {
         tlog::debug() << "socket_client_thread (fd=" << targetfd
                       << "): Frame receiving average time of "
                       << kLogStatsIntervalFrame
-                      << " frames: " << elapsed / count << " msec.";
+                      << " frames: " << elapsed / count << " usec.";
         count = 0;
         elapsed = 0;
       }
     }
 
-    std::unique_ptr<RenderedFrame> frame_o = std::make_unique<RenderedFrame>(
-        frame, AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8, ctxmgr_scene, ctxmgr_depth);
+    if (auto capture = session->capture()) {
+      capture->write_frame(payload, frame.is_left(), trace.render_received);
+    }
 
     try {
-      // Push the frame to the frame queue.
-      if (frame_o->is_left()) {
-        frame_queue_left->push(std::move(frame_o));
-      } else {
-        frame_queue_right->push(std::move(frame_o));
-      }
+      // Push the frame to the frame queue of the session.
+      session->push_frame(frame, trace);
     } catch (const LockTimeout &) {
       // It takes too much time to acquire a lock of frame_queue. Drop the
       // frame. BUG: If we drop the frame, the program will hang and look for
       // the frame.
+      dropped->inc();
       continue;
     }
   }
@@ -213,17 +151,14 @@ void socket_client_thread(
                << "): Exiting thread.";
 }
 
-void socket_manage_thread(
-    std::string renderer, std::shared_ptr<FrameQueue> frame_queue_left,
-    std::shared_ptr<FrameQueue> frame_queue_right,
-    std::atomic<std::uint64_t> &frame_index_left,
-    std::atomic<std::uint64_t> &frame_index_right, std::atomic<int> &is_left,
-    std::shared_ptr<CameraManager> cameramgr,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
-    std::atomic<bool> &shutdown_requested) {
+void socket_manage_thread(std::string renderer,
+                          std::shared_ptr<SessionManager> session_manager,
+                          std::atomic<bool> &shutdown_requested) {
   // set_thread_name(std::string("socket_manage=") + renderer);
+  Tracer::name_thread("socket_manage:" + renderer);
   int error_times = 0;
+  auto connected = MetricsRegistry::global().gauge(
+      "nes_renderers_connected", "Renderers with an open connection.");
   while (!shutdown_requested) {
     std::stringstream renderer_parsed(renderer);
 
@@ -267,13 +202,13 @@ void socket_manage_thread(
     tlog::success() << "socket_client_thread_factory(" << renderer
                     << "): Connected to " << renderer;
 
-    std::thread _socket_client_thread(
-        socket_client_thread, fd, frame_queue_left, frame_queue_right,
-        std::ref(frame_index_left), std::ref(frame_index_right),
-        std::ref(is_left), cameramgr, ctxmgr_scene, ctxmgr_depth,
-        std::ref(shutdown_requested));
+    connected->add(1);
+    std::thread _socket_client_thread(socket_client_thread, fd, renderer,
+                                      session_manager,
+                                      std::ref(shutdown_requested));
 
     _socket_client_thread.join();
+    connected->add(-1);
 
     error_times = 0;
 
@@ -282,36 +217,150 @@ void socket_manage_thread(
   }
 }
 
-void socket_main_thread(
-    std::vector<std::string> renderers,
-    std::shared_ptr<FrameQueue> frame_queue_left,
-    std::shared_ptr<FrameQueue> frame_queue_right,
-    std::atomic<std::uint64_t> &frame_index_left,
-    std::atomic<std::uint64_t> &frame_index_right, std::atomic<int> &is_left,
-    std::shared_ptr<CameraManager> cameramgr,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_scene,
-    std::shared_ptr<types::AVCodecContextManager> ctxmgr_depth,
-    std::atomic<bool> &shutdown_requested) {
+void socket_main_thread(std::shared_ptr<RendererList> renderers,
+                        std::shared_ptr<SessionManager> session_manager,
+                        std::atomic<bool> &shutdown_requested) {
   // set_thread_name("socket_main");
-  std::vector<std::thread> threads;
+  Tracer::name_thread("socket_main");
+
+  // The connection threads of a renderer stop when their flag or
+  // shutdown_requested is set. std::list keeps the flags in place.
+  struct Connection {
+    std::string renderer;
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> finished{false};
+    std::thread thread;
+  };
+  std::list<Connection> connections;
+  // Removed connections, joined once finished. A thread exits only after its
+  // pending request is answered, which must not hold up the other changes.
+  std::list<Connection> retiring;
 
   tlog::info() << "socket_main_thread: Connecting to renderers.";
 
-  for (const auto renderer : renderers) {
-    threads.push_back(
-        std::thread(socket_manage_thread, renderer, frame_queue_left,
-                    frame_queue_right, std::ref(frame_index_left),
-                    std::ref(frame_index_right), std::ref(is_left), cameramgr,
-                    ctxmgr_scene, ctxmgr_depth, std::ref(shutdown_requested)));
+  while (!shutdown_requested) {
+    // Match the running connections with the list, renderer by renderer.
+    std::multiset<std::string> wanted;
+    for (const auto &renderer : renderers->get()) {
+      wanted.insert(renderer);
+    }
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (auto match = wanted.find(it->renderer); match != wanted.end()) {
+        wanted.erase(match);
+        ++it;
+        continue;
+      }
+      tlog::info() << "socket_main_thread: Disconnecting from "
+                   << it->renderer << ".";
+      it->stop_requested = true;
+      auto next = std::next(it);
+      retiring.splice(retiring.end(), connections, it);
+      it = next;
+    }
+    for (auto it = retiring.begin(); it != retiring.end();) {
+      if (!it->finished) {
+        ++it;
+        continue;
+      }
+      it->thread.join();
+      it = retiring.erase(it);
+    }
+    for (const auto &renderer : wanted) {
+      auto &connection = connections.emplace_back();
+      connection.renderer = renderer;
+      connection.thread = std::thread([&connection, session_manager] {
+        socket_manage_thread(connection.renderer, session_manager,
+                             connection.stop_requested);
+        connection.finished = true;
+      });
+    }
+    std::this_thread::sleep_for(kRendererListPollInterval);
   }
 
-  tlog::info() << "socket_main_thread: Connectd to all renderers.";
-
-  for (auto &thread : threads) {
-    if (thread.joinable()) {
-      thread.join();
+  connections.splice(connections.end(), retiring);
+  for (auto &connection : connections) {
+    connection.stop_requested = true;
+  }
+  for (auto &connection : connections) {
+    if (connection.thread.joinable()) {
+      connection.thread.join();
     }
   }
 
   tlog::info() << "socket_main_thread: Closed all connections. Exiting thread.";
 }
+
+void capture_replay_thread(std::shared_ptr<CaptureReader> capture,
+                           std::shared_ptr<Session> session, double speed,
+                           unsigned loops,
+                           std::atomic<bool> &shutdown_requested) {
+  Tracer::name_thread("capture_replay");
+  tlog::info() << "capture_replay_thread: Replaying " << capture->size()
+               << " records " << loops << " time(s) at "
+               << (speed > 0 ? std::to_string(speed) + "x speed."
+                             : std::string("maximum speed."));
+
+  // The encoders expect the indices of an eye to continue, so every loop
+  // shifts them past the last index of the previous loop.
+  std::uint64_t index_offset[2] = {0, 0};
+  std::uint64_t next_offset[2] = {0, 0};
+  nesproto::RenderedFrame frame;
+  nesproto::Camera camera;
+
+  // Frames keep their recorded timing whatever the speed; each loop follows
+  // the previous one.
+  std::int64_t last_frame_time = 0;
+  for (unsigned loop = 0; loop < loops && !shutdown_requested; loop++) {
+    const auto start = std::chrono::steady_clock::now();
+    const std::int64_t first_timestamp =
+        capture->size() ? capture->record(0).timestamp_ns : 0;
+    const std::int64_t origin = std::max(FrameTrace::now(), last_frame_time);
+
+    for (std::size_t i = 0; i < capture->size() && !shutdown_requested; i++) {
+      const CaptureRecord &record = capture->record(i);
+      if (speed > 0) {
+        std::this_thread::sleep_until(
+            start + std::chrono::nanoseconds((std::int64_t)(
+                        (record.timestamp_ns - first_timestamp) / speed)));
+      }
+      std::string_view payload = capture->payload(i);
+
+      if (record.type == CaptureRecord::TYPE_CAMERA) {
+        if (camera.ParseFromArray(payload.data(), payload.size())) {
+          session->camera_manager()->set_camera(camera);
+        }
+        continue;
+      }
+      if (record.type != CaptureRecord::TYPE_FRAME ||
+          !frame.ParseFromArray(payload.data(), payload.size())) {
+        continue;
+      }
+
+      const int eye = frame.is_left() ? 0 : 1;
+      next_offset[eye] =
+          std::max(next_offset[eye], index_offset[eye] + frame.index() + 1);
+      frame.set_index(index_offset[eye] + frame.index());
+
+      FrameTrace trace;
+      trace.frame_index = frame.index();
+      trace.render_received = FrameTrace::now();
+      trace.frame_time = origin + (record.timestamp_ns - first_timestamp);
+      last_frame_time = trace.frame_time;
+      // Unlike a renderer thread, wait for the queue instead of dropping the
+      // frame, so that every replay encodes the same frames.
+      while (!shutdown_requested) {
+        try {
+          session->push_frame(frame, trace);
+          break;
+        } catch (const LockTimeout &) {
+          continue;
+        }
+      }
+    }
+
+    index_offset[0] = next_offset[0];
+    index_offset[1] = next_offset[1];
+  }
+
+  tlog::info() << "capture_replay_thread: Finished replaying. Exiting thread.";
+}
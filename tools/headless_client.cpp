@@ -0,0 +1,365 @@
+/**
+ *  Copyright (c) Moonsik Park. All rights reserved.
+ *
+ *  @file   headless_client.cpp
+ *  @author Moonsik Park, Korea Institute of Science and Technology
+ **/
+
+// A client of the multiplexed server without a display. Each connection sends
+// camera updates along an orbit and counts the packets of every stream it
+// receives. With several connections it serves as a load generator.
+
+#include <args/args.hxx>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <websocketpp/client.hpp>
+#include <websocketpp/config/asio_client.hpp>
+
+#include "base/logging.h"
+#include "base/metrics.h"
+#include "nes.pb.h"
+
+using namespace args;
+
+typedef websocketpp::client<websocketpp::config::asio_client> client_notls;
+
+namespace {
+
+std::atomic<bool> shutdown_requested{false};
+
+void signal_handler(int signum) { shutdown_requested.store(true); }
+
+// Stream ids of MultiplexServer.
+constexpr std::uint8_t kStreamIdControl = 0;
+constexpr std::size_t kStreamCount = 4;
+constexpr const char *kStreamNames[kStreamCount] = {
+    "scene_left", "depth_left", "scene_right", "depth_right"};
+
+// Packets received by all connections.
+struct ClientStats {
+  std::array<std::atomic<std::uint64_t>, kStreamCount> packets{};
+  std::array<std::atomic<std::uint64_t>, kStreamCount> bytes{};
+  std::array<std::atomic<std::uint64_t>, kStreamCount> keyframes{};
+  std::atomic<std::uint64_t> malformed{0};
+  std::atomic<std::uint64_t> sessions_admitted{0};
+  std::atomic<std::uint64_t> sessions_rejected{0};
+  // Time from sending the pose of a frame to the arrival of its packet,
+  // measured with the client timestamp the server returns.
+  Histogram pose_to_receive{1e-9, 16, 34};
+};
+
+// One connection to the multiplexed server.
+class HeadlessConnection {
+ public:
+  HeadlessConnection(client_notls &client, ClientStats &stats,
+                     bool dedicated, std::uint32_t subscription)
+      : m_client(client),
+        m_stats(stats),
+        m_dedicated(dedicated),
+        m_subscription(subscription) {}
+
+  void connect(const std::string &uri) {
+    websocketpp::lib::error_code ec;
+    auto connection = m_client.get_connection(uri, ec);
+    if (ec) {
+      throw std::runtime_error{"Failed to connect to " + uri + ": " +
+                               ec.message()};
+    }
+    connection->set_open_handler(
+        [this](websocketpp::connection_hdl hdl) { on_open(hdl); });
+    connection->set_close_handler(
+        [this](websocketpp::connection_hdl) { m_open = false; });
+    connection->set_message_handler(
+        [this](websocketpp::connection_hdl, client_notls::message_ptr msg) {
+          on_message(msg->get_payload());
+        });
+    m_client.connect(connection);
+  }
+
+  // Report the rate received since the previous report, seconds ago. The
+  // client does not decode and cannot measure the round trip time, so only
+  // the rate is reported.
+  void send_feedback(double seconds) {
+    if (!m_open) {
+      return;
+    }
+    const std::uint64_t bytes = m_received_bytes.exchange(0);
+    nesproto::ControlMessage message;
+    message.mutable_feedback()->set_receive_bps(bytes * 8 / seconds);
+    send_control(message);
+  }
+
+  // Send a camera on the orbit at angle, in radians.
+  void send_camera(double angle, unsigned width, unsigned height) {
+    if (!m_open) {
+      return;
+    }
+    nesproto::ControlMessage message;
+    nesproto::Camera *camera = message.mutable_camera();
+    camera->set_width(width);
+    camera->set_height(height);
+    // Rotation around the y axis followed by the position on the orbit, as a
+    // row-major 3x4 matrix.
+    float c = std::cos(angle), s = std::sin(angle);
+    const float matrix[12] = {c, 0, s, 2 * s, 0, 1, 0, 0, -s, 0, c, 2 * c};
+    for (float value : matrix) {
+      camera->add_matrix(value);
+    }
+    camera->set_pose_id(++m_pose_id);
+    camera->set_client_timestamp(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+    // The server sets the eye of a camera from is_left.
+    camera->set_is_left(true);
+    send_control(message);
+    camera->set_is_left(false);
+    send_control(message);
+  }
+
+ private:
+  client_notls &m_client;
+  ClientStats &m_stats;
+  bool m_dedicated;
+  std::uint32_t m_subscription;
+  websocketpp::connection_hdl m_hdl;
+  std::atomic<bool> m_open{false};
+  std::atomic<std::uint64_t> m_received_bytes{0};
+  // Last pose id sent; cameras are sent by the main thread only.
+  std::uint64_t m_pose_id = 0;
+
+  void on_open(websocketpp::connection_hdl hdl) {
+    m_hdl = hdl;
+    m_open = true;
+    nesproto::ControlMessage subscription;
+    subscription.mutable_subscription()->set_streams(m_subscription);
+    send_control(subscription);
+    if (m_dedicated) {
+      nesproto::ControlMessage request;
+      request.mutable_session_request()->set_dedicated(true);
+      send_control(request);
+    }
+  }
+
+  void send_control(const nesproto::ControlMessage &message) {
+    std::string payload(1, (char)kStreamIdControl);
+    message.AppendToString(&payload);
+    websocketpp::lib::error_code ec;
+    m_client.send(m_hdl, payload, websocketpp::frame::opcode::binary, ec);
+  }
+
+  void on_message(const std::string &payload) {
+    if (payload.empty()) {
+      m_stats.malformed++;
+      return;
+    }
+    m_received_bytes += payload.size();
+    std::uint8_t stream_id = payload[0];
+    if (stream_id == kStreamIdControl) {
+      nesproto::ServerControlMessage message;
+      if (message.ParseFromArray(payload.data() + 1, payload.size() - 1) &&
+          message.has_session_status()) {
+        if (message.session_status().admitted()) {
+          m_stats.sessions_admitted++;
+        } else {
+          m_stats.sessions_rejected++;
+        }
+      }
+      return;
+    }
+
+    // [stream id][u16 metadata size][PacketMetadata][packet]
+    std::size_t stream = stream_id - 1;
+    if (stream >= kStreamCount || payload.size() < 3) {
+      m_stats.malformed++;
+      return;
+    }
+    std::size_t metadata_size =
+        (std::uint8_t)payload[1] | ((std::uint8_t)payload[2] << 8);
+    if (payload.size() <= 3 + metadata_size) {
+      m_stats.malformed++;
+      return;
+    }
+    nesproto::PacketMetadata metadata;
+    if (metadata.ParseFromArray(payload.data() + 3, metadata_size) &&
+        metadata.client_timestamp() != 0) {
+      std::int64_t now =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now().time_since_epoch())
+              .count();
+      if (now > metadata.client_timestamp()) {
+        m_stats.pose_to_receive.record(now - metadata.client_timestamp());
+      }
+    }
+    m_stats.packets[stream]++;
+    m_stats.bytes[stream] += payload.size() - 3 - metadata_size;
+    if (metadata.keyframe()) {
+      m_stats.keyframes[stream]++;
+    }
+  }
+};
+
+// Log the rate of every stream since the counts in last, and update last.
+void print_rates(const ClientStats &stats, double seconds,
+                 std::array<std::uint64_t, kStreamCount * 2> &last) {
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(1) << "Last " << seconds << " sec:";
+  for (std::size_t i = 0; i < kStreamCount; i++) {
+    std::uint64_t packets = stats.packets[i];
+    std::uint64_t bytes = stats.bytes[i];
+    line << " " << kStreamNames[i] << "=" << (packets - last[i * 2]) / seconds
+         << " fps " << (bytes - last[i * 2 + 1]) * 8 / seconds / 1000
+         << " kbps;";
+    last[i * 2] = packets;
+    last[i * 2 + 1] = bytes;
+  }
+  tlog::info() << line.str();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  std::signal(SIGINT, signal_handler);
+
+  ArgumentParser parser{"ngp encode server headless client"};
+  HelpFlag help_flag{parser, "HELP", "Display help.", {'h', "help"}};
+  ValueFlag<std::string> uri_flag{parser,
+                                  "URI",
+                                  "URI of the multiplexed server.",
+                                  {"uri"},
+                                  "ws://127.0.0.1:9997"};
+  ValueFlag<unsigned int> connections_flag{
+      parser, "CONNECTIONS", "Number of connections.", {"connections"}, 1};
+  Flag dedicated_flag{parser,
+                      "DEDICATED",
+                      "Request a dedicated session for every connection.",
+                      {"dedicated"}};
+  ValueFlag<std::uint32_t> subscription_flag{
+      parser,
+      "SUBSCRIPTION",
+      "Bit mask of the streams to receive; bit n is the stream with id n.",
+      {"subscription"},
+      0x1e};
+  ValueFlag<double> camera_rate_flag{
+      parser, "CAMERA_RATE", "Camera updates per second.", {"camera_rate"},
+      60};
+  ValueFlag<double> orbit_period_flag{
+      parser,
+      "ORBIT_PERIOD",
+      "Seconds the camera takes to go around the orbit.",
+      {"orbit_period"},
+      10};
+  ValueFlag<unsigned int> width_flag{
+      parser, "WIDTH", "Width of the requested view.", {"width"}, 1280};
+  ValueFlag<unsigned int> height_flag{
+      parser, "HEIGHT", "Height of the requested view.", {"height"}, 720};
+  Flag feedback_flag{parser,
+                     "FEEDBACK",
+                     "Report the received rate every second, so the server "
+                     "adapts the bitrate to the connection.",
+                     {"feedback"}};
+  ValueFlag<double> duration_flag{
+      parser,
+      "DURATION",
+      "Seconds to run. 0 runs until interrupted.",
+      {"duration"},
+      0};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const Help &) {
+    std::cout << parser;
+    return 0;
+  } catch (const ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -1;
+  } catch (const ValidationError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -2;
+  }
+
+  ClientStats stats;
+  client_notls client;
+  client.clear_access_channels(websocketpp::log::alevel::all);
+  client.clear_error_channels(websocketpp::log::elevel::all);
+  client.init_asio();
+
+  std::vector<std::unique_ptr<HeadlessConnection>> connections;
+  try {
+    for (unsigned i = 0; i < get(connections_flag); i++) {
+      connections.push_back(std::make_unique<HeadlessConnection>(
+          client, stats, static_cast<bool>(dedicated_flag),
+          get(subscription_flag)));
+      connections.back()->connect(get(uri_flag));
+    }
+  } catch (const std::exception &e) {
+    tlog::error() << e.what();
+    return -1;
+  }
+  std::thread io_thread([&] { client.run(); });
+
+  using clock = std::chrono::steady_clock;
+  const auto start = clock::now();
+  auto last_report = start;
+  std::array<std::uint64_t, kStreamCount * 2> last_counts{};
+  const auto camera_interval =
+      std::chrono::duration<double>(1 / get(camera_rate_flag));
+  while (!shutdown_requested) {
+    auto now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - start).count();
+    if (get(duration_flag) > 0 && elapsed >= get(duration_flag)) {
+      break;
+    }
+    double angle = 2 * M_PI * elapsed / get(orbit_period_flag);
+    for (auto &connection : connections) {
+      connection->send_camera(angle, get(width_flag), get(height_flag));
+    }
+    if (now - last_report >= std::chrono::seconds(1)) {
+      const double seconds =
+          std::chrono::duration<double>(now - last_report).count();
+      print_rates(stats, seconds, last_counts);
+      if (feedback_flag) {
+        for (auto &connection : connections) {
+          connection->send_feedback(seconds);
+        }
+      }
+      last_report = now;
+    }
+    std::this_thread::sleep_for(camera_interval);
+  }
+
+  client.stop();
+  io_thread.join();
+  double elapsed =
+      std::chrono::duration<double>(clock::now() - start).count();
+
+  tlog::info() << "Sessions admitted=" << stats.sessions_admitted
+               << " rejected=" << stats.sessions_rejected
+               << "; malformed messages=" << stats.malformed;
+  for (std::size_t i = 0; i < kStreamCount; i++) {
+    tlog::info() << kStreamNames[i] << ": packets=" << stats.packets[i]
+                 << " (" << stats.packets[i] / elapsed << " fps) bytes="
+                 << stats.bytes[i] << " ("
+                 << stats.bytes[i] * 8 / elapsed / 1000
+                 << " kbps) keyframes=" << stats.keyframes[i];
+  }
+  tlog::info() << "Pose to receive latency: p50="
+               << stats.pose_to_receive.quantile(0.5) / 1e6
+               << " p99=" << stats.pose_to_receive.quantile(0.99) / 1e6
+               << " msec (n=" << stats.pose_to_receive.count() << ")";
+  return 0;
+}
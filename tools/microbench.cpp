@@ -0,0 +1,505 @@
+/**
+ *  Copyright (c) Moonsik Park. All rights reserved.
+ *
+ *  @file   microbench.cpp
+ *  @author Moonsik Park, Korea Institute of Science and Technology
+ **/
+
+// Microbenchmarks of the kernels every frame goes through, one at a time.
+// Each benchmark is calibrated to run for at least --min_time seconds and then
+// repeated; the median, minimum and maximum time per operation are written as
+// one JSON object per line. Inputs are generated deterministically so that
+// results of different commits can be compared; pass --label to tag them.
+
+#include <args/args.hxx>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/logging.h"
+#include "base/video/frame_map.h"
+#include "base/video/frame_queue.h"
+#include "base/video/render_text.h"
+#include "base/video/type_managers.h"
+#include "nes.pb.h"
+
+using namespace args;
+
+namespace {
+
+// A kernel runs the benchmarked operation iterations times.
+using Kernel = std::function<void(std::uint64_t iterations)>;
+
+class BenchRunner {
+ public:
+  BenchRunner(std::ostream &out, std::string label, std::string filter,
+              double min_seconds, unsigned repetitions,
+              std::uint64_t iterations)
+      : m_out(out),
+        m_label(label),
+        m_filter(filter),
+        m_min_seconds(min_seconds),
+        m_repetitions(std::max(repetitions, 1u)),
+        m_iterations(iterations) {}
+
+  // Whether the benchmark name passes --filter. Benchmarks with an expensive
+  // setup check this before setting up.
+  inline bool selected(const std::string &name) const {
+    return name.find(m_filter) != std::string::npos;
+  }
+
+  // Run a benchmark and write its result. bytes_per_op is the size of the
+  // input of one operation, or 0 if it has none.
+  void run(const std::string &name, std::uint64_t bytes_per_op,
+           const Kernel &kernel) {
+    if (!selected(name)) {
+      return;
+    }
+    tlog::info() << "microbench: Running " << name << ".";
+
+    // Grow the iteration count until a run takes min_seconds. The runs also
+    // warm up the caches and the kernel.
+    std::uint64_t iterations = m_iterations ? m_iterations : 1;
+    while (!m_iterations) {
+      double seconds = time(kernel, iterations);
+      if (seconds >= m_min_seconds || iterations >= kMaxIterations) {
+        break;
+      }
+      double estimate = seconds > 0
+                            ? m_min_seconds / seconds * iterations * 1.2
+                            : iterations * 10.0;
+      iterations = std::min<std::uint64_t>(
+          kMaxIterations,
+          std::max<std::uint64_t>(iterations * 2, estimate));
+    }
+
+    std::vector<double> ns_per_op;
+    for (unsigned i = 0; i < m_repetitions; i++) {
+      ns_per_op.push_back(time(kernel, iterations) * 1e9 / iterations);
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    double median = ns_per_op[ns_per_op.size() / 2];
+
+    m_out << "{\"label\":\"" << m_label << "\",\"benchmark\":\"" << name
+          << "\",\"iterations\":" << iterations
+          << ",\"repetitions\":" << m_repetitions
+          << ",\"ns_per_op\":{\"median\":" << median
+          << ",\"min\":" << ns_per_op.front()
+          << ",\"max\":" << ns_per_op.back() << "}";
+    if (bytes_per_op) {
+      m_out << ",\"bytes_per_op\":" << bytes_per_op
+            << ",\"mb_per_sec\":" << bytes_per_op / median * 1e3;
+    }
+    m_out << "}" << std::endl;
+  }
+
+ private:
+  static constexpr std::uint64_t kMaxIterations = 1 << 30;
+
+  std::ostream &m_out;
+  std::string m_label;
+  std::string m_filter;
+  double m_min_seconds;
+  unsigned m_repetitions;
+  std::uint64_t m_iterations;
+
+  static double time(const Kernel &kernel, std::uint64_t iterations) {
+    auto begin = std::chrono::steady_clock::now();
+    kernel(iterations);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         begin)
+        .count();
+  }
+};
+
+std::string resolution_name(unsigned width, unsigned height) {
+  return std::to_string(width) + "x" + std::to_string(height);
+}
+
+// Fill a packed image with a pattern that changes with seed, so that the
+// encoder sees motion between consecutive frames.
+void fill_pattern(std::uint8_t *data, int linesize, unsigned width,
+                  unsigned height, unsigned channels, unsigned seed) {
+  for (unsigned y = 0; y < height; y++) {
+    for (unsigned x = 0; x < width * channels; x++) {
+      data[y * linesize + x] = (std::uint8_t)(x / channels + y * 3 + seed * 4 +
+                                              (x % channels) * 85);
+    }
+  }
+}
+
+// A frame as a renderer sends it, with an RGB scene and a grayscale depth.
+nesproto::RenderedFrame make_rendered_frame(unsigned width, unsigned height) {
+  nesproto::RenderedFrame frame;
+  frame.set_index(1);
+  frame.set_is_left(true);
+  frame.mutable_camera()->set_width(width);
+  frame.mutable_camera()->set_height(height);
+  frame.mutable_camera()->set_is_left(true);
+  for (int i = 0; i < 12; i++) {
+    frame.mutable_camera()->add_matrix(i % 5 == 0 ? 1.f : 0.f);
+  }
+  std::string scene(width * height * 3, '\0');
+  fill_pattern((std::uint8_t *)scene.data(), width * 3, width, height, 3, 0);
+  std::string depth(width * height, '\0');
+  fill_pattern((std::uint8_t *)depth.data(), width, width, height, 1, 0);
+  frame.set_frame(std::move(scene));
+  frame.set_depth(std::move(depth));
+  return frame;
+}
+
+void bench_convert_frame(BenchRunner &runner, unsigned width,
+                         unsigned height) {
+  // The source frames point into the protobuf message as in RenderedFrame.
+  nesproto::RenderedFrame frame = make_rendered_frame(width, height);
+  types::FrameManager source_scene(
+      types::FrameManager::FrameContext(width, height, AV_PIX_FMT_RGB24),
+      (std::uint8_t *)frame.frame().data());
+  types::FrameManager source_depth(
+      types::FrameManager::FrameContext(width, height, AV_PIX_FMT_GRAY8),
+      (std::uint8_t *)frame.depth().data());
+  types::FrameManager converted_scene(
+      types::FrameManager::FrameContext(width, height, AV_PIX_FMT_YUV420P));
+  types::FrameManager converted_depth(
+      types::FrameManager::FrameContext(width, height, AV_PIX_FMT_YUV420P));
+
+  // RenderedFrame::convert_frame() runs one SwsContextManager per frame.
+  runner.run("convert_frame/scene/" + resolution_name(width, height),
+             frame.frame().size(), [&](std::uint64_t iterations) {
+               for (std::uint64_t i = 0; i < iterations; i++) {
+                 types::SwsContextManager sws(source_scene, converted_scene);
+               }
+             });
+  runner.run("convert_frame/depth/" + resolution_name(width, height),
+             frame.depth().size(), [&](std::uint64_t iterations) {
+               for (std::uint64_t i = 0; i < iterations; i++) {
+                 types::SwsContextManager sws(source_depth, converted_depth);
+               }
+             });
+}
+
+void bench_render_text(BenchRunner &runner, const std::string &font,
+                       unsigned width, unsigned height) {
+  const std::string matrix_name =
+      "render_string_to_frame/matrix/" + resolution_name(width, height);
+  const std::string short_name =
+      "render_string_to_frame/short/" + resolution_name(width, height);
+  if (!runner.selected(matrix_name) && !runner.selected(short_name)) {
+    return;
+  }
+
+  // The overlay is drawn into the luma plane of the converted scene.
+  RenderTextContext etctx(font);
+  types::FrameManager frame(
+      types::FrameManager::FrameContext(width, height, AV_PIX_FMT_YUV420P));
+  fill_pattern(frame.data().data[0], frame.data().linesize[0], width, height,
+               1, 0);
+
+  // The camera matrix the overlay draws in the center.
+  const std::string matrix =
+      "+1.00000 +0.00000 +0.00000 +0.00000 \n"
+      "+0.00000 +1.00000 +0.00000 +0.00000 \n"
+      "+0.00000 +0.00000 +1.00000 +0.00000 \n"
+      "+0.00000 +0.00000 +0.00000 +1.00000 ";
+  runner.run(matrix_name, 0, [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      etctx.render_string_to_frame(
+          frame, RenderTextContext::RenderPosition::RENDER_POSITION_CENTER,
+          matrix);
+    }
+  });
+  runner.run(short_name, 0, [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      etctx.render_string_to_frame(
+          frame, RenderTextContext::RenderPosition::RENDER_POSITION_LEFT_BOTTOM,
+          "index=123456");
+    }
+  });
+}
+
+// Split count into n shares that differ by at most one.
+std::uint64_t share(std::uint64_t count, unsigned n, unsigned i) {
+  return count / n + (i < count % n ? 1 : 0);
+}
+
+void bench_frame_queue(BenchRunner &runner, unsigned threads,
+                       std::size_t queue_size) {
+  // An operation is one frame going through the queue.
+  runner.run(
+      "frame_queue/push_pop/" + std::to_string(threads) + "p" +
+          std::to_string(threads) + "c",
+      0, [&](std::uint64_t iterations) {
+        FrameQueue queue(nullptr, queue_size);
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; i++) {
+          workers.emplace_back([&queue, count = share(iterations, threads, i)] {
+            for (std::uint64_t j = 0; j < count; j++) {
+              queue.push(FrameQueue::element{});
+            }
+          });
+          workers.emplace_back([&queue, count = share(iterations, threads, i)] {
+            for (std::uint64_t j = 0; j < count; j++) {
+              queue.pop();
+            }
+          });
+        }
+        for (auto &worker : workers) {
+          worker.join();
+        }
+      });
+}
+
+void bench_frame_map(BenchRunner &runner, unsigned window,
+                     std::size_t map_size) {
+  // Frames are inserted in a fixed random order within blocks of window
+  // frames, as they arrive from renderers of different speeds, and taken in
+  // index order as send_frame_thread() does.
+  std::vector<FrameMap::keytype> order(window);
+  for (unsigned i = 0; i < window; i++) {
+    order[i] = i;
+  }
+  std::mt19937 engine(1);
+  std::shuffle(order.begin(), order.end(), engine);
+
+  runner.run(
+      "frame_map/insert_get_delete/window" + std::to_string(window), 0,
+      [&](std::uint64_t iterations) {
+        // Round up to whole blocks so that every inserted index is taken.
+        iterations = (iterations + window - 1) / window * window;
+        FrameMap map(nullptr, map_size);
+        std::thread inserter([&] {
+          for (std::uint64_t block = 0; block < iterations; block += window) {
+            for (auto offset : order) {
+              map.insert(block + offset, FrameMap::element{});
+            }
+          }
+        });
+        for (std::uint64_t i = 0; i < iterations; i++) {
+          map.get_delete(i);
+        }
+        inserter.join();
+      });
+}
+
+void bench_protobuf_parse(BenchRunner &runner, unsigned width,
+                          unsigned height) {
+  const std::string serialized =
+      make_rendered_frame(width, height).SerializeAsString();
+  // socket_client_thread() parses every frame into a new message.
+  runner.run("protobuf/parse_rendered_frame/" + resolution_name(width, height),
+             serialized.size(), [&](std::uint64_t iterations) {
+               for (std::uint64_t i = 0; i < iterations; i++) {
+                 nesproto::RenderedFrame frame;
+                 if (!frame.ParseFromString(serialized)) {
+                   throw std::runtime_error{"Failed to parse RenderedFrame."};
+                 }
+               }
+             });
+}
+
+void bench_send_frame(BenchRunner &runner, const std::string &encoder,
+                      const std::string &preset, const std::string &tune,
+                      unsigned width, unsigned height, unsigned bitrate,
+                      unsigned fps, unsigned keyint) {
+  const std::string name = "send_frame/" + encoder + "/" + preset + "/" +
+                           resolution_name(width, height);
+  if (!runner.selected(name)) {
+    return;
+  }
+
+  types::AVCodecContextManager ctxmgr(
+      types::AVCodecContextManager::CodecInitInfo(
+          encoder, AV_PIX_FMT_YUV420P, preset, tune, width, height, bitrate,
+          fps, keyint));
+
+  // A few distinct frames are sent in turn so that the encoder sees motion.
+  constexpr unsigned kFrameCount = 8;
+  std::vector<AVFrame *> frames;
+  for (unsigned i = 0; i < kFrameCount; i++) {
+    AVFrame *frame = av_frame_alloc();
+    if (frame == nullptr) {
+      throw std::runtime_error{"Failed to allocate AVFrame."};
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (int ret = av_frame_get_buffer(
+            frame, types::FrameManager::kBufferSizeAlignValueBytes);
+        ret < 0) {
+      throw std::runtime_error{std::string("Failed to allocate frame data: ") +
+                               types::averror_explain(ret)};
+    }
+    fill_pattern(frame->data[0], frame->linesize[0], width, height, 1, i);
+    fill_pattern(frame->data[1], frame->linesize[1], width / 2, height / 2, 1,
+                 i);
+    fill_pattern(frame->data[2], frame->linesize[2], width / 2, height / 2, 1,
+                 i);
+    frames.push_back(frame);
+  }
+
+  // An operation sends a frame and receives the packets that are ready, as
+  // send_frame_thread() and receive_packet_thread() do together.
+  types::AVPacketManager pkt;
+  FrameTrace trace;
+  std::int64_t pts = 0;
+  runner.run(name, width * height * 3 / 2, [&](std::uint64_t iterations) {
+    for (std::uint64_t i = 0; i < iterations; i++) {
+      AVFrame *frame = frames[pts % kFrameCount];
+      // Frames at the nominal rate, whatever the speed of the encoder. A
+      // frame time of 0 would stand for now.
+      trace.frame_time = ++pts * 1000000000 / fps;
+      if (int ret = ctxmgr.send_frame(frame, trace); ret < 0) {
+        throw std::runtime_error{std::string("Failed to send frame: ") +
+                                 types::averror_explain(ret)};
+      }
+      while (ctxmgr.receive_packet(pkt(), &trace) == 0) {
+        av_packet_unref(pkt());
+      }
+    }
+  });
+
+  for (AVFrame *frame : frames) {
+    av_frame_free(&frame);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  ArgumentParser parser{
+      "ngp encode server microbenchmarks\n"
+      "Results are written as one JSON object per line."};
+  HelpFlag help_flag{parser, "HELP", "Display help.", {'h', "help"}};
+  ValueFlag<std::string> filter_flag{
+      parser,
+      "FILTER",
+      "Run only the benchmarks whose name contains FILTER.",
+      {"filter"},
+      ""};
+  ValueFlag<std::string> label_flag{
+      parser,
+      "LABEL",
+      "Label written with every result, e.g. the commit.",
+      {"label"},
+      ""};
+  ValueFlag<double> min_time_flag{
+      parser,
+      "MIN_TIME",
+      "Minimum seconds of one repetition.",
+      {"min_time"},
+      0.5};
+  ValueFlag<unsigned int> repetitions_flag{
+      parser, "REPETITIONS", "Repetitions of every benchmark.",
+      {"repetitions"}, 5};
+  ValueFlag<std::uint64_t> iterations_flag{
+      parser,
+      "ITERATIONS",
+      "Fixed iterations of every repetition. 0 calibrates with MIN_TIME.",
+      {"iterations"},
+      0};
+  ValueFlag<unsigned int> width_flag{
+      parser, "WIDTH", "Width of the frames.", {"width"}, 1280};
+  ValueFlag<unsigned int> height_flag{
+      parser, "HEIGHT", "Height of the frames.", {"height"}, 720};
+  ValueFlagList<std::string> encoder_flag{
+      parser, "ENCODER", "Encoders of send_frame. default: libx264",
+      {"encoder"}};
+  ValueFlagList<std::string> preset_flag{
+      parser,
+      "PRESET",
+      "Encode presets of send_frame. default: ultrafast, superfast, "
+      "veryfast, faster, fast, medium",
+      {"preset"}};
+  ValueFlag<std::string> tune_flag{
+      parser, "TUNE", "Encode tune.", {"tune"}, "stillimage,zerolatency"};
+  ValueFlag<unsigned int> bitrate_flag{
+      parser, "BITRATE", "Bitrate of the encoder.", {"bitrate"}, 400000};
+  ValueFlag<unsigned int> fps_flag{
+      parser, "FPS", "Frame rate given to the encoder.", {"fps"}, 30};
+  ValueFlag<unsigned int> keyint_flag{
+      parser, "KEYINT", "Group of picture (GOP) size", {"keyint"}, 250};
+  ValueFlag<std::string> font_flag{
+      parser,
+      "FONT",
+      "Location of a font file used to render texts.",
+      {"font"},
+      "/usr/share/fonts/truetype/noto/NotoMono-Regular.ttf"};
+  ValueFlag<std::string> output_flag{
+      parser,
+      "OUTPUT",
+      "File to append the results to. default: stdout",
+      {'o', "output"},
+      ""};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const Help &) {
+    std::cout << parser;
+    return 0;
+  } catch (const ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -1;
+  } catch (const ValidationError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -2;
+  }
+
+  try {
+    std::ofstream file;
+    if (!get(output_flag).empty()) {
+      file.open(get(output_flag), std::ios::app);
+      if (!file) {
+        throw std::runtime_error{"Failed to open " + get(output_flag)};
+      }
+    }
+    std::ostream &out = file.is_open() ? file : std::cout;
+
+    BenchRunner runner(out, get(label_flag), get(filter_flag),
+                       get(min_time_flag), get(repetitions_flag),
+                       get(iterations_flag));
+    const unsigned width = get(width_flag);
+    const unsigned height = get(height_flag);
+
+    bench_convert_frame(runner, width, height);
+    bench_render_text(runner, get(font_flag), width, height);
+    for (unsigned threads : {1, 2, 4}) {
+      bench_frame_queue(runner, threads, FrameQueue::kFrameQueueMaxSize);
+    }
+    for (unsigned window : {1, 16}) {
+      bench_frame_map(runner, window, FrameMap::kFrameMapMaxSize);
+    }
+    bench_protobuf_parse(runner, width, height);
+
+    std::vector<std::string> encoders = get(encoder_flag);
+    if (encoders.empty()) {
+      encoders = {"libx264"};
+    }
+    std::vector<std::string> presets = get(preset_flag);
+    if (presets.empty()) {
+      presets = {"ultrafast", "superfast", "veryfast",
+                 "faster",    "fast",      "medium"};
+    }
+    for (const auto &encoder : encoders) {
+      for (const auto &preset : presets) {
+        bench_send_frame(runner, encoder, preset, get(tune_flag), width,
+                         height, get(bitrate_flag), get(fps_flag),
+                         get(keyint_flag));
+      }
+    }
+  } catch (const std::exception &e) {
+    tlog::error() << "microbench: " << e.what();
+    return -1;
+  }
+  return 0;
+}
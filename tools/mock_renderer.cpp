@@ -0,0 +1,128 @@
+/**
+ *  Copyright (c) Moonsik Park. All rights reserved.
+ *
+ *  @file   mock_renderer.cpp
+ *  @author Moonsik Park, Korea Institute of Science and Technology
+ **/
+
+// Runs a MockRenderer on a port until interrupted, so that the server can be
+// exercised on a machine without a GPU.
+
+#include <args/args.hxx>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "base/logging.h"
+#include "base/testing/mock_renderer.h"
+#include "nes.pb.h"
+
+using namespace args;
+
+namespace {
+
+std::atomic<bool> shutdown_requested{false};
+
+void signal_handler(int signum) { shutdown_requested.store(true); }
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+  std::signal(SIGINT, signal_handler);
+
+  ArgumentParser parser{"ngp encode server mock renderer"};
+  HelpFlag help_flag{parser, "HELP", "Display help.", {'h', "help"}};
+  ValueFlag<uint16_t> port_flag{
+      parser, "PORT", "Port to listen on.", {'p', "port"}, 10100};
+  ValueFlag<unsigned int> width_flag{
+      parser,
+      "WIDTH",
+      "Width of the frames. 0 uses the width of the request.",
+      {"width"},
+      0};
+  ValueFlag<unsigned int> height_flag{
+      parser,
+      "HEIGHT",
+      "Height of the frames. 0 uses the height of the request.",
+      {"height"},
+      0};
+  ValueFlag<std::string> distribution_flag{
+      parser,
+      "DISTRIBUTION",
+      "Distribution of the render latency {constant, uniform, normal, "
+      "lognormal}.",
+      {"latency_distribution"},
+      "constant"};
+  ValueFlag<double> latency_flag{
+      parser, "LATENCY_MS", "Mean render latency.", {"latency_ms"}, 10};
+  ValueFlag<double> jitter_flag{
+      parser,
+      "JITTER_MS",
+      "Half width of the uniform distribution, or standard deviation of the "
+      "normal and lognormal distributions.",
+      {"jitter_ms"},
+      0};
+  ValueFlag<double> failure_rate_flag{
+      parser,
+      "FAILURE_RATE",
+      "Probability of answering a request with a malformed frame.",
+      {"failure_rate"},
+      0};
+  ValueFlag<double> disconnect_rate_flag{
+      parser,
+      "DISCONNECT_RATE",
+      "Probability of dropping the connection instead of answering a "
+      "request.",
+      {"disconnect_rate"},
+      0};
+  Flag noise_flag{parser,
+                  "NOISE",
+                  "Fill the frames with noise instead of a gradient.",
+                  {"noise"}};
+  ValueFlag<std::uint64_t> seed_flag{
+      parser, "SEED", "Seed of the random generators.", {"seed"}, 1};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const Help &) {
+    std::cout << parser;
+    return 0;
+  } catch (const ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -1;
+  } catch (const ValidationError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -2;
+  }
+
+  MockRenderer::Options options;
+  try {
+    options.width = get(width_flag);
+    options.height = get(height_flag);
+    options.distribution =
+        MockRenderer::parse_distribution(get(distribution_flag));
+    options.latency_ms = get(latency_flag);
+    options.jitter_ms = get(jitter_flag);
+    options.failure_rate = get(failure_rate_flag);
+    options.disconnect_rate = get(disconnect_rate_flag);
+    options.noise = static_cast<bool>(noise_flag);
+    options.seed = get(seed_flag);
+
+    MockRenderer renderer(options, get(port_flag), false);
+    while (!shutdown_requested) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  } catch (const std::exception &e) {
+    tlog::error() << e.what();
+    return -1;
+  }
+
+  tlog::info() << "Mock renderer exiting.";
+  return 0;
+}
@@ -0,0 +1,618 @@
+/**
+ *  Copyright (c) Moonsik Park. All rights reserved.
+ *
+ *  @file   pipeline_bench.cpp
+ *  @author Moonsik Park, Korea Institute of Science and Technology
+ **/
+
+// End-to-end benchmark of the encode pipeline. For every combination of the
+// swept parameters it wires a SessionManager the way main.cpp does, serves it
+// with in-process MockRenderers over loopback TCP, drains the packets into
+// counting sinks standing in for the clients, and writes one JSON object per
+// line with the frame rate, the per-stage latency, the CPU time per frame, the
+// peak RSS and the distribution of the packet sizes. Each configuration runs
+// in a child process of its own, so that its peak RSS is not that of the
+// configurations before it, and the CPU time of the mock renderers and of the
+// sinks is left out of that of the pipeline. Sweeping --refresh
+// compares the bitrate spikes and the latency of periodic key frames with
+// those of intra refresh, and sweeping --pacing compares the frames requested
+// from the renderers and the regularity of the packets with and without render
+// pacing.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <args/args.hxx>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/latency_stats.h"
+#include "base/logging.h"
+#include "base/server/packet_sink.h"
+#include "base/session_manager.h"
+#include "base/testing/mock_renderer.h"
+#include "base/video/frame_queue.h"
+#include "base/video/render_text.h"
+#include "base/video/stereo_packing.h"
+#include "base/video/type_managers.h"
+#include "server.h"
+
+using namespace args;
+
+namespace {
+
+// CPU time of the calling thread in seconds.
+double thread_cpu_seconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Stands in for the clients of a stream.
+class CountingSink : public PacketSink {
+ public:
+  // Distribution of the sizes of the packets and of the intervals between
+  // them since reset_sizes().
+  struct SizeStats {
+    std::uint64_t packets = 0;
+    std::uint64_t keyframes = 0;
+    double mean_bytes = 0;
+    double stddev_bytes = 0;
+    std::uint64_t max_bytes = 0;
+    double mean_interval_ms = 0;
+    double stddev_interval_ms = 0;
+  };
+
+  void consume_packet(AVPacket *pkt, const FrameTrace &trace) override {
+    const double cpu_begin = thread_cpu_seconds();
+    count(pkt);
+    std::scoped_lock lock{m_sizes_mutex};
+    m_cpu_seconds += thread_cpu_seconds() - cpu_begin;
+  }
+
+  inline std::uint64_t packets() const { return m_packets; }
+  inline std::uint64_t bytes() const { return m_bytes; }
+
+  // CPU time spent counting the packets.
+  double cpu_seconds() {
+    std::scoped_lock lock{m_sizes_mutex};
+    return m_cpu_seconds;
+  }
+
+  void reset_sizes() {
+    std::scoped_lock lock{m_sizes_mutex};
+    m_sizes = SizeStats{};
+    m_size_sum = 0;
+    m_size_square_sum = 0;
+    m_last_packet = 0;
+    m_intervals = 0;
+    m_interval_sum = 0;
+    m_interval_square_sum = 0;
+  }
+
+  SizeStats sizes() {
+    std::scoped_lock lock{m_sizes_mutex};
+    SizeStats sizes = m_sizes;
+    if (sizes.packets) {
+      sizes.mean_bytes = m_size_sum / sizes.packets;
+      sizes.stddev_bytes = std::sqrt(std::max(
+          0.0, m_size_square_sum / sizes.packets -
+                   sizes.mean_bytes * sizes.mean_bytes));
+    }
+    if (m_intervals) {
+      sizes.mean_interval_ms = m_interval_sum / m_intervals;
+      sizes.stddev_interval_ms = std::sqrt(std::max(
+          0.0, m_interval_square_sum / m_intervals -
+                   sizes.mean_interval_ms * sizes.mean_interval_ms));
+    }
+    return sizes;
+  }
+
+ private:
+  std::atomic<std::uint64_t> m_packets{0};
+  std::atomic<std::uint64_t> m_bytes{0};
+  std::mutex m_sizes_mutex;
+  SizeStats m_sizes;
+  double m_size_sum = 0;
+  double m_size_square_sum = 0;
+  std::int64_t m_last_packet = 0;
+  std::uint64_t m_intervals = 0;
+  double m_interval_sum = 0;
+  double m_interval_square_sum = 0;
+  double m_cpu_seconds = 0;
+
+  void count(AVPacket *pkt) {
+    m_packets.fetch_add(1, std::memory_order_relaxed);
+    m_bytes.fetch_add(pkt->size, std::memory_order_relaxed);
+    std::scoped_lock lock{m_sizes_mutex};
+    const double size = pkt->size;
+    m_sizes.packets++;
+    m_sizes.keyframes += (pkt->flags & AV_PKT_FLAG_KEY) ? 1 : 0;
+    m_size_sum += size;
+    m_size_square_sum += size * size;
+    m_sizes.max_bytes = std::max<std::uint64_t>(m_sizes.max_bytes, pkt->size);
+    const std::int64_t now = FrameTrace::now();
+    if (m_last_packet != 0) {
+      const double interval = (now - m_last_packet) / 1e6;
+      m_intervals++;
+      m_interval_sum += interval;
+      m_interval_square_sum += interval * interval;
+    }
+    m_last_packet = now;
+  }
+};
+
+struct BenchConfig {
+  unsigned width;
+  unsigned height;
+  unsigned renderers;
+  std::string encoder;
+  std::string preset;
+  std::size_t queue_size;
+  StereoLayout layout;
+  bool intra_refresh;
+  bool render_pacing;
+};
+
+// Parameters shared by every configuration.
+struct BenchCommon {
+  // Empty to skip the overlay.
+  std::string font;
+  std::string tune;
+  unsigned bitrate;
+  unsigned fps;
+  unsigned keyint;
+  MockRenderer::Options renderer;
+  double warmup_seconds;
+  double duration_seconds;
+};
+
+double process_cpu_seconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+std::string run_config(const BenchConfig &config, const BenchCommon &common) {
+  tlog::info() << "pipeline_bench: Running " << config.width << "x"
+               << config.height << ", " << config.renderers
+               << " renderer(s), " << config.encoder << " preset "
+               << config.preset << ", queue size " << config.queue_size
+               << ", stereo packing " << stereo_layout_name(config.layout)
+               << ", " << (config.intra_refresh ? "intra refresh" : "keyframes")
+               << ", " << (config.render_pacing ? "paced" : "free") << ".";
+
+  std::shared_ptr<RenderTextContext> etctx;
+  if (!common.font.empty()) {
+    etctx = std::make_shared<RenderTextContext>(common.font);
+  }
+  types::AVCodecContextManager::CodecInitInfo codec_info(
+      config.encoder, AV_PIX_FMT_YUV420P, config.preset, common.tune,
+      config.width, config.height, common.bitrate, common.fps, common.keyint,
+      config.intra_refresh);
+  auto session_manager = std::make_shared<SessionManager>(
+      codec_info, codec_info, etctx, 1, config.queue_size, config.layout,
+      BandwidthEstimator::Options{}, config.render_pacing);
+
+  std::array<std::shared_ptr<CountingSink>, Session::STREAM_COUNT> sinks;
+  std::array<Session::sink_list, Session::STREAM_COUNT> sink_lists;
+  for (int i = 0; i < Session::STREAM_COUNT; i++) {
+    sinks[i] = std::make_shared<CountingSink>();
+    sink_lists[i].push_back(sinks[i]);
+  }
+  session_manager->primary()->start(sink_lists);
+
+  std::vector<std::unique_ptr<MockRenderer>> renderers;
+  std::vector<std::string> addresses;
+  for (unsigned i = 0; i < config.renderers; i++) {
+    MockRenderer::Options options = common.renderer;
+    options.seed += i * 1000;
+    renderers.push_back(std::make_unique<MockRenderer>(options, 0));
+    addresses.push_back(renderers.back()->address());
+  }
+
+  std::atomic<bool> shutdown_requested{false};
+  std::thread socket_thread(socket_main_thread,
+                            std::make_shared<RendererList>(addresses),
+                            session_manager, std::ref(shutdown_requested));
+
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(common.warmup_seconds));
+
+  // A packed packet carries the frames of both eyes.
+  const unsigned frames_per_packet =
+      config.layout == StereoLayout::NONE ? 1 : 2;
+  auto count_frames = [&] {
+    return frames_per_packet * (sinks[Session::STREAM_SCENE_LEFT]->packets() +
+                                sinks[Session::STREAM_SCENE_RIGHT]->packets());
+  };
+  // The threads of the process but the renderers and the sinks, which stand in
+  // for the other hosts, run the pipeline. The benchmark thread sleeps.
+  auto pipeline_cpu_seconds = [&] {
+    double cpu = process_cpu_seconds();
+    for (const auto &renderer : renderers) {
+      cpu -= renderer->cpu_seconds();
+    }
+    for (const auto &sink : sinks) {
+      cpu -= sink->cpu_seconds();
+    }
+    return cpu;
+  };
+  auto count_bytes = [&] {
+    std::uint64_t bytes = 0;
+    for (const auto &sink : sinks) {
+      bytes += sink->bytes();
+    }
+    return bytes;
+  };
+
+  session_manager->latency_stats()->reset();
+  for (const auto &sink : sinks) {
+    sink->reset_sizes();
+  }
+  const std::uint64_t frames_begin = count_frames();
+  const std::uint64_t requested_begin = session_manager->requested_frames();
+  const std::uint64_t bytes_begin = count_bytes();
+  const double cpu_begin = pipeline_cpu_seconds();
+  const auto time_begin = std::chrono::steady_clock::now();
+
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(common.duration_seconds));
+
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - time_begin)
+                             .count();
+  const double cpu = pipeline_cpu_seconds() - cpu_begin;
+  const std::uint64_t frames = count_frames() - frames_begin;
+  const std::uint64_t requested =
+      session_manager->requested_frames() - requested_begin;
+  const std::uint64_t bytes = count_bytes() - bytes_begin;
+  // The scene stream of the left eye carries every packed frame as well.
+  const auto sizes = sinks[Session::STREAM_SCENE_LEFT]->sizes();
+
+  std::ostringstream result;
+  result << "{\"width\":" << config.width << ",\"height\":" << config.height
+         << ",\"renderers\":" << config.renderers << ",\"encoder\":\""
+         << config.encoder << "\",\"preset\":\""
+         << config.preset << "\",\"queue_size\":" << config.queue_size
+         << ",\"stereo_packing\":\"" << stereo_layout_name(config.layout)
+         << "\",\"refresh\":\""
+         << (config.intra_refresh ? "intra_refresh" : "keyframe") << "\""
+         << ",\"pacing\":\"" << (config.render_pacing ? "paced" : "free")
+         << "\""
+         << ",\"overlay\":" << (etctx ? "true" : "false")
+         << ",\"seconds\":" << seconds << ",\"frames\":" << frames
+         << ",\"fps\":" << frames / seconds
+         << ",\"requested_fps\":" << requested / seconds
+         << ",\"bitrate_kbps\":" << bytes * 8 / seconds / 1000
+         << ",\"cpu_ms_per_frame\":"
+         << (frames ? cpu * 1000 / frames : 0.0)
+         << ",\"scene_packet_bytes\":{\"mean\":" << sizes.mean_bytes
+         << ",\"stddev\":" << sizes.stddev_bytes
+         << ",\"max\":" << sizes.max_bytes
+         << ",\"max_to_mean\":"
+         << (sizes.mean_bytes ? sizes.max_bytes / sizes.mean_bytes : 0.0)
+         << ",\"packets\":" << sizes.packets
+         << ",\"keyframes\":" << sizes.keyframes << "}"
+         << ",\"scene_packet_interval_ms\":{\"mean\":"
+         << sizes.mean_interval_ms
+         << ",\"stddev\":" << sizes.stddev_interval_ms << "},\"latency_ms\":{";
+  for (int stage = 0; stage < LatencyStats::STAGE_COUNT; stage++) {
+    auto percentiles = session_manager->latency_stats()->percentiles(
+        static_cast<LatencyStats::Stage>(stage));
+    result << (stage ? "," : "") << "\""
+           << LatencyStats::stage_name(static_cast<LatencyStats::Stage>(stage))
+           << "\":{\"p50\":" << percentiles.p50_ms
+           << ",\"p99\":" << percentiles.p99_ms
+           << ",\"n\":" << percentiles.count << "}";
+  }
+  result << "}}";
+
+  // Closing the renderers unblocks the socket threads waiting for frames.
+  shutdown_requested = true;
+  renderers.clear();
+  socket_thread.join();
+  session_manager->stop_all();
+
+  return result.str();
+}
+
+// Run a configuration in a child process and add its peak RSS to the result.
+// The process is only forked before any thread is spawned.
+std::string run_isolated(const BenchConfig &config, const BenchCommon &common) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    throw std::runtime_error{std::string("Failed to create a pipe: ") +
+                             std::strerror(errno)};
+  }
+  const pid_t pid = fork();
+  if (pid < 0) {
+    const int error = errno;
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error{std::string("Failed to fork: ") +
+                             std::strerror(error)};
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    int status = 0;
+    try {
+      const std::string result = run_config(config, common);
+      std::size_t written = 0;
+      while (written < result.size()) {
+        const ssize_t n =
+            write(fds[1], result.data() + written, result.size() - written);
+        if (n <= 0) {
+          status = 1;
+          break;
+        }
+        written += n;
+      }
+    } catch (const std::exception &e) {
+      tlog::error() << "pipeline_bench: " << e.what();
+      status = 1;
+    }
+    close(fds[1]);
+    _exit(status);
+  }
+
+  close(fds[1]);
+  std::string result;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 ||
+         (n < 0 && errno == EINTR)) {
+    result.append(buffer, std::max<ssize_t>(n, 0));
+  }
+  close(fds[0]);
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0 || result.empty()) {
+    throw std::runtime_error{"The benchmark of a configuration failed."};
+  }
+  // The child starts with the small footprint of the parent, so its peak is
+  // that of the configuration.
+  result.insert(result.size() - 1,
+                ",\"peak_rss_kb\":" + std::to_string(usage.ru_maxrss));
+  return result;
+}
+
+// Parse "WIDTHxHEIGHT".
+std::pair<unsigned, unsigned> parse_resolution(const std::string &value) {
+  auto separator = value.find('x');
+  if (separator == std::string::npos) {
+    throw std::runtime_error{"Invalid resolution: " + value};
+  }
+  return {(unsigned)std::stoul(value.substr(0, separator)),
+          (unsigned)std::stoul(value.substr(separator + 1))};
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  ArgumentParser parser{
+      "ngp encode server end-to-end benchmark\n"
+      "Every combination of the repeated flags is run. Results are written "
+      "as one JSON object per line."};
+  HelpFlag help_flag{parser, "HELP", "Display help.", {'h', "help"}};
+  ValueFlagList<std::string> resolution_flag{
+      parser,
+      "RESOLUTION",
+      "Resolution as WIDTHxHEIGHT. default: 1280x720",
+      {"resolution"}};
+  ValueFlagList<unsigned int> renderers_flag{
+      parser, "RENDERERS", "Number of renderers. default: 2", {"renderers"}};
+  ValueFlagList<std::string> encoder_flag{
+      parser,
+      "ENCODER",
+      "Encoder of every stream, see --list_encoders of the server. default: "
+      "libx264",
+      {"encoder"}};
+  ValueFlagList<std::string> preset_flag{
+      parser, "PRESET", "Encode preset. default: ultrafast", {"preset"}};
+  ValueFlagList<unsigned int> queue_size_flag{
+      parser,
+      "QUEUE_SIZE",
+      "Size of the frame queues. default: 100",
+      {"queue_size"}};
+  ValueFlagList<std::string> stereo_packing_flag{
+      parser,
+      "STEREO_PACKING",
+      "Stereo packing {none, side_by_side, top_bottom}. default: none",
+      {"stereo_packing"}};
+  ValueFlagList<std::string> refresh_flag{
+      parser,
+      "REFRESH",
+      "Refresh of the pictures {keyframe, intra_refresh}. default: keyframe",
+      {"refresh"}};
+  ValueFlagList<std::string> pacing_flag{
+      parser,
+      "PACING",
+      "Render requests {free, paced}; paced requests frames at --fps per "
+      "eye. default: free",
+      {"pacing"}};
+  ValueFlag<std::string> tune_flag{
+      parser, "TUNE", "Encode tune.", {"tune"}, "stillimage,zerolatency"};
+  ValueFlag<unsigned int> bitrate_flag{
+      parser, "BITRATE", "Bitrate of each stream.", {"bitrate"}, 400000};
+  ValueFlag<unsigned int> fps_flag{
+      parser,
+      "FPS",
+      "Frame rate given to the encoder and the render pacing.",
+      {"fps"},
+      30};
+  ValueFlag<unsigned int> keyint_flag{
+      parser, "KEYINT", "Group of picture (GOP) size", {"keyint"}, 250};
+  ValueFlag<std::string> font_flag{
+      parser,
+      "FONT",
+      "Location of a font file used to render texts.",
+      {"font"},
+      "/usr/share/fonts/truetype/noto/NotoMono-Regular.ttf"};
+  Flag no_overlay_flag{parser,
+                       "NO_OVERLAY",
+                       "Do not draw the debug overlay.",
+                       {"no_overlay"}};
+  ValueFlag<std::string> distribution_flag{
+      parser,
+      "DISTRIBUTION",
+      "Distribution of the render latency {constant, uniform, normal, "
+      "lognormal}.",
+      {"latency_distribution"},
+      "constant"};
+  ValueFlag<double> latency_flag{
+      parser, "LATENCY_MS", "Mean render latency.", {"latency_ms"}, 10};
+  ValueFlag<double> jitter_flag{
+      parser, "JITTER_MS", "Jitter of the render latency.", {"jitter_ms"}, 0};
+  Flag noise_flag{parser,
+                  "NOISE",
+                  "Render noise instead of a gradient.",
+                  {"noise"}};
+  ValueFlag<double> warmup_flag{
+      parser, "WARMUP", "Seconds to run before measuring.", {"warmup"}, 3};
+  ValueFlag<double> duration_flag{
+      parser, "DURATION", "Seconds to measure.", {"duration"}, 10};
+  ValueFlag<std::string> output_flag{
+      parser,
+      "OUTPUT",
+      "File to append the results to. default: stdout",
+      {'o', "output"},
+      ""};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const Help &) {
+    std::cout << parser;
+    return 0;
+  } catch (const ParseError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -1;
+  } catch (const ValidationError &e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return -2;
+  }
+
+  try {
+    BenchCommon common;
+    if (!no_overlay_flag) {
+      common.font = get(font_flag);
+    }
+    common.tune = get(tune_flag);
+    common.bitrate = get(bitrate_flag);
+    common.fps = get(fps_flag);
+    common.keyint = get(keyint_flag);
+    common.renderer.distribution =
+        MockRenderer::parse_distribution(get(distribution_flag));
+    common.renderer.latency_ms = get(latency_flag);
+    common.renderer.jitter_ms = get(jitter_flag);
+    common.renderer.noise = static_cast<bool>(noise_flag);
+    common.warmup_seconds = get(warmup_flag);
+    common.duration_seconds = get(duration_flag);
+
+    std::vector<std::string> resolutions = get(resolution_flag);
+    std::vector<unsigned int> renderer_counts = get(renderers_flag);
+    std::vector<std::string> encoders = get(encoder_flag);
+    std::vector<std::string> presets = get(preset_flag);
+    std::vector<unsigned int> queue_sizes = get(queue_size_flag);
+    std::vector<StereoLayout> layouts;
+    for (const auto &name : get(stereo_packing_flag)) {
+      layouts.push_back(parse_stereo_layout(name));
+    }
+    std::vector<bool> refreshes;
+    for (const auto &name : get(refresh_flag)) {
+      if (name != "keyframe" && name != "intra_refresh") {
+        throw std::runtime_error{"Unknown refresh " + name +
+                                 ". Expected keyframe or intra_refresh."};
+      }
+      refreshes.push_back(name == "intra_refresh");
+    }
+    std::vector<bool> pacings;
+    for (const auto &name : get(pacing_flag)) {
+      if (name != "free" && name != "paced") {
+        throw std::runtime_error{"Unknown pacing " + name +
+                                 ". Expected free or paced."};
+      }
+      pacings.push_back(name == "paced");
+    }
+    if (resolutions.empty()) {
+      resolutions = {"1280x720"};
+    }
+    if (renderer_counts.empty()) {
+      renderer_counts = {2};
+    }
+    if (encoders.empty()) {
+      encoders = {"libx264"};
+    }
+    if (presets.empty()) {
+      presets = {"ultrafast"};
+    }
+    if (queue_sizes.empty()) {
+      queue_sizes = {FrameQueue::kFrameQueueMaxSize};
+    }
+    if (layouts.empty()) {
+      layouts = {StereoLayout::NONE};
+    }
+    if (refreshes.empty()) {
+      refreshes = {false};
+    }
+    if (pacings.empty()) {
+      pacings = {false};
+    }
+
+    std::ofstream file;
+    if (!get(output_flag).empty()) {
+      file.open(get(output_flag), std::ios::app);
+      if (!file) {
+        throw std::runtime_error{"Failed to open " + get(output_flag)};
+      }
+    }
+    std::ostream &out = file.is_open() ? file : std::cout;
+
+    for (const auto &resolution : resolutions) {
+      auto [width, height] = parse_resolution(resolution);
+      for (unsigned renderers : renderer_counts) {
+        for (const auto &encoder : encoders) {
+          for (const auto &preset : presets) {
+            for (unsigned queue_size : queue_sizes) {
+              for (StereoLayout layout : layouts) {
+                for (bool intra_refresh : refreshes) {
+                  for (bool render_pacing : pacings) {
+                    out << run_isolated({width, height, renderers, encoder,
+                                         preset, queue_size, layout,
+                                         intra_refresh, render_pacing},
+                                        common)
+                        << std::endl;
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  } catch (const std::exception &e) {
+    tlog::error() << "pipeline_bench: " << e.what();
+    return -1;
+  }
+  return 0;
+}